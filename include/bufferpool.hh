@@ -0,0 +1,73 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef BUFFERPOOL_HH
+#define BUFFERPOOL_HH
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+#include <boost/noncopyable.hpp>
+
+using namespace std;
+
+// smallest and largest relay buffers, the size classes are the powers of 4 in between
+#define BUFFER_MIN_SIZE (4 * 1024)
+#define BUFFER_MAX_SIZE (256 * 1024)
+#define BUFFER_CLASSES 4
+
+/**
+ * @class buffer_pool
+ * @brief The process-wide pool of relay buffers. Buffers come in a few size classes (4, 16, 64 and 256 KB); a
+ * connection asks for a larger class while it moves bulk data and a smaller one when its reads get short, and it
+ * gives its buffers back while it waits for data, so idle connections hold no buffer memory.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class buffer_pool : private boost::noncopyable {
+public:
+	static buffer_pool& instance();
+	
+	char* acquire(size_t size);
+	void release(char* buffer, size_t size);
+	
+	static size_t fit(size_t size);
+	static size_t grow(size_t size);
+	static size_t shrink(size_t size);
+	
+	size_t getAllocated() const { return allocated; }
+	size_t getInUse() const { return inUse; }
+	
+private:
+	buffer_pool();
+	~buffer_pool();
+	static int classOf(size_t size);
+	
+	vector<char*> freeList[BUFFER_CLASSES];
+	atomic<size_t> allocated;	// bytes obtained from the heap
+	atomic<size_t> inUse;		// bytes handed out to connections
+	mutex m;
+};
+
+#endif
@@ -0,0 +1,116 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef COALESCER_HH
+#define COALESCER_HH
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+using namespace std;
+
+/**
+ * @class shared_response
+ * @brief One response of a remote server fanned out to the clients which asked for the same resource while it
+ * was in flight. The connection which forwarded the request (the leader) appends the bytes it relays to its own
+ * client; the connections which joined (the followers) copy them to theirs, each from the start of the response.
+ * The bytes are kept from the start while others may join, which is until the response grows past the window;
+ * after that only the bytes some follower still needs are kept. The leader stops reading the remote server while
+ * a follower is more than the window behind.
+ * The leader and the followers run on different threads; a side which waits for the other is woken up through
+ * its waker.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class shared_response : private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<shared_response> pointer;
+	typedef boost::function<void ()> waker;
+	
+	enum state_type {
+		DATA,		// bytes were copied
+		WAIT,		// the leader has not relayed more yet, the follower is woken up when it does
+		END,		// the follower has the whole response
+		FAILED		// the leader gave up, the follower has to fetch the response itself
+	};
+	
+	shared_response(size_t window);
+	
+	// leader
+	bool append(const char* data, size_t len);
+	void finish();
+	void fail();
+	bool lagging(waker leader);
+	
+	// followers
+	int follow(waker follower);
+	size_t read(int id, char* buffer, size_t len, state_type& state);
+	size_t pending(int id);
+	void leave(int id);
+	
+private:
+	struct follower {
+		unsigned long long position;	// response offset of the next byte to copy
+		waker wake;
+		bool waiting;
+		bool active;
+	};
+	
+	void trim();
+	bool behind() const;
+	
+	size_t window;
+	string data_;						// the kept bytes
+	unsigned long long start_;			// response offset of the first kept byte
+	bool joinable;
+	bool finished;
+	bool failed;
+	vector<follower> followers_;
+	waker leader_;						// set while the leader waits for a follower
+	mutex m;
+};
+
+/**
+ * @class request_coalescer
+ * @brief The responses in flight of one proxy which other clients may still join, by request key.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class request_coalescer : private boost::noncopyable {
+public:
+	bool add(const string& key, shared_response::pointer response);
+	shared_response::pointer find(const string& key);
+	void remove(const string& key, shared_response::pointer response);
+	
+private:
+	map<string, shared_response::pointer> inFlight_;
+	mutex m;
+};
+
+#endif
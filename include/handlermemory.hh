@@ -0,0 +1,110 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef HANDLERMEMORY_HH
+#define HANDLERMEMORY_HH
+
+#include <cstddef>
+#include <new>
+
+#include <boost/noncopyable.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+
+/**
+ * @class handler_memory
+ * @brief Memory for the handler of one asynchronous operation at a time. A connection keeps one block per chain
+ * of operations it runs (e.g. the reads of one direction), so the operations of a long stream reuse the same block
+ * instead of allocating their handlers on the heap. Asio frees the memory of an operation before it calls the
+ * handler, so the next operation the handler starts finds the block free. A larger handler, or an operation which
+ * overlaps the running one, falls back to the heap.
+ * @author Vu Ba Tien Dung
+ *
+ */
+template <size_t Size>
+class handler_memory : private boost::noncopyable {
+public:
+	handler_memory() : inUse(false) {}
+	
+	void* allocate(size_t size) {
+		if (!inUse && size <= Size) {
+			inUse = true;
+			return storage.address();
+		}
+		return ::operator new(size);
+	}
+	
+	void deallocate(void* pointer) {
+		if (pointer == storage.address())
+			inUse = false;
+		else
+			::operator delete(pointer);
+	}
+	
+private:
+	boost::aligned_storage<Size> storage;
+	bool inUse;
+};
+
+/**
+ * @class alloc_handler
+ * @brief Wraps a completion handler so that Asio allocates the operation it belongs to from a handler_memory,
+ * through the asio_handler_allocate and asio_handler_deallocate hooks.
+ * @author Vu Ba Tien Dung
+ *
+ */
+template <typename Memory, typename Handler>
+class alloc_handler {
+public:
+	alloc_handler(Memory& memory, const Handler& handler) : memory(memory), handler(handler) {}
+	
+	void operator()() { handler(); }
+	template <typename Arg1>
+	void operator()(const Arg1& arg1) { handler(arg1); }
+	template <typename Arg1, typename Arg2>
+	void operator()(const Arg1& arg1, const Arg2& arg2) { handler(arg1, arg2); }
+	
+	friend void* asio_handler_allocate(size_t size, alloc_handler<Memory, Handler>* self) {
+		return self->memory.allocate(size);
+	}
+	
+	friend void asio_handler_deallocate(void* pointer, size_t, alloc_handler<Memory, Handler>* self) {
+		self->memory.deallocate(pointer);
+	}
+	
+private:
+	Memory& memory;
+	Handler handler;
+};
+
+/**
+ * @param memory the block the operation is allocated from, it must outlive the operation
+ * @param handler the completion handler
+ * @return the handler, allocating from memory
+ *
+ */
+template <typename Memory, typename Handler>
+inline alloc_handler<Memory, Handler> make_alloc_handler(Memory& memory, const Handler& handler) {
+	return alloc_handler<Memory, Handler>(memory, handler);
+}
+
+#endif
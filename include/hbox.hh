@@ -52,6 +52,11 @@ THE SOFTWARE.
 #include "hboxinfo.hh"
 #include "upnpdevice.hh"
 #include "event.hh"
+#include "iopool.hh"
+#include "rangecache.hh"
+#include "metrics.hh"
+#include "tunnel.hh"
+#include "warmup.hh"
 
 using namespace std;
 using namespace log4cpp;
@@ -60,8 +65,6 @@ namespace ba=boost::asio;
 namespace bs=boost::system;
 
 typedef boost::shared_ptr<ba::ip::tcp::socket> socket_ptr;
-typedef boost::shared_ptr<ba::io_service> io_service_ptr;
-typedef deque<io_service_ptr> ios_deque;
 
 // Helper functions for logging
 #define HBOX_DEBUG(a) hbox::log \
@@ -133,9 +136,18 @@ private:
 	list<hbox_info*> remote_hbox_es;
 	int maxPort;
 	
-	boost::thread_group thr_grp;
-	deque<ba::io_service::work> io_service_work;
+	// one I/O pool shared by all proxy servers
+	io_service_pool ioPool;
 	int THREAD_NUM;	
+	proxy_settings proxySettings;
+	int metricsPort;
+	metrics_server::pointer metricsServer;
+	int frontPort;
+	tcp_proxy_server::pointer frontDoor;	// one HTTP port for the media servers of all remote hboxes, empty if disabled
+	route_table::pointer routes;
+	int tunnelPort;
+	tunnel_server::pointer tunnelServer;	// carries the streams remote hboxes open to the local media servers
+	map<string, tunnel_client::pointer> tunnels;	// to each remote hbox, by its name
 	
 public:
 	// the file which contains username and password of the xmppclient
@@ -170,6 +182,7 @@ public:
 	void newRemoteUPnPService(event&);
 	void startRemoteUPnPDevice(event&);
 	void delRemoteUPnPDevice(event&);
+	void closeTunnel(const string& hboxName);
 	void saveSourceHboxToDescription(string&, const string&);
 	
 	void sendAction(event& temp);
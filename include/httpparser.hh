@@ -0,0 +1,126 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef HTTPPARSER_HH
+#define HTTPPARSER_HH
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+
+using namespace std;
+
+/**
+ * @class http_head
+ * @brief The start line and the header fields of one HTTP message.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class http_head {
+public:
+	string method;		// request only
+	string uri;			// request only
+	string version;
+	int status;			// response only
+	string reason;		// response only
+	vector<pair<string, string> > fields;
+	string raw;			// the head exactly as it was received
+
+	http_head() : status(0) {}
+	
+	void clear();
+	bool parse(const string& text, bool request);
+	
+	string get(const string& name) const;
+	bool has(const string& name) const;
+	bool hasToken(const string& name, const string& token) const;
+	bool getRange(long long& first, long long& last) const;
+	bool getContentRange(long long& first, long long& last, long long& total) const;
+	void set(const string& name, const string& value);
+	void erase(const string& name);
+	string text() const;
+};
+
+/**
+ * @class http_parser
+ * @brief An incremental HTTP/1.x framer. It follows a byte stream in one direction of a proxy connection and
+ * reports where message heads, bodies and message ends are, without buffering the bodies. A response parser must be
+ * told the method of every request with expect_response() so that it knows which responses have no body.
+ * The bytes of a head are held by the parser until the head is complete (see held()); body bytes, chunk framing
+ * included, are reported as they come.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class http_parser {
+public:
+	enum event_type {
+		NEED_MORE,	// all input was consumed
+		HEAD,		// a message head is complete, see head()
+		BODY,		// the consumed bytes belong to a message body, chunk framing included
+		END,		// the current message is complete
+		ERROR		// the stream is not HTTP, the parser stays in this state
+	};
+	
+	http_parser(bool request);
+	
+	event_type parse(const char* data, size_t len, size_t& used);
+	void expect_response(const string& method);
+	void reset();
+	
+	const http_head& head() const { return head_; }
+	const string& held() const { return line_; }
+	bool idle() const;
+	bool keepAlive() const { return keepAlive_; }
+	bool chunked() const { return state_ >= S_CHUNK_SIZE && state_ <= S_TRAILER; }
+	bool untilClose() const { return state_ == S_UNTIL_CLOSE; }
+	bool failed() const { return state_ == S_FAILED; }
+	size_t pending() const { return expected_.size(); }
+	
+private:
+	enum parse_state {
+		S_HEAD,
+		S_LENGTH,
+		S_CHUNK_SIZE,
+		S_CHUNK_DATA,
+		S_CHUNK_END,
+		S_TRAILER,
+		S_UNTIL_CLOSE,
+		S_DONE,
+		S_FAILED
+	};
+	
+	void start_body();
+	bool plausible(char c) const;
+	
+	bool request_;
+	parse_state state_;
+	http_head head_;
+	string line_;					// partial head
+	string chunk_;					// partial chunk size or trailer line
+	unsigned long long remaining_;	// body or chunk bytes left
+	bool keepAlive_;
+	deque<string> expected_;		// methods of the requests which wait for a response
+};
+
+#endif
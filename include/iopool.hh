@@ -0,0 +1,69 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef IOPOOL_HH
+#define IOPOOL_HH
+
+#include <deque>
+#include <atomic>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/noncopyable.hpp>
+
+using namespace std;
+
+namespace ba=boost::asio;
+
+typedef boost::shared_ptr<ba::io_service> io_service_ptr;
+typedef deque<io_service_ptr> ios_deque;
+
+/**
+ * @class io_service_pool
+ * @brief A process-wide pool of io_services shared by all proxy servers. Every io_service is run by exactly one
+ * thread, so the handlers of a connection never run concurrently. The pool is sized to the number of cores by default.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class io_service_pool : private boost::noncopyable {
+public:
+	io_service_pool();
+	~io_service_pool();
+	
+	void start(size_t pool_size = 0);
+	void stop();
+	void join();
+	
+	ba::io_service& get_io_service();
+	const ios_deque& get_io_services() const { return io_services_; }
+	size_t size() const { return io_services_.size(); }
+
+private:
+	ios_deque io_services_;
+	deque<ba::io_service::work> work_;
+	boost::thread_group threads_;
+	atomic<size_t> next_;
+};
+
+#endif
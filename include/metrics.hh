@@ -0,0 +1,177 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef METRICS_HH
+#define METRICS_HH
+
+#include <string>
+#include <list>
+#include <ostream>
+#include <mutex>
+#include <atomic>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "trafficclass.hh"
+
+using namespace std;
+
+namespace ba=boost::asio;
+namespace bs=boost::system;
+
+// bucket i of a histogram counts the values below 2^i
+#define HISTOGRAM_BUCKETS 40
+// seconds before the metrics port accepts again after a failed accept
+#define METRICS_ACCEPT_RETRY 1
+
+/**
+ * @return a monotonic clock in microseconds, for measuring durations
+ *
+ */
+unsigned long long metrics_now();
+
+/**
+ * @class histogram
+ * @brief A lock-free histogram with power-of-two buckets. Percentiles are reported as the upper bound of the bucket
+ * they fall in, which is precise enough to tell a slow link from a slow server.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class histogram : private boost::noncopyable {
+public:
+	histogram();
+	
+	void record(unsigned long long value);
+	unsigned long long percentile(double p) const;
+	unsigned long long getCount() const { return count; }
+	unsigned long long getSum() const { return sum; }
+	
+	void report(ostream& out, const string& name, const string& labels) const;
+	
+private:
+	atomic<unsigned long long> buckets[HISTOGRAM_BUCKETS];
+	atomic<unsigned long long> count;
+	atomic<unsigned long long> sum;
+};
+
+/**
+ * @class proxy_metrics
+ * @brief Traffic counters of one proxy server. Connections update them from any I/O thread without locking.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class proxy_metrics : private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<proxy_metrics> pointer;
+	
+	proxy_metrics(int port, const string& target, const string& peer);
+	
+	const int port;				// listening port
+	const string target;		// forwarding address and port
+	const string peer;			// the hbox the remote server belongs to, empty for local servers
+	
+	atomic<unsigned long> accepted;
+	atomic<unsigned long> rejected;				// connections refused by the connection limits
+	atomic<unsigned long> idleTimeouts;
+	atomic<unsigned long> readTimeouts;
+	atomic<unsigned long> active;				// connections currently open
+	atomic<unsigned long> tunneled;				// connections to the remote server carried by the tunnel to its hbox
+	atomic<unsigned long> connectFailures;
+	atomic<unsigned long> resumed;				// responses whose rest was fetched again after the remote server dropped
+	atomic<unsigned long> upstreamReused;		// connections served by a pooled upstream
+	atomic<unsigned long> warmed;				// upstreams connected ahead of any client and parked in the pool
+	atomic<unsigned long> requests;				// requests forwarded to the remote server
+	atomic<unsigned long> localResponses;		// requests answered by the range cache or the read-ahead
+	atomic<unsigned long> coalesced;			// requests which joined the response to an identical request
+	atomic<unsigned long> rewritten;			// responses whose URLs were rewritten for the local clients
+	atomic<unsigned long> responses[TRAFFIC_CLASSES];	// responses relayed, by traffic class
+	atomic<unsigned long> readPauses;			// a direction reached its high watermark
+	atomic<unsigned long> readResumes;			// a paused direction went down to its low watermark
+	atomic<unsigned long long> bytesToServer;
+	atomic<unsigned long long> bytesToClient;
+	atomic<unsigned long> tuningFailures;		// socket options the kernel refused
+	atomic<unsigned long> receiveBuffer;		// SO_RCVBUF the kernel granted the last tuned socket
+	atomic<unsigned long> sendBuffer;			// SO_SNDBUF the kernel granted the last tuned socket
+	string congestion;			// the congestion control asked for, set before the metrics are registered
+	
+	histogram connectTime;		// microseconds to connect the remote server
+	histogram firstByte;		// microseconds from a request to the head of its response
+	histogram throughput;		// bytes per second sent to the client by each finished connection
+	
+	void report(ostream& out) const;
+};
+
+/**
+ * @class metrics_registry
+ * @brief The process-wide list of proxy metrics, and the text report of them together with the shared buffer
+ * pool and range cache. A proxy drops out of the report when its last connection is gone.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class metrics_registry : private boost::noncopyable {
+public:
+	static metrics_registry& instance();
+	
+	void add(proxy_metrics::pointer metrics);
+	void report(ostream& out);
+	
+	atomic<unsigned long> activeConnections;	// open connections of all proxies
+	
+private:
+	metrics_registry() : activeConnections(0) {}
+	
+	list<boost::weak_ptr<proxy_metrics> > proxies;
+	mutex m;
+};
+
+/**
+ * @class metrics_server
+ * @brief Answers every HTTP request on a loopback port with the metrics report, so that the numbers can be
+ * fetched with curl or scraped by a monitoring system.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class metrics_server : public boost::enable_shared_from_this<metrics_server>, private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<metrics_server> pointer;
+	
+	static pointer create(ba::io_service& io_service, int port);
+	void close();
+	
+private:
+	metrics_server(ba::io_service& io_service, int port);
+	void start_accept();
+	void handle_accept(boost::shared_ptr<ba::ip::tcp::socket> socket, const bs::error_code& err);
+	void handle_retry(const bs::error_code& err);
+	void handle_close();
+	
+	ba::io_service& io_service_;
+	ba::ip::tcp::acceptor acceptor_;
+	ba::deadline_timer retry_;		// accepts again after a failed accept
+};
+
+#endif
@@ -30,20 +30,200 @@ THE SOFTWARE.
 #include <boost/lexical_cast.hpp>
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/weak_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/bind.hpp>
 #include <boost/thread/thread.hpp>
-#include <boost/array.hpp>
+#include <boost/circular_buffer.hpp>
+
+#include "proxycontext.hh"
+#include "httpparser.hh"
+#include "bufferpool.hh"
+#include "rangecache.hh"
+#include "routetable.hh"
+#include "uringengine.hh"
+#include "handlermemory.hh"
+#include "urlrewriter.hh"
 
 using namespace std;
 
 namespace ba=boost::asio;
 namespace bs=boost::system;
 
+// most chunks gathered into one write
+#define RELAY_GATHER 64
+// chunks a direction has room for before its queue grows
+#define RELAY_QUEUE 16
+// memory kept for the handler of each chain of asynchronous operations of a connection
+#define RELAY_HANDLER_MEMORY 1024
+
+
+/**
+ * @class relay_chunk
+ * @brief A piece of data waiting to be written to one side of a connection. It either points into a pooled read
+ * buffer, which the last chunk referring to it gives back, or holds its own text (message heads, local responses).
+ * The text lives on the heap, so the bytes a running write points to stay put when the queue grows and moves its
+ * chunks.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class relay_chunk {
+public:
+	const char* data;
+	size_t len;
+	char* buffer;			// pooled buffer released once this chunk is written, NULL if none
+	size_t bufferSize;
+	boost::shared_ptr<const string> text;
+	
+	relay_chunk() : data(NULL), len(0), buffer(NULL), bufferSize(0) {}
+	ba::const_buffer bytes() const { return text ? ba::buffer(*text) : ba::buffer(data, len); }
+	size_t size() const { return text ? text->size() : len; }
+};
+
+/**
+ * @class buffer_range
+ * @brief A buffer sequence over buffers kept by its owner, so that an asynchronous write does not copy its list.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class buffer_range {
+public:
+	typedef ba::const_buffer value_type;
+	typedef const ba::const_buffer* const_iterator;
+	
+	buffer_range(const_iterator first, const_iterator last) : first(first), last(last) {}
+	const_iterator begin() const { return first; }
+	const_iterator end() const { return last; }
+	
+private:
+	const_iterator first;
+	const_iterator last;
+};
+
+/**
+ * @class relay_direction
+ * @brief One direction of a connection: the read buffer of its source socket and the queue of data waiting for
+ * its destination socket. The queue is a ring which only grows, so a steady stream does not allocate.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class relay_direction {
+public:
+	boost::circular_buffer<relay_chunk> queue;
+	ba::const_buffer gather[RELAY_GATHER];	// the buffers of the running write
+	size_t queued;			// bytes in queue
+	size_t inFlight;		// chunks of the queue handed to the running write
+	bool reading;			// waiting for the source socket
+	bool writing;
+	bool finished;			// the source reached its end of stream
+	bool shut;				// the end of stream was passed on to the destination
+	bool paused;			// reading stopped at the high watermark
+	char* buffer;			// pooled read buffer, NULL while waiting for data
+	size_t size;			// size class of buffer
+	size_t want;			// size class for the next read
+	unsigned long long lastRead;	// when data last came from the source, see metrics_now()
+	handler_memory<RELAY_HANDLER_MEMORY> readMemory;	// for the reads of the source
+	handler_memory<RELAY_HANDLER_MEMORY> writeMemory;	// for the writes of the destination
+	
+	relay_direction() : queue(RELAY_QUEUE) { reset(); }
+	bool drained() const { return queue.empty() && !writing; }
+	
+	// starts over with another source, the queue must be empty; operations still running keep their memory
+	void reset() {
+		queued = inFlight = 0;
+		reading = writing = finished = shut = paused = false;
+		buffer = NULL;
+		size = 0;
+		want = BUFFER_MIN_SIZE;
+		lastRead = 0;
+	}
+};
+
+/**
+ * @class http_exchange
+ * @brief A request forwarded to the remote server whose response has not ended yet.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class http_exchange {
+public:
+	http_head request;
+	bool widened;				// the read-ahead asked the remote server for a larger range
+	long long first;			// the range the client asked for, when widened
+	long long last;
+	long long owed;				// body bytes still owed to the client, -1 before the response head
+	unsigned long long sent;	// when the request was queued, see metrics_now()
+	string base;				// where the client reaches the remote server, empty if URLs are not rewritten
+	bool resumable;				// the rest of the body can be asked for again if the remote server drops
+	long long resumeFrom;		// resource offset of the next body byte, when resumable
+	long long resumeTo;			// resource offset of the last body byte
+	long long total;			// size of the resource
+	string validator;			// the ETag or Last-Modified the rest must come from
+	int resumes;				// reconnects for this response
+	
+	http_exchange(const http_head& request) : request(request), widened(false), first(0), last(0), owed(-1),
+											  sent(metrics_now()), resumable(false), resumeFrom(0), resumeTo(0),
+											  total(0), resumes(0) {}
+};
+
+/**
+ * @class read_ahead
+ * @brief The bytes of a resource a connection fetched ahead of what the client asked for. Small Range requests
+ * are widened to the read-ahead window and the client is given what it asked for; its next requests are answered
+ * from here, also while the rest of the window is still arriving.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class read_ahead {
+public:
+	string key;
+	long long total;
+	unsigned long long start;	// resource offset of the first byte in data
+	unsigned long long end;		// resource offset past the last byte the remote server sends
+	string data;
+	http_head head;				// the response head local responses are made from
+	
+	read_ahead() : total(-1), start(0), end(0) {}
+	// whether the window holds the range; its bytes may not all have arrived yet, see received()
+	bool covers(const string& key, long long first, long long last) const {
+		return key == this->key && end > start && first >= (long long) start && last < (long long) end;
+	}
+	// resource offset past the last byte which arrived
+	unsigned long long received() const { return start + data.size(); }
+	void clear() { key.clear(); data.clear(); start = end = 0; total = -1; }
+};
 
 /**
  * @class tcp_connection
  * @brief TCP connection implements an asynchronous socket of Boost::ASIO library.
+ * The connection relays in full duplex: one pump copies client data to the remote server and another one copies
+ * server data back to the client. Each pump forwards the end of stream as a half-close and the connection is closed
+ * once both directions are finished.
+ * In buffered mode both directions are followed by HTTP parsers and each pump queues what it read for the other
+ * side. When the client leaves after complete keep-alive exchanges, the connection to the remote server is parked in
+ * the upstream pool of the proxy instead of being closed. Requests the range cache can answer are served from disk
+ * without reaching the remote server, and cacheable responses are stored on their way to the client.
+ * Buffered pumps wait for readability before they take a buffer from the buffer pool, and give it back once the data
+ * is written, so a connection only holds buffers while it moves data. The buffer size follows the size of the reads.
+ * A connection of the front door is not tied to one remote server: each request picks its remote server by its path
+ * prefix, and between exchanges the connection moves to another remote server when the client asks for one.
+ * The packets of both sockets are marked with the traffic class of the current exchange, which the request
+ * method and the response content type tell, so that control exchanges are not queued behind media streams.
+ * Identical GETs which arrive while the response to the first one is in flight are not forwarded: the connection
+ * which forwarded it shares the response, and the others relay it to their clients from there.
+ * URLs of the remote server in the Location of responses and in text bodies are rewritten to the address the
+ * client used, so that playlists and redirects do not send it to the remote network. Rewritten bodies are relayed
+ * chunked and are neither cached nor shared.
+ * The candidate addresses of the remote server are connected in a staggered race and the first to answer is used,
+ * so an unreachable address does not hold the connection until the connect times out.
+ * When the remote server drops, or stalls for the read timeout, in the middle of a GET response with a known length,
+ * the connection asks a new connection for the rest with a Range request and relays it as the continuation of the
+ * body, so the client does not notice the WAN blip.
+ * A draining connection closes as soon as it is between exchanges and answers new requests with 503; one which
+ * cannot tell its exchanges apart, or takes longer than the drain timeout, is closed at the drain timeout.
+ * In uring mode each pump holds one buffer, registered with the io_uring of its thread when one is free, for as long
+ * as the connection is connected: a read into it is always pending, so the buffer cannot be given back in between.
  * @author Vu Ba Tien Dung
  *
  */
@@ -51,43 +231,165 @@ class tcp_connection : public boost::enable_shared_from_this<tcp_connection> {
 public:
 	typedef boost::shared_ptr<tcp_connection> pointer;
 
-	static pointer create(ba::io_service& io_service, string forwardIP, int forwardPort) {
-		return pointer(new tcp_connection(io_service, forwardIP, forwardPort));
+	static pointer create(ba::io_service& io_service, proxy_context::pointer context) {
+		return pointer(new tcp_connection(io_service, context));
 	}
+	
+	~tcp_connection();
 
 	ba::ip::tcp::socket& socket() {
 		return csocket_;
 	}
 
 	void start();
+	void check_timeouts();
+	void drain();
 
 private:
-	tcp_connection(ba::io_service& io_service, string forwardIP, int forwardPort);
+	tcp_connection(ba::io_service& io_service, proxy_context::pointer context);
+	void handle_start();
+	void handle_check_timeouts();
+	void handle_drain();
 	void shutdown();
-	void start_connect(size_t len);
+	void half_close(ba::ip::tcp::socket& socket);
+	void handle_end_of_stream(bool toServer);
+	void update_close_state();
+	void start_connect();
+	
+	relay_direction& flow(bool toServer) { return toServer ? cflow : sflow; }
+	
+	// buffered pumps, toServer selects the direction
+	void start_read(bool toServer);
+	void handle_readable(const bs::error_code& err, bool toServer, unsigned generation);
+	size_t read_available(bool toServer, bs::error_code& err);
+	void release_buffer(bool toServer);
+	void process(bool toServer, size_t len);
+	void enqueue(bool toServer, const char* data, size_t len);
+	void enqueue(bool toServer, const string& text);
+	void flush(bool toServer);
+	void handle_write(const bs::error_code& err, size_t len, bool toServer);
+	
+	// HTTP tracking for the upstream pool and the range cache
+	bool on_request_head(size_t rest);
+	bool route_request();
+	void reply_error(const string& status);
+	bool serve_ahead(const http_head& request);
+	bool widen_request(const http_head& request);
+	bool on_response_head();
+	void prepare_resume(http_exchange& x, const http_head& response);
+	bool resume_upstream();
+	void handle_resume(const bs::error_code& err, unsigned generation);
+	void on_resumed_head(const char*& data, size_t& len);
+	bool on_response_body(const char* data, size_t len);
+	bool client_answered() const;
+	size_t high_watermark(bool toServer) const;
+	size_t low_watermark(bool toServer) const;
+	void on_response_end();
+	void stop_tracking();
+	bool upstream_reusable();
+	void recycle_upstream();
+	string cache_key(const http_head& request) const;
+	void feed_local();
+	void set_traffic_class(traffic_class c);
+	string rewrite_base(const http_head& request) const;
+	bool rewrite_response(const http_exchange& x);
+	void enqueue_rewritten(const string& text);
+	
+	// sharing a response with identical requests
+	string share_key(const http_head& request) const;
+	bool shareable(const http_head& request) const;
+	void offer_shared(const http_head& request);
+	bool follow_shared(const http_head& request);
+	bool feed_shared();
+	void withdraw_shared();
+	void abandon_shared();
+	void leave_shared();
+	static void wake(boost::weak_ptr<tcp_connection> connection);
+	void handle_wake();
+	
+	// zero-copy pumps, toServer selects the direction
+	bool open_splice_pipes();
+	void start_splice_read(bool toServer);
+	void handle_splice_read(const bs::error_code& err, bool toServer);
+	void flush_splice(bool toServer);
+	void handle_splice_write(const bs::error_code& err, bool toServer);
+	
+	// io_uring pumps, toServer selects the direction
+	void start_uring_read(bool toServer);
+	void handle_uring_read(int result, bool toServer);
+	void flush_uring(bool toServer);
+	void handle_uring_write(int result, bool toServer);
 	
-	void handle_client_write(const bs::error_code& err, size_t len);
-	void handle_client_read_data(const bs::error_code& err, size_t len);
-	void handle_server_write(const bs::error_code& err, size_t len);
-	void handle_server_read_data(const bs::error_code& err, size_t len);
-	void start_forward_to_server(size_t len);
 	void handle_resolve(const boost::system::error_code& err,
-									ba::ip::tcp::resolver::iterator endpoint_iterator, size_t len);
-	void handle_connect(const boost::system::error_code& err,
-									ba::ip::tcp::resolver::iterator endpoint_iterator, size_t len);
+									ba::ip::tcp::resolver::iterator endpoint_iterator, unsigned generation);
+	void race_next();
+	void handle_race(const boost::system::error_code& err, size_t index, unsigned generation);
+	void handle_stagger(const boost::system::error_code& err, unsigned generation);
+	void stop_racing();
+	void handle_connect(const boost::system::error_code& err);
 
 	ba::io_service& io_service_;
+	proxy_context::pointer home_;	// the context of the proxy server which accepted the connection
+	proxy_context::pointer context_;// the context of the remote server, home_ until the front door picks a route
 	ba::ip::tcp::socket csocket_;	// socket to client
 	ba::ip::tcp::socket ssocket_;	// socket to remote server
 	ba::ip::tcp::resolver resolver_;
-	bool proxy_closed;
+	endpoint_list endpoints_;		// candidates for the remote server
+	vector<boost::shared_ptr<ba::ip::tcp::socket> > racers_;	// the connects in flight, by candidate
+	ba::deadline_timer stagger_;	// starts the next candidate while the earlier ones still connect
+	size_t raced;					// candidates started
+	size_t racing;					// connects in flight
+	bool isTunneled;				// the candidate is the tunnel portal, not the remote server
 	bool isOpened;
-	bool isPersistent;
-	int forwardPort;
-	string forwardIP;
-
-	boost::array<char, 8192> cbuffer;
-	boost::array<char, 8192> sbuffer;
+	bool isFailed;					// the remote server could not be connected
+	bool isClosed;
+	bool isDraining;				// the connection closes once it is between exchanges
+	unsigned long long drainStart;	// when draining started, see metrics_now()
+	relay_mode mode;
+	unsigned generation_;			// counts the connections to remote servers, reads of earlier ones are ignored
+	
+	relay_direction cflow;			// client -> server
+	relay_direction sflow;			// server -> client
+	
+	bool isTracking;				// both directions are parsed as HTTP
+	http_parser requests;
+	http_parser responses;
+	http_parser resumed_;			// the head of the response which brings the rest of a dropped one
+	bool isResuming;				// the rest of the current response is asked for on a new connection
+	ba::deadline_timer resumer_;	// the delay before the next reconnect
+	http_head routed_;				// the current request of a front door connection, without its route prefix
+	deque<http_exchange> exchanges;	// forwarded requests which wait for their response
+	read_ahead ahead_;
+	cache_fill fill_;				// stores the body of the current response
+	cache_hit local_;				// the response being served from the range cache
+	bool isServingLocal;
+	traffic_class trafficClass;		// what the current exchange carries, TRAFFIC_CLASSES before the first one
+	url_rewriter rewriter_;			// rewrites the body of the current response
+	
+	shared_response::pointer shared_;	// the response this connection shares with identical requests
+	string sharedKey;				// its key while other requests may still join it
+	bool isHeldBack;				// the remote server is not read until a follower catches up
+	shared_response::pointer following_;// the response this connection relays instead of forwarding its request
+	int followId;
+	http_head followRequest;		// forwarded after all if the response cannot be followed
+	unsigned long long followed;	// bytes of it queued for the client
+	shared_response::waker waker_;
+	
+	unsigned long long startTime;	// when the connection started, 0 before, see metrics_now()
+	unsigned long long connectStart;// when the connect to the remote server started, 0 for a pooled upstream
+	unsigned long long clientBytes;	// bytes written to the client
+	unsigned long long lastActivity;// when data last moved in either direction
+	
+	int cpipe[2];					// client -> server pipe in splice mode
+	int spipe[2];					// server -> client pipe in splice mode
+	size_t cpipe_pending;			// bytes held in cpipe
+	size_t spipe_pending;			// bytes held in spipe
+	
+	uring_engine* uring_;			// the io_uring of the io_service in uring mode
+	char* ubuffer[2];				// buffer of each direction in uring mode, client -> server first
+	int uslot[2];					// its registered buffer index, -1 for a pooled buffer
+	size_t uheld[2];				// bytes read into it
+	size_t usent[2];				// bytes of them written
 };
 
 #endif
@@ -0,0 +1,125 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef PROXYCONTEXT_HH
+#define PROXYCONTEXT_HH
+
+#include <string>
+#include <atomic>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "configfile.hh"
+#include "upstreampool.hh"
+#include "resolvercache.hh"
+#include "metrics.hh"
+#include "coalescer.hh"
+#include "trafficclass.hh"
+#include "sockettuning.hh"
+#include "tunnel.hh"
+
+using namespace std;
+
+class route_table;
+
+/**
+ * How a connection moves bytes between the client and the remote server.
+ * RELAY_SPLICE moves them with splice() through a kernel pipe so that payloads never enter user space; it is only
+ * available on Linux and falls back to RELAY_BUFFERED elsewhere or when the pipes cannot be created.
+ * RELAY_URING reads and writes through an io_uring per I/O thread, which batches the system calls of all its
+ * connections; it falls back to RELAY_BUFFERED when the kernel or the build has no io_uring.
+ * Only RELAY_BUFFERED follows the connections as HTTP, the other modes relay the bytes as they are.
+ */
+enum relay_mode {
+	RELAY_BUFFERED,
+	RELAY_SPLICE,
+	RELAY_URING
+};
+
+/**
+ * @class proxy_settings
+ * @brief Tunables of the proxy servers. They are read from the optional [proxy] keys of the configuration file.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class proxy_settings {
+public:
+	relay_mode mode;
+	int upstreamPoolSize;		// idle connections kept per remote server
+	int upstreamIdleTimeout;	// seconds an idle connection to a remote server is kept
+	int warmConnections;		// idle connections kept open to a remote server before any client asks for it
+	int resolveTtl;				// seconds the resolved forward target is reused
+	int connectStagger;			// milliseconds before the next candidate of the remote server is raced, 0 waits for failures
+	string cacheDir;			// directory of the range cache, empty to disable it
+	int cacheSize;				// megabytes the range cache may use
+	bool useRangeCache;			// answer and store requests with the range cache
+	size_t prefetchWindow;		// bytes read ahead of the client on remote media streams
+	size_t coalesceWindow;		// bytes of a response other clients may join, and may fall behind, 0 to disable
+	size_t highWatermark;		// queued bytes which pause reading a direction
+	size_t lowWatermark;		// queued bytes at which a paused direction is read again
+	int maxConnections;			// open connections per proxy, 0 for no limit
+	int maxTotalConnections;	// open connections of all proxies, 0 for no limit
+	int idleTimeout;			// seconds a connection may move no data, 0 for no limit
+	int readTimeout;			// seconds a connection may wait for data it is owed, 0 for no limit
+	int resumeAttempts;			// reconnects of a remote server which dropped in the middle of a response, 0 to give up
+	int drainTimeout;			// seconds the connections of a removed proxy may take to finish their exchanges
+	bool reusePort;				// one SO_REUSEPORT acceptor per I/O thread
+	bool rewriteUrls;			// rewrite the URLs remote servers give in redirects, documents and playlists
+	int dscp[TRAFFIC_CLASSES];	// code point the packets of each traffic class are marked with, -1 for none
+	socket_tuning tuning;		// the options of the listening, client and upstream sockets
+	
+	proxy_settings();
+	void load(const ConfigFile& cf);
+};
+
+/**
+ * @class proxy_context
+ * @brief The state one tcp_proxy_server shares with its connections: where to forward and the resources reused
+ * between connections. Connections hold it by shared pointer so it stays valid as long as any of them runs.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class proxy_context : private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<proxy_context> pointer;
+	
+	proxy_context(const string& forwardIP, int forwardPort, const proxy_settings& settings, int listeningPort = 0,
+				  const string& peer = "", int originPort = 0);
+	
+	const string forwardIP;
+	const int forwardPort;
+	const proxy_settings settings;
+	const int originPort;		// the port of the remote server in its own network, 0 if its URLs are not rewritten
+	const string peer;			// the hbox the remote server belongs to, empty for a local server
+	
+	upstream_pool upstreams;
+	resolver_cache resolved;
+	request_coalescer coalescer;
+	proxy_metrics::pointer metrics;
+	boost::shared_ptr<route_table> routes;	// set for the front door, whose connections pick a remote server per request
+	tunnel_portal::pointer tunnel;	// set when the remote server is reached through the tunnel to its hbox
+	atomic<bool> retired;		// the device of the remote server is gone, its connections drain
+};
+
+#endif
@@ -25,14 +25,22 @@ THE SOFTWARE.
 
 #include <deque>
 #include <string>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <atomic>
 
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
 #include <boost/thread/thread.hpp>
 
 #include "proxyconnection.hh"
+#include "iopool.hh"
+#include "routetable.hh"
 
 using namespace std;
 
@@ -40,28 +48,76 @@ namespace ba=boost::asio;
 namespace bs=boost::system;
 
 typedef boost::shared_ptr<ba::ip::tcp::socket> socket_ptr;
-typedef boost::shared_ptr<ba::io_service> io_service_ptr;
-typedef deque<io_service_ptr> ios_deque;
+
+/**
+ * @class proxy_acceptor
+ * @brief One listening socket of a proxy server and the io_service it accepts on.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class proxy_acceptor {
+public:
+	typedef boost::shared_ptr<proxy_acceptor> pointer;
+	
+	proxy_acceptor(ba::io_service& io_service) : io_service(io_service), acceptor(io_service), isAccepting(false) {}
+	
+	ba::io_service& io_service;
+	ba::ip::tcp::acceptor acceptor;
+	atomic<bool> isAccepting;	// false after an accept error until the sweeper restarts it
+};
 
 /**
  * @class tcp_proxy_server
  * @brief TCP proxy server forwards data between one hbox to another. The hbox creates proxy servers to forward data from local UPnP service devices to the remote UPnP renderers.
+ * With the reuse_port setting every I/O thread listens on the port with its own SO_REUSEPORT socket, so the kernel
+ * spreads the accepts over the threads and each connection stays on the thread which accepted it. Otherwise one
+ * acceptor hands the connections round robin to the pool.
+ * Connections beyond the per-proxy or the global limit are refused. One timer per proxy checks the timeouts of all
+ * its connections every second, and restarts accepting after the acceptor failed, e.g. when file descriptors ran out.
+ * The front door is a proxy server with a route table instead of a fixed remote server: its connections forward
+ * each request to the remote server its path prefix names.
+ * The server keeps a registry of its live connections. Its owner does not delete it but drains it: the listening
+ * port is closed, the connections finish the exchanges they are in and the ones still open after the drain timeout
+ * are closed. The pending handlers of the server hold it, so it is freed on the I/O threads once it has no
+ * connection left.
  * @author Vu Ba Tien Dung
  *
  */
-class tcp_proxy_server {
+class tcp_proxy_server : public boost::enable_shared_from_this<tcp_proxy_server>, private boost::noncopyable {
 public:
-	tcp_proxy_server(const ios_deque& io_services, int listeningPort, string forwardIP, int forwardPort);
+	typedef boost::shared_ptr<tcp_proxy_server> pointer;
+	
+	static pointer create(io_service_pool& io_pool, int listeningPort, string forwardIP, int forwardPort,
+						  const proxy_settings& settings = proxy_settings(), const string& peer = "", int originPort = 0);
+	static pointer create(io_service_pool& io_pool, int listeningPort, route_table::pointer routes,
+						  const proxy_settings& settings = proxy_settings());
+	static pointer create(io_service_pool& io_pool, int listeningPort, proxy_context::pointer context);
+	
+	void drain();
+	size_t live();
 
 private:
-	void start_accept();
-	void handle_accept(tcp_connection::pointer new_connection, const bs::error_code& error);
+	tcp_proxy_server(io_service_pool& io_pool, int listeningPort, string forwardIP, int forwardPort, const proxy_settings& settings, const string& peer, int originPort);
+	tcp_proxy_server(io_service_pool& io_pool, int listeningPort, route_table::pointer routes, const proxy_settings& settings);
+	tcp_proxy_server(io_service_pool& io_pool, int listeningPort, proxy_context::pointer context);
+	void open();
+	bool listen(proxy_acceptor& acceptor, bool reusePort);
+	void close_acceptor(proxy_acceptor::pointer acceptor);
+	void start_accept(proxy_acceptor::pointer acceptor);
+	void handle_accept(proxy_acceptor::pointer acceptor, tcp_connection::pointer new_connection, const bs::error_code& error);
+	bool admit();
+	void start_sweep();
+	void handle_sweep(const bs::error_code& error);
 	
-	ios_deque io_services_;
-	ba::ip::tcp::acceptor acceptor_;
+	io_service_pool& io_pool_;
+	ba::deadline_timer sweeper_;
 	int listeningPort;
-	string forwardIP;
-	int forwardPort;
+	proxy_context::pointer context_;
+	vector<proxy_acceptor::pointer> acceptors_;
+	bool isSharded;				// one SO_REUSEPORT acceptor per I/O thread
+	atomic<bool> isDraining;	// the server accepts no more connections and goes away with the last one
+	list<boost::weak_ptr<tcp_connection> > connections_;	// the live connections
+	mutex m;					// protects connections_
 
 };
 
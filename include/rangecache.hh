@@ -0,0 +1,141 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef RANGECACHE_HH
+#define RANGECACHE_HH
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <ctime>
+
+#include <boost/noncopyable.hpp>
+
+#include "httpparser.hh"
+
+using namespace std;
+
+/**
+ * @class cache_hit
+ * @brief A response the range cache can give without asking the remote server: a head and a byte range of a file.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class cache_hit {
+public:
+	int fd;							// the data file, owned by the hit
+	unsigned long long offset;
+	unsigned long long length;
+	string head;
+	
+	cache_hit() : fd(-1), offset(0), length(0) {}
+	~cache_hit();
+	void close();
+};
+
+/**
+ * @class cache_fill
+ * @brief Stores the body of one response, as it streams through the proxy, into the range cache.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class cache_fill : private boost::noncopyable {
+public:
+	cache_fill() : fd(-1), generation(0), offset(0), written(0), failed(false) {}
+	~cache_fill();
+	
+	bool active() const { return fd >= 0; }
+	void write(const char* data, size_t len);
+	void commit();
+	
+private:
+	friend class range_cache;
+	string key;
+	int fd;
+	unsigned long generation;		// of the entry the body belongs to
+	unsigned long long offset;		// where the body starts in the resource
+	unsigned long long written;
+	bool failed;
+};
+
+/**
+ * @class range_cache
+ * @brief A disk-backed LRU of byte ranges of the resources fetched through the proxies, keyed by proxy target and
+ * URL. Each resource is a sparse data file in which every fetched range is stored at its own offset, and a small
+ * index file with the ranges present and the header fields replayed in local responses. Replays and seeks into
+ * cached ranges are then answered locally instead of crossing the inter-home link again.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class range_cache : private boost::noncopyable {
+public:
+	static range_cache& instance();
+	
+	bool open(const string& dir, unsigned long long maxBytes);
+	bool enabled() const { return !dir.empty(); }
+	
+	bool lookup(const string& key, const http_head& request, cache_hit& hit);
+	bool fill(const string& key, const http_head& request, const http_head& response, cache_fill& fill);
+	void commit(const string& key, unsigned long generation, unsigned long long offset, unsigned long long length);
+	
+	unsigned long getHits() const { return hits; }
+	unsigned long getMisses() const { return misses; }
+	unsigned long long getSize() const { return size; }
+	
+private:
+	struct entry {
+		string key;
+		string name;								// file name without extension
+		long long total;
+		string validator;							// ETag or Last-Modified of the stored representation
+		vector<pair<string, string> > fields;		// header fields replayed in local responses
+		map<unsigned long long, unsigned long long> ranges;	// first byte -> end (exclusive)
+		unsigned long long bytes;
+		time_t lastUse;
+		time_t expires;								// when the stored representation turns stale, 0 if never told
+		unsigned long generation;					// renewed whenever the data file is replaced
+	};
+	
+	range_cache();
+	void load();
+	void save(const entry& e);
+	void drop(map<string, entry>::iterator it);
+	void evict();
+	static string nameOf(const string& key);
+	static string validatorOf(const http_head& head);
+	static bool storable(const http_head& response);
+	static time_t expiryOf(const http_head& response, time_t now);
+	
+	string dir;
+	unsigned long long maxBytes;
+	atomic<unsigned long long> size;
+	atomic<unsigned long> hits;
+	atomic<unsigned long> misses;
+	unsigned long generations;
+	map<string, entry> entries;
+	mutex m;
+};
+
+#endif
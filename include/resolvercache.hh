@@ -0,0 +1,82 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef RESOLVERCACHE_HH
+#define RESOLVERCACHE_HH
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <ctime>
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+
+using namespace std;
+
+namespace ba=boost::asio;
+
+typedef vector<ba::ip::tcp::endpoint> endpoint_list;
+
+/**
+ * @class resolver_cache
+ * @brief The resolved endpoints of the fixed forward target of one proxy. New connections reuse them until the TTL
+ * expires, so they do not pay a resolver round trip (and the hop to the resolver thread of Boost::ASIO) each.
+ * The endpoints are kept in the order connections race them: the address which last won a race to the same host
+ * first, then the others alternating between address families, so an HIT, an LSI and a plain address of a peer all
+ * get a turn. The winner is shared by the proxies of all remote servers on that host.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class resolver_cache : private boost::noncopyable {
+public:
+	resolver_cache(int ttl, const string& host);
+	
+	bool lookup(endpoint_list& endpoints);
+	void store(endpoint_list& endpoints);
+	void prefer(const ba::ip::tcp::endpoint& winner);
+	void invalidate();
+	
+	unsigned long getHits() const { return hits; }
+	unsigned long getMisses() const { return misses; }
+	
+private:
+	void order(endpoint_list& endpoints) const;
+	void promote(endpoint_list& endpoints) const;
+	
+	const string host;
+	endpoint_list endpoints_;
+	time_t expires;
+	int ttl;			// seconds
+	atomic<unsigned long> hits;
+	atomic<unsigned long> misses;
+	mutex m;
+	
+	static map<string, ba::ip::address> winners;	// host -> the address which last won a connect race to it
+	static mutex winnersLock;
+};
+
+#endif
@@ -0,0 +1,89 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef ROUTETABLE_HH
+#define ROUTETABLE_HH
+
+#include <string>
+#include <map>
+#include <mutex>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "proxycontext.hh"
+
+using namespace std;
+
+// path prefix of the resources served through the front door, followed by the route id
+#define ROUTE_PREFIX "/hbox/"
+
+/**
+ * @class route_table
+ * @brief The remote media servers reachable through the front door of the hbox. Resource URLs handed to local
+ * renderers point at the front door with the prefix /hbox/<id>, and the front door forwards each request to the
+ * proxy context registered under that id with the prefix removed.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class route_table : private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<route_table> pointer;
+	
+	void add(const string& id, proxy_context::pointer context);
+	void remove(const string& id);
+	proxy_context::pointer find(const string& id);
+	
+	static string prefix(const string& id);
+	static bool split(const string& uri, string& id, string& rest);
+	
+private:
+	map<string, proxy_context::pointer> routes_;
+	mutex m;
+};
+
+/**
+ * @class proxy_route
+ * @brief One entry of a route table, removed again with the device that owns it. The front door connections
+ * which use the route then drain.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class proxy_route : private boost::noncopyable {
+public:
+	proxy_route(route_table::pointer table, const string& id, proxy_context::pointer context) : table(table), id(id),
+																								context(context) {
+		table->add(id, context);
+	}
+	~proxy_route() {
+		table->remove(id);
+		context->retired = true;
+	}
+	
+private:
+	route_table::pointer table;
+	string id;
+	proxy_context::pointer context;
+};
+
+#endif
@@ -0,0 +1,67 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+
+
+#ifndef SOCKETTUNING_HH
+#define SOCKETTUNING_HH
+
+#include <string>
+
+#include "configfile.hh"
+#include "metrics.hh"
+#include "trafficclass.hh"
+
+using namespace std;
+
+/**
+ * @class socket_tuning
+ * @brief The socket options of the sockets of one proxy. Buffers sized for the bandwidth-delay product of the links
+ * between homes are set on the listeners, so that the accepted sockets advertise a large enough window scale, and on
+ * the upstream sockets before they connect. Fixed buffers turn off the autotuning of the kernel and are capped by
+ * net.core.rmem_max and wmem_max, so 0 leaves them to the kernel. Options the kernel refuses are counted in the
+ * metrics of the proxy, as are the buffer sizes it granted.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class socket_tuning {
+public:
+	bool noDelay[TRAFFIC_CLASSES];	// TCP_NODELAY while the socket carries an exchange of each class
+	int receiveBuffer;			// SO_RCVBUF bytes, 0 for the kernel default
+	int sendBuffer;				// SO_SNDBUF bytes, 0 for the kernel default
+	int notSentLowat;			// TCP_NOTSENT_LOWAT bytes, 0 for the kernel default
+	int keepIdle;				// seconds a connection is idle before keepalive probes, 0 leaves keepalive off
+	int keepInterval;			// seconds between keepalive probes
+	int keepCount;				// unanswered probes before the connection is dropped
+	string congestion;			// TCP_CONGESTION algorithm, empty for the kernel default
+	bool fastOpen;				// TCP Fast Open on the listeners and on the connects to other hboxes
+	
+	socket_tuning();
+	void load(const ConfigFile& cf);
+	
+	void listen(int fd, proxy_metrics& metrics) const;
+	void apply(int fd, bool peer, proxy_metrics& metrics) const;
+	void apply_class(int fd, traffic_class c) const;
+};
+
+#endif
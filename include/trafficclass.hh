@@ -0,0 +1,56 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef TRAFFICCLASS_HH
+#define TRAFFICCLASS_HH
+
+#include <boost/asio.hpp>
+
+#include "httpparser.hh"
+
+using namespace std;
+
+namespace ba=boost::asio;
+namespace bs=boost::system;
+
+// bodies longer than this are bulk whatever their content type
+#define TRAFFIC_BULK_SIZE (1024 * 1024)
+
+/**
+ * What an HTTP exchange carries, from the most urgent to the least. Control exchanges are the UPnP actions,
+ * event subscriptions and descriptions a control point waits for; interactive ones are small resources shown
+ * to the user, such as thumbnails and album art; bulk ones are media streams and large downloads.
+ */
+enum traffic_class {
+	TRAFFIC_CONTROL,
+	TRAFFIC_INTERACTIVE,
+	TRAFFIC_BULK,
+	TRAFFIC_CLASSES
+};
+
+traffic_class classify_request(const http_head& request);
+traffic_class classify_response(traffic_class requested, const http_head& response);
+const char* traffic_class_name(traffic_class c);
+void mark_traffic(ba::ip::tcp::socket& socket, int dscp, traffic_class c);
+
+#endif
@@ -0,0 +1,336 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+
+#ifndef TUNNEL_HH
+#define TUNNEL_HH
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "iopool.hh"
+#include "metrics.hh"
+#include "sockettuning.hh"
+
+using namespace std;
+
+namespace ba=boost::asio;
+namespace bs=boost::system;
+
+// the first bytes a tunnel client sends, naming the protocol and its version
+#define TUNNEL_PREFACE "HBOXTUN2"
+// bytes of a frame header: stream id (4), type (1), unused (1), payload length (2), in network byte order
+#define TUNNEL_HEADER 8
+// most payload bytes in one frame
+#define TUNNEL_FRAME_MAX (32 * 1024)
+// bytes a stream may be sent before the receiver gives credit back
+#define TUNNEL_STREAM_WINDOW (256 * 1024)
+// streams one tunnel carries at most
+#define TUNNEL_MAX_STREAMS 1024
+// seconds before a lost tunnel is connected again, doubled up to TUNNEL_RETRY_MAX while it keeps failing
+#define TUNNEL_RETRY 2
+#define TUNNEL_RETRY_MAX 60
+
+/**
+ * The frames of the tunnel protocol. Streams are opened by the client end only.
+ */
+enum tunnel_frame_type {
+	TUNNEL_OPEN,	// opens a stream to the local port in the payload (2 bytes)
+	TUNNEL_DATA,	// stream bytes
+	TUNNEL_WINDOW,	// the receiver wrote the number of bytes in the payload (4 bytes) and takes as many more
+	TUNNEL_FIN,		// the sender reached the end of its stream
+	TUNNEL_RESET,	// the stream is aborted, or could not be opened
+	TUNNEL_ACCEPT	// the stream is connected to its local port, the opener may send
+};
+
+/**
+ * @class tunnel_stream
+ * @brief One logical connection carried by a tunnel, with the local socket at this end of it. The opening end
+ * reads its local socket only once the other end accepted the stream, so a refused stream has not lost any bytes
+ * and its connection can still be carried directly.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class tunnel_stream : private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<tunnel_stream> pointer;
+	
+	tunnel_stream(ba::io_service& io_service) : socket(io_service), id(0), port(0), credit(TUNNEL_STREAM_WINDOW),
+												queued(0), written(0), connected(false), accepted(false),
+												reading(false), writing(false),
+												inFlight(false), localEnd(false), peerEnd(false), shut(false),
+												closed(false) {}
+	
+	ba::ip::tcp::socket socket;
+	unsigned id;
+	int port;				// the port of the other end the stream is opened to, opening end only
+	size_t credit;			// bytes the other end may still be sent
+	deque<string> out;		// bytes from the other end waiting for the local socket
+	size_t queued;			// bytes in out
+	size_t written;			// bytes written to the local socket and not yet given back as credit
+	vector<char> buffer;	// read buffer of the local socket
+	bool connected;
+	bool accepted;			// both ends are connected, the local socket may be read
+	bool reading;
+	bool writing;
+	bool inFlight;			// a data frame of the stream waits in the tunnel, the local socket is read after it
+	bool localEnd;			// the local socket reached its end of stream, the other end was told
+	bool peerEnd;			// the other end reached its end of stream
+	bool shut;				// its end of stream was passed on to the local socket
+	bool closed;
+};
+
+/**
+ * @class tunnel_session
+ * @brief One tunnel connection between two hboxes, which carries the streams of all the proxies between them.
+ * Each stream has its own credit so that a stream whose local socket does not keep up cannot stop the others;
+ * the local socket of a stream is read again only once its previous frame is written to the tunnel, which
+ * interleaves the streams frame by frame. The session and all its streams run on one io_service.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class tunnel_session : public boost::enable_shared_from_this<tunnel_session>, private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<tunnel_session> pointer;
+	typedef boost::function<bool (int)> admission;
+	typedef boost::function<void ()> ended;
+	typedef boost::function<void (tunnel_stream::pointer)> refusal;
+	
+	static pointer create(ba::io_service& io_service, bool client, admission admit = admission(), ended onEnd = ended(),
+						  refusal onRefuse = refusal()) {
+		return pointer(new tunnel_session(io_service, client, admit, onEnd, onRefuse));
+	}
+	
+	ba::ip::tcp::socket& socket() { return socket_; }
+	ba::io_service& io_service() { return io_service_; }
+	
+	void start();
+	bool attach(tunnel_stream::pointer stream, int port);
+	void close();
+	bool isOpen() const { return !isClosed; }
+	size_t streams() const { return streams_.size(); }
+	
+private:
+	struct frame {
+		string bytes;
+		unsigned stream;	// the stream whose data the frame carries, 0 for the other frames
+	};
+	
+	tunnel_session(ba::io_service& io_service, bool client, admission admit, ended onEnd, refusal onRefuse);
+	void handle_preface(const bs::error_code& err);
+	void start_read();
+	void handle_read(const bs::error_code& err, size_t len);
+	bool dispatch(unsigned id, int type, const char* payload, size_t len);
+	void open_stream(unsigned id, int port);
+	void handle_stream_connect(tunnel_stream::pointer stream, const bs::error_code& err);
+	void send(unsigned id, int type, const char* payload, size_t len, bool data = false);
+	void flush();
+	void handle_write(const bs::error_code& err);
+	void start_stream_read(tunnel_stream::pointer stream);
+	void handle_stream_read(tunnel_stream::pointer stream, const bs::error_code& err, size_t len);
+	void flush_stream(tunnel_stream::pointer stream);
+	void handle_stream_write(tunnel_stream::pointer stream, const bs::error_code& err, size_t len);
+	void finish_stream(tunnel_stream::pointer stream);
+	void reset_stream(tunnel_stream::pointer stream, bool tell);
+	void refuse_stream(tunnel_stream::pointer stream);
+	
+	ba::io_service& io_service_;
+	ba::ip::tcp::socket socket_;
+	bool isClient;
+	bool isClosed;
+	bool isWriting;
+	admission admit_;			// tells which local ports the other end may open streams to
+	ended onEnd_;
+	refusal onRefuse_;			// takes the streams the other end refused or the tunnel lost before accepting them
+	char preface_[sizeof(TUNNEL_PREFACE) - 1];
+	vector<char> in_;			// read buffer of the tunnel
+	string pending_;			// the start of a frame whose end has not arrived
+	deque<frame> frames_;		// frames waiting for the tunnel
+	size_t writingFrames;		// frames of frames_ handed to the running write
+	map<unsigned, tunnel_stream::pointer> streams_;
+	unsigned nextId;
+};
+
+/**
+ * @class tunnel_client
+ * @brief The end of the tunnel to one remote hbox from which the proxies of its media servers reach them. The
+ * tunnel is connected once and kept open, and connected again whenever it is lost. Each remote server is given
+ * a portal: a loopback port whose connections become streams of the tunnel to the server's proxy port on the
+ * remote hbox, so that the proxies need no other change than where they connect.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class tunnel_client : public boost::enable_shared_from_this<tunnel_client>, private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<tunnel_client> pointer;
+	
+	static pointer create(io_service_pool& io_pool, const string& host, int port, const string& peer,
+						  const socket_tuning& tuning, int dscp);
+	
+	bool ready() const { return isReady; }
+	ba::io_service& io_service() { return io_service_; }
+	const string& getHost() const { return host; }
+	
+	void close();
+	void accept(boost::shared_ptr<ba::ip::tcp::acceptor> acceptor, int port);
+	void close_portal(boost::shared_ptr<ba::ip::tcp::acceptor> acceptor);
+	
+private:
+	tunnel_client(ba::io_service& io_service, const string& host, int port, const string& peer,
+				  const socket_tuning& tuning, int dscp);
+	void start_connect();
+	void handle_resolve(const bs::error_code& err, ba::ip::tcp::resolver::iterator endpoints);
+	void connect(size_t index);
+	void handle_connect(const bs::error_code& err, size_t index);
+	static void lost(boost::weak_ptr<tunnel_client> client);
+	static void refused(boost::weak_ptr<tunnel_client> client, tunnel_stream::pointer stream);
+	void bypass(tunnel_stream::pointer stream);
+	void handle_end();
+	void handle_retry(const bs::error_code& err);
+	void handle_close();
+	void handle_accept(boost::shared_ptr<ba::ip::tcp::acceptor> acceptor, int port, tunnel_stream::pointer stream,
+					   const bs::error_code& err);
+	
+	ba::io_service& io_service_;
+	ba::ip::tcp::resolver resolver_;
+	ba::deadline_timer retry_;
+	string host;
+	int port;
+	const socket_tuning tuning;	// of the tunnel socket and of the connections which bypass the tunnel
+	const int dscp;				// code point of the tunnel socket, -1 for none
+	proxy_metrics::pointer metrics;	// reported like a proxy, under the tunnel port of the remote hbox
+	vector<ba::ip::tcp::endpoint> endpoints_;	// candidates for the remote hbox
+	int backoff;				// seconds before the next attempt
+	tunnel_session::pointer session_;
+	atomic<bool> isReady;		// the tunnel is connected
+	bool isClosed;				// the remote hbox is gone or moved, the tunnel is not connected again
+};
+
+/**
+ * @class tunnel_bypass
+ * @brief Carries a connection accepted on a portal straight to the remote hbox when the tunnel cannot: it is
+ * down or full, or the other end refused the stream. The proxy behind the portal does not notice the difference.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class tunnel_bypass : public boost::enable_shared_from_this<tunnel_bypass>, private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<tunnel_bypass> pointer;
+	
+	static void start(ba::io_service& io_service, tunnel_stream::pointer stream, const string& host,
+					  const socket_tuning& tuning, int dscp, proxy_metrics::pointer metrics);
+	
+private:
+	tunnel_bypass(ba::io_service& io_service, tunnel_stream::pointer stream, const socket_tuning& tuning, int dscp,
+				  proxy_metrics::pointer metrics);
+	void handle_resolve(const bs::error_code& err, ba::ip::tcp::resolver::iterator endpoints);
+	void connect(size_t index);
+	void handle_connect(const bs::error_code& err, size_t index);
+	void start_read(bool fromLocal);
+	void handle_read(bool fromLocal, const bs::error_code& err, size_t len);
+	void handle_write(bool fromLocal, const bs::error_code& err);
+	void close();
+	
+	tunnel_stream::pointer stream_;	// its socket is the connection of the portal
+	ba::ip::tcp::socket remote_;
+	ba::ip::tcp::resolver resolver_;
+	const socket_tuning tuning;
+	const int dscp;
+	proxy_metrics::pointer metrics;
+	vector<ba::ip::tcp::endpoint> endpoints_;	// candidates for the remote hbox
+	vector<char> buffers_[2];		// by source, the portal connection first
+	bool ended_[2];					// the source reached its end of stream, which was passed on
+	bool isClosed;
+};
+
+/**
+ * @class tunnel_portal
+ * @brief The loopback port through which the proxy of one remote server reaches it over the tunnel. Closed when
+ * the last proxy context using it goes away.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class tunnel_portal : private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<tunnel_portal> pointer;
+	
+	tunnel_portal(tunnel_client::pointer client, int port);
+	~tunnel_portal();
+	
+	int port() const { return localPort; }
+	bool ready() const { return client_->ready(); }
+	
+private:
+	tunnel_client::pointer client_;
+	boost::shared_ptr<ba::ip::tcp::acceptor> acceptor_;
+	int localPort;
+};
+
+/**
+ * @class tunnel_server
+ * @brief The end of the tunnels remote hboxes open to reach the proxies of the local media servers. A stream may
+ * only be opened to one of those proxy ports.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class tunnel_server : public boost::enable_shared_from_this<tunnel_server>, private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<tunnel_server> pointer;
+	
+	static pointer create(io_service_pool& io_pool, int port, const socket_tuning& tuning, int dscp);
+	
+	void allow(int port);
+	void forbid(int port);
+	bool admits(int port);
+	void close();
+	
+private:
+	tunnel_server(io_service_pool& io_pool, int port, const socket_tuning& tuning, int dscp);
+	void start_accept();
+	void handle_accept(tunnel_session::pointer session, const bs::error_code& err);
+	void handle_close();
+	static bool admit(boost::weak_ptr<tunnel_server> server, int port);
+	
+	io_service_pool& io_pool_;
+	ba::io_service& io_service_;	// the thread of the acceptor
+	ba::ip::tcp::acceptor acceptor_;
+	const socket_tuning tuning;	// of the listener and the tunnels it accepts
+	const int dscp;				// code point of the tunnels it accepts, -1 for none
+	proxy_metrics::pointer metrics;
+	set<int> ports_;			// the proxy ports streams may be opened to
+	mutex m;					// protects ports_
+};
+
+#endif
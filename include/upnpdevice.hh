@@ -80,7 +80,8 @@ private:
 	int rewritePort;
 	string ipAddress;
 	bool isMediaServer;
-	tcp_proxy_server* server;
+	tcp_proxy_server::pointer server;	// drained when the device goes away
+	proxy_route* route;
 	
 public:
 	/**
@@ -95,11 +96,12 @@ public:
 		
 		remotePort = 0;
 		localPort = 0;
-		server = NULL;
+		route = NULL;
 	}
 	
 	~upnp_device() {
-		if (server) delete server;
+		if (server) server->drain();
+		if (route) delete route;
 	}
 	
 	// getters and setters
@@ -113,8 +115,10 @@ public:
 	void setLocalPort(int localPort) { this->localPort = localPort; } 
 	bool getMediaServer() { return isMediaServer; }
 	void setMediaServer(bool isMediaServer) { this->isMediaServer = isMediaServer; } 
-	tcp_proxy_server* getServer() { return server; }
-	void setServer(tcp_proxy_server* server) { this->server = server; } 
+	tcp_proxy_server::pointer getServer() { return server; }
+	void setServer(tcp_proxy_server::pointer server) { this->server = server; } 
+	proxy_route* getRoute() { return route; }
+	void setRoute(proxy_route* route) { this->route = route; } 
 	
 	void setDeviceName(string name) { this->deviceName = name; }
 	string getDeviceName() { return deviceName; }
@@ -0,0 +1,71 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef UPSTREAMPOOL_HH
+#define UPSTREAMPOOL_HH
+
+#include <deque>
+#include <mutex>
+#include <ctime>
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+
+using namespace std;
+
+namespace ba=boost::asio;
+
+/**
+ * @class upstream_pool
+ * @brief Idle connections to the remote server of one proxy. A connection whose HTTP exchanges are complete and
+ * which both ends agreed to keep alive is parked here when its client goes away, and the next client of the proxy
+ * reuses it instead of paying a new TCP (and HIP) handshake. The pool keeps the file descriptors only, so a parked
+ * connection can be taken over by a socket of any io_service.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class upstream_pool : private boost::noncopyable {
+public:
+	upstream_pool(size_t maxIdle, int idleTimeout);
+	~upstream_pool();
+	
+	bool acquire(ba::ip::tcp::socket& socket);
+	bool release(ba::ip::tcp::socket& socket);
+	size_t size();
+	
+private:
+	struct idle_connection {
+		int fd;
+		bool v6;
+		time_t since;
+	};
+	
+	void expire(time_t now);
+	
+	deque<idle_connection> idle_;
+	size_t maxIdle;
+	int idleTimeout;	// seconds
+	mutex m;
+};
+
+#endif
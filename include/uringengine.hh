@@ -0,0 +1,111 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef URINGENGINE_HH
+#define URINGENGINE_HH
+
+#include <vector>
+#include <mutex>
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
+
+using namespace std;
+
+namespace ba=boost::asio;
+
+// submission queue entries of one ring
+#define URING_ENTRIES 256
+// registered buffers of one ring and their size, connections beyond them use pooled buffers
+#define URING_BUFFERS 32
+#define URING_BUFFER_SIZE (64 * 1024)
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * @class uring_engine
+ * @brief An io_uring instance attached to one io_service, used by the connections of the uring relay mode.
+ * Reads and writes prepared while a handler runs are submitted together with one system call once the handler
+ * returns, and the completions are reaped in one go when the eventfd of the ring wakes the io_service up. The ring
+ * has a set of registered buffers, so the kernel does not map the pages of the relay buffers for every operation.
+ * Every io_service is run by one thread, so the ring is only touched by that thread; only the registered buffers
+ * may be given back from any thread.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class uring_engine : public ba::io_service::service {
+public:
+	static ba::io_service::id id;
+	typedef boost::function<void (int)> completion;	// called with the bytes moved, or with -errno
+	
+	explicit uring_engine(ba::io_service& io_service);
+	~uring_engine();
+	
+	static bool supported();
+	bool available() const { return ring_ >= 0; }
+	
+	char* acquire(int& slot);
+	void release(char* buffer, int slot);
+	void read(int fd, char* buffer, size_t len, int slot, completion handler);
+	void write(int fd, const char* buffer, size_t len, int slot, completion handler);
+	
+private:
+	void shutdown_service();
+	bool open();
+	void close();
+	void prepare(int op, int fd, const char* buffer, size_t len, int slot, completion handler);
+	void submit();
+	void start_wait();
+	void handle_wait(const boost::system::error_code& err);
+	
+	ba::io_service& io_service_;
+	ba::posix::stream_descriptor notifier_;	// eventfd signalled by the ring on completions
+	int ring_;
+	void* rings;						// submission and completion rings, mapped together
+	size_t ringsSize;
+	io_uring_sqe* sqes;
+	size_t sqesSize;
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqFlags;
+	unsigned* sqArray;
+	unsigned sqMask;
+	unsigned sqEntries;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned cqMask;
+	io_uring_cqe* cqes;
+	unsigned queued;					// prepared entries not submitted yet
+	bool isSubmitting;					// a submit is posted to the io_service
+	
+	unsigned long long sequence;
+	boost::unordered_map<unsigned long long, completion> pending_;	// operations in the ring by user data
+	
+	char* arena;						// the registered buffers, NULL if they could not be registered
+	vector<int> free_;					// registered buffers not in use
+	mutex m;							// protects free_
+};
+
+#endif
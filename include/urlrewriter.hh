@@ -0,0 +1,84 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+
+#ifndef URLREWRITER_HH
+#define URLREWRITER_HH
+
+#include <string>
+
+#include "httpparser.hh"
+
+using namespace std;
+
+// longest host and port a URL is held back for while its end has not arrived
+#define URL_MAX_AUTHORITY 270
+
+/**
+ * @class url_rewriter
+ * @brief Rewrites the URLs of a remote media server, as the server sees itself in its own network, to where the
+ * local clients reach it through the proxy. A URL is the remote server's when its port is the one the server
+ * listens on in the remote network, whatever its host, the same way action responses are fixed; its scheme and
+ * authority are replaced by the base the client used for the request.
+ * Bodies are rewritten as they stream through: chunked bodies are decoded and only the bytes of a URL which may
+ * not be complete yet are held back, so a response is never buffered as a whole. The rewritten body has another
+ * length and is sent chunked.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class url_rewriter {
+public:
+	url_rewriter() : active_(false) { clear(); }
+	
+	static bool rewritable(const http_head& response);
+	static string rewrite(const string& text, int port, const string& base);
+	
+	void start(int port, const string& base, bool chunked);
+	void feed(const char* data, size_t len, string& out);
+	void finish(string& out);
+	void clear();
+	bool active() const { return active_; }
+	
+private:
+	enum decode_state {
+		D_IDENTITY,		// the body is not chunked
+		D_SIZE,
+		D_DATA,
+		D_DATA_END,
+		D_TRAILER,
+		D_DONE
+	};
+	
+	void scan(const char* data, size_t len, bool last, string& out);
+	bool matches(const string& authority) const;
+	
+	string portText_;			// the port of the remote server in its own network
+	string base_;				// scheme and authority, and route prefix, the URLs are given
+	bool active_;
+	decode_state state_;
+	unsigned long long remaining_;	// chunk bytes left
+	string line_;				// partial chunk size or trailer line
+	string held_;				// the start of a URL whose end has not arrived
+};
+
+#endif
@@ -0,0 +1,91 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+
+
+#ifndef WARMUP_HH
+#define WARMUP_HH
+
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "proxycontext.hh"
+
+using namespace std;
+
+namespace ba=boost::asio;
+namespace bs=boost::system;
+
+// seconds before a warmer which could not connect tries again, doubled up to WARMUP_RETRY_MAX
+#define WARMUP_RETRY 2
+#define WARMUP_RETRY_MAX 60
+// times the expired warm connections are replaced without a request in between before the warmer goes quiet
+#define WARMUP_UNUSED_REFILLS 2
+// seconds between the looks of a quiet warmer for new requests, which wake it up
+#define WARMUP_QUIET_CHECK 5
+
+/**
+ * @class upstream_warmer
+ * @brief Keeps the path to a remote server warm before any renderer asks for it: it resolves the server, connects
+ * it, which sets up the HIP association with its hbox, and parks the connections in the upstream pool of the proxy,
+ * so the first request of a renderer does not pay for the cold start across the WAN. The pool is topped up again
+ * as its connections expire, until the proxy context is retired or freed. A server nobody asks for is only warmed
+ * a few times: after WARMUP_UNUSED_REFILLS refills in a row whose connections expired without a request, the
+ * warmer waits for a request before it connects again.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class upstream_warmer : public boost::enable_shared_from_this<upstream_warmer>, private boost::noncopyable {
+public:
+	typedef boost::shared_ptr<upstream_warmer> pointer;
+	
+	static pointer create(ba::io_service& io_service, proxy_context::pointer context);
+	
+private:
+	upstream_warmer(ba::io_service& io_service, proxy_context::pointer context);
+	void start_warm();
+	void handle_resolve(const bs::error_code& err, ba::ip::tcp::resolver::iterator endpoints);
+	void start_connect(size_t index);
+	void handle_connect(const bs::error_code& err, size_t index);
+	size_t target(const proxy_context& context) const;
+	void wait(int seconds);
+	void handle_wait(const bs::error_code& err);
+	
+	ba::io_service& io_service_;
+	ba::ip::tcp::resolver resolver_;
+	ba::deadline_timer timer_;
+	boost::shared_ptr<ba::ip::tcp::socket> socket_;
+	boost::weak_ptr<proxy_context> context_;	// the warmer does not keep the proxy context alive
+	endpoint_list endpoints_;					// candidates for the remote server
+	int backoff;								// seconds before the next attempt after a failure
+	bool filled;								// the pool held the target when last looked at
+	unsigned long lastRequests;					// requests of the proxy when the last refill started
+	int unusedRefills;							// refills in a row without a request in between
+};
+
+#endif
@@ -0,0 +1,478 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/**
+ * hbox_bench: measures a tcp_proxy_server on loopback in front of a synthetic media server. The clients fetch
+ * one object of a configurable size, whole or by Range, over keep-alive or fresh connections, for a fixed time;
+ * the throughput, the request and connection rates and the request latency percentiles are printed at the end.
+ * Built with "make bench", run "./hbox_bench -h" for the options.
+ */
+
+#include "hbox.hh"
+#include "proxyserver.hh"
+#include "httpparser.hh"
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+
+#include <boost/enable_shared_from_this.hpp>
+
+Category &hbox::log = Category::getInstance("hbox");
+
+/**
+ * @class bench_options
+ * @brief The parameters of a run, from the command line
+ * @author Vu Ba Tien Dung
+ *
+ */
+class bench_options {
+public:
+	int clients;				// concurrent clients
+	int seconds;				// length of the run
+	size_t objectSize;			// bytes of the object the clients fetch
+	string range;				// none, seq, random or open
+	size_t rangeSize;			// bytes asked for by each seq and random request
+	bool keepAlive;				// reuse the connection for the next request
+	bool shared;				// all clients ask for the same target, which the proxy may coalesce
+	int threads;				// I/O threads of the proxy, 0 for one per core
+	int originThreads;			// threads of the synthetic media server
+	int port;					// listening port of the proxy
+	string config;				// configuration file whose [proxy] keys tune the proxy
+	string mode;				// relay mode overriding the configuration
+	bool direct;				// clients talk to the media server, for a baseline
+	bool verify;				// check every byte of the bodies and fail the run on any error
+	
+	bench_options() : clients(16), seconds(10), objectSize(1024 * 1024), range("none"), rangeSize(64 * 1024),
+					  keepAlive(true), shared(false), threads(0), originThreads(1), port(18000), direct(false),
+					  verify(false) {}
+};
+
+/**
+ * @return the byte of the synthetic object at an offset, so that the clients can check what they got
+ *
+ */
+static inline char object_byte(unsigned long long offset) {
+	return 'a' + offset % 26;
+}
+
+/**
+ * @class origin_session
+ * @brief One connection to the synthetic media server. It answers GET and HEAD requests for any target with the
+ * object, or the part of it a Range asks for, and keeps the connection alive unless the client closes it.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class origin_session : public boost::enable_shared_from_this<origin_session> {
+public:
+	typedef boost::shared_ptr<origin_session> pointer;
+	
+	origin_session(ba::io_service& io_service, const string& content) : socket_(io_service), content_(content) {}
+	ba::ip::tcp::socket& socket() { return socket_; }
+	
+	void start() {
+		ba::async_read_until(socket_, request_, "\r\n\r\n",
+							 boost::bind(&origin_session::handle_read, shared_from_this(),
+										 ba::placeholders::error, ba::placeholders::bytes_transferred));
+	}
+	
+private:
+	void handle_read(const bs::error_code& err, size_t len) {
+		if (err)
+			return;
+		
+		ba::streambuf::const_buffers_type data = request_.data();
+		http_head request;
+		bool parsed = request.parse(string(ba::buffers_begin(data), ba::buffers_begin(data) + len), true);
+		request_.consume(len);
+		if (!parsed)
+			return;
+		
+		long long size = content_.size(), first = 0, last = size - 1;
+		bool partial = request.getRange(first, last);
+		if (partial) {
+			if (first < 0) {
+				first = max(size - last, 0LL);
+				last = size - 1;
+			}
+			else if (last < 0 || last >= size)
+				last = size - 1;
+		}
+		
+		ostringstream head;
+		if (partial && first < size) {
+			head << "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " << first << "-" << last << "/" << size << "\r\n";
+		}
+		else {
+			head << "HTTP/1.1 200 OK\r\n";
+			first = 0;
+			last = size - 1;
+		}
+		keepAlive = !request.hasToken("Connection", "close") && request.version == "HTTP/1.1";
+		head << "Content-Type: video/mpeg\r\nAccept-Ranges: bytes\r\nContent-Length: " << last - first + 1 << "\r\n";
+		if (!keepAlive)
+			head << "Connection: close\r\n";
+		head << "\r\n";
+		head_ = head.str();
+		
+		vector<ba::const_buffer> buffers;
+		buffers.push_back(ba::buffer(head_));
+		if (request.method != "HEAD")
+			buffers.push_back(ba::buffer(content_.data() + first, last - first + 1));
+		ba::async_write(socket_, buffers, boost::bind(&origin_session::handle_write, shared_from_this(),
+													  ba::placeholders::error));
+	}
+	
+	void handle_write(const bs::error_code& err) {
+		bs::error_code ignored;
+		if (!err && keepAlive)
+			start();
+		else
+			socket_.shutdown(ba::ip::tcp::socket::shutdown_send, ignored);
+	}
+	
+	ba::ip::tcp::socket socket_;
+	const string& content_;
+	ba::streambuf request_;
+	string head_;
+	bool keepAlive;
+};
+
+/**
+ * @class bench_origin
+ * @brief The synthetic media server the proxy forwards to, listening on an ephemeral loopback port
+ * @author Vu Ba Tien Dung
+ *
+ */
+class bench_origin {
+public:
+	bench_origin(ba::io_service& io_service, size_t objectSize) : io_service_(io_service),
+		acceptor_(io_service, ba::ip::tcp::endpoint(ba::ip::address_v4::loopback(), 0)) {
+		content_.resize(objectSize);
+		for (size_t i = 0; i < objectSize; i++)
+			content_[i] = object_byte(i);
+		start_accept();
+	}
+	
+	int port() const { return acceptor_.local_endpoint().port(); }
+	
+private:
+	void start_accept() {
+		origin_session::pointer session(new origin_session(io_service_, content_));
+		acceptor_.async_accept(session->socket(), boost::bind(&bench_origin::handle_accept, this, session,
+															  ba::placeholders::error));
+	}
+	
+	void handle_accept(origin_session::pointer session, const bs::error_code& err) {
+		if (!err)
+			session->start();
+		start_accept();
+	}
+	
+	ba::io_service& io_service_;
+	ba::ip::tcp::acceptor acceptor_;
+	string content_;
+};
+
+/**
+ * @class bench_client
+ * @brief One client of the benchmark, run by its own thread with blocking sockets. The latency of a request is
+ * measured from the connect, or from sending it on a kept-alive connection, to the last byte of the body.
+ * @author Vu Ba Tien Dung
+ *
+ */
+class bench_client {
+public:
+	vector<unsigned long long> latencies;	// microseconds
+	unsigned long long bytes;				// body bytes received
+	unsigned long connections;
+	unsigned long errors;
+	
+	bench_client(const bench_options& options, int port, int id) : bytes(0), connections(0), errors(0),
+		options(options), port(port), id(id), seed(id), socket_(io_service_) {}
+	
+	void run(unsigned long long deadline) {
+		vector<char> body(options.objectSize);
+		unsigned long long next = 0;	// offset of the next seq request
+		
+		while (metrics_now() < deadline) {
+			unsigned long long start = metrics_now();
+			bs::error_code err;
+			if (!socket_.is_open()) {
+				socket_.connect(ba::ip::tcp::endpoint(ba::ip::address_v4::loopback(), port), err);
+				if (err) {
+					errors++;
+					socket_.close();
+					usleep(1000);
+					continue;
+				}
+				connections++;
+				response_.consume(response_.size());
+			}
+			
+			// the range of this request
+			unsigned long long size = options.objectSize, first = 0, last = size - 1;
+			ostringstream request;
+			request << "GET /object/" << (options.shared ? 0 : id) << " HTTP/1.1\r\nHost: 127.0.0.1\r\n";
+			if (options.range == "seq" || options.range == "random") {
+				first = options.range == "seq" ? next : (unsigned long long) rand_r(&seed) * options.rangeSize % size;
+				last = min(first + options.rangeSize, size) - 1;
+				next = last + 1 < size ? last + 1 : 0;
+				request << "Range: bytes=" << first << "-" << last << "\r\n";
+			}
+			else if (options.range == "open") {
+				first = (unsigned long long) rand_r(&seed) * 4096 % size;
+				request << "Range: bytes=" << first << "-\r\n";
+			}
+			if (!options.keepAlive)
+				request << "Connection: close\r\n";
+			request << "\r\n";
+			
+			if (!fetch(request.str(), first, last, body)) {
+				errors++;
+				socket_.close(err);
+				continue;
+			}
+			latencies.push_back(metrics_now() - start);
+			bytes += last - first + 1;
+			if (!options.keepAlive)
+				socket_.close(err);
+		}
+	}
+	
+private:
+	/**
+	 * Sends a request and reads its response
+	 * @return false if the response is not the expected range of the object
+	 *
+	 */
+	bool fetch(const string& request, unsigned long long first, unsigned long long last, vector<char>& body) {
+		bs::error_code err;
+		ba::write(socket_, ba::buffer(request), err);
+		if (err)
+			return false;
+		
+		size_t len = ba::read_until(socket_, response_, "\r\n\r\n", err);
+		if (err)
+			return false;
+		ba::streambuf::const_buffers_type data = response_.data();
+		http_head head;
+		bool parsed = head.parse(string(ba::buffers_begin(data), ba::buffers_begin(data) + len), false);
+		response_.consume(len);
+		size_t length = last - first + 1;
+		if (!parsed || head.status / 100 != 2 || (size_t) atoll(head.get("Content-Length").c_str()) != length)
+			return false;
+		
+		size_t held = min(response_.size(), length);
+		ba::buffer_copy(ba::buffer(&body[0], held), response_.data());
+		response_.consume(held);
+		if (held < length)
+			ba::read(socket_, ba::buffer(&body[held], length - held), err);
+		if (err)
+			return false;
+		if (options.verify) {
+			for (size_t i = 0; i < length; i++)
+				if (body[i] != object_byte(first + i))
+					return false;
+			return true;
+		}
+		return body[0] == object_byte(first) && body[length - 1] == object_byte(last);
+	}
+	
+	const bench_options& options;
+	int port;
+	int id;
+	unsigned int seed;			// of the random ranges, so that runs are repeatable
+	ba::io_service io_service_;
+	ba::ip::tcp::socket socket_;
+	ba::streambuf response_;
+};
+
+/**
+ * @return the latency below which a share p of the sorted samples fall
+ *
+ */
+static unsigned long long percentile(const vector<unsigned long long>& sorted, double p) {
+	if (sorted.empty())
+		return 0;
+	return sorted[min((size_t) (p * sorted.size()), sorted.size() - 1)];
+}
+
+static void usage(const char* name) {
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		" -c clients         Concurrent clients (16)\n"
+		" -d seconds         Length of the run (10)\n"
+		" -s bytes           Size of the object, with an optional k or m suffix (1m)\n"
+		" -r none|seq|random|open\n"
+		"                    Whole object, sequential or random ranges, or random offsets to the end (none)\n"
+		" -R bytes           Size of the seq and random ranges (64k)\n"
+		" -n                 A new connection for every request\n"
+		" -S                 All clients ask for the same target, otherwise each has its own\n"
+		" -t threads         I/O threads of the proxy, 0 for one per core (0)\n"
+		" -o threads         Threads of the synthetic media server (1)\n"
+		" -p port            Listening port of the proxy (18000)\n"
+		" -f configfile      Tune the proxy with the [proxy] keys of an hbox configuration file\n"
+		" -m buffered|splice|uring\n"
+		"                    Relay mode, overrides the configuration file\n"
+		" -x                 Clients talk to the media server directly, for a baseline\n"
+		" -V                 Check every byte of the responses and fail the run on any error\n"
+		, name);
+}
+
+/**
+ * @return a size given with an optional k or m suffix
+ *
+ */
+static size_t parse_size(const char* text) {
+	char* end;
+	size_t size = strtoul(text, &end, 10);
+	if (*end == 'k' || *end == 'K')
+		size *= 1024;
+	else if (*end == 'm' || *end == 'M')
+		size *= 1024 * 1024;
+	return size;
+}
+
+int main(int argc, char* argv[]) {
+	bench_options options;
+	int c;
+	while ((c = getopt(argc, argv, "c:d:s:r:R:nSt:o:p:f:m:xVh")) != -1) {
+		switch (c) {
+			case 'c': options.clients = atoi(optarg); break;
+			case 'd': options.seconds = atoi(optarg); break;
+			case 's': options.objectSize = parse_size(optarg); break;
+			case 'r': options.range = optarg; break;
+			case 'R': options.rangeSize = parse_size(optarg); break;
+			case 'n': options.keepAlive = false; break;
+			case 'S': options.shared = true; break;
+			case 't': options.threads = atoi(optarg); break;
+			case 'o': options.originThreads = atoi(optarg); break;
+			case 'p': options.port = atoi(optarg); break;
+			case 'f': options.config = optarg; break;
+			case 'm': options.mode = optarg; break;
+			case 'x': options.direct = true; break;
+			case 'V': options.verify = true; break;
+			default:
+				usage(argv[0]);
+				return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (options.clients <= 0 || options.seconds <= 0 || options.objectSize == 0 || options.rangeSize == 0 ||
+		(options.range != "none" && options.range != "seq" && options.range != "random" && options.range != "open")) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	
+	hbox::log.setAdditivity(false);
+	hbox::log.setPriority(log4cpp::Priority::WARN);
+	hbox::log.setAppender(new FileAppender("_", ::dup(fileno(stderr))));
+	
+	proxy_settings settings;
+	if (!options.config.empty())
+		settings.load(ConfigFile(options.config));
+	if (!options.mode.empty()) {
+		ConfigFile mode;
+		mode.add("relay_mode", options.mode);
+		proxy_settings relay;
+		relay.load(mode);
+		settings.mode = relay.mode;
+	}
+	if (settings.mode == RELAY_URING && !uring_engine::supported()) {
+		HBOX_WARN("io_uring is not available, the proxy uses the buffered relay");
+		settings.mode = RELAY_BUFFERED;
+	}
+	
+	// the media server
+	ba::io_service originService;
+	bench_origin origin(originService, options.objectSize);
+	boost::thread_group originThreads;
+	for (int i = 0; i < max(options.originThreads, 1); i++)
+		originThreads.create_thread(boost::bind(&ba::io_service::run, &originService));
+	
+	// the proxy
+	io_service_pool pool;
+	tcp_proxy_server::pointer proxy;
+	int port = origin.port();
+	if (!options.direct) {
+		pool.start(options.threads);
+		proxy = tcp_proxy_server::create(pool, options.port, "127.0.0.1", origin.port(), settings);
+		port = options.port;
+	}
+	
+	static const char* const modes[] = { "buffered", "splice", "uring" };
+	printf("%d clients, %zu byte object, range %s", options.clients, options.objectSize, options.range.c_str());
+	if (options.range == "seq" || options.range == "random")
+		printf(" of %zu bytes", options.rangeSize);
+	printf(", %s, %s, ", options.shared ? "one target" : "a target per client",
+		   options.keepAlive ? "keep-alive" : "a connection per request");
+	if (proxy)
+		printf("%zu proxy threads, %s relay\n", pool.size(), modes[settings.mode]);
+	else
+		printf("no proxy\n");
+	fflush(stdout);
+	
+	// the run
+	vector<bench_client*> clients;
+	boost::thread_group clientThreads;
+	unsigned long long start = metrics_now();
+	unsigned long long deadline = start + options.seconds * 1000000ULL;
+	for (int i = 0; i < options.clients; i++) {
+		clients.push_back(new bench_client(options, port, i + 1));
+		clientThreads.create_thread(boost::bind(&bench_client::run, clients.back(), deadline));
+	}
+	clientThreads.join_all();
+	double elapsed = (metrics_now() - start) / 1000000.0;
+	
+	// the report
+	vector<unsigned long long> latencies;
+	unsigned long long bytes = 0;
+	unsigned long connections = 0, errors = 0;
+	for (size_t i = 0; i < clients.size(); i++) {
+		latencies.insert(latencies.end(), clients[i]->latencies.begin(), clients[i]->latencies.end());
+		bytes += clients[i]->bytes;
+		connections += clients[i]->connections;
+		errors += clients[i]->errors;
+		delete clients[i];
+	}
+	sort(latencies.begin(), latencies.end());
+	
+	printf("requests      %zu (%.1f/s), errors %lu\n", latencies.size(), latencies.size() / elapsed, errors);
+	printf("connections   %lu (%.1f/s)\n", connections, connections / elapsed);
+	printf("throughput    %.1f MB/s\n", bytes / elapsed / 1000000.0);
+	printf("latency (us)  p50 %llu, p99 %llu, p999 %llu, max %llu\n", percentile(latencies, 0.5),
+		   percentile(latencies, 0.99), percentile(latencies, 0.999), latencies.empty() ? 0 : latencies.back());
+	
+	if (proxy)
+		proxy->drain();
+	if (!options.direct) {
+		pool.stop();
+		pool.join();
+	}
+	originService.stop();
+	originThreads.join_all();
+	if (options.verify && errors > 0)
+		return EXIT_FAILURE;
+	return errors > 0 && latencies.empty() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
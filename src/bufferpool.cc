@@ -0,0 +1,109 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "bufferpool.hh"
+
+// free bytes kept per size class, the rest goes back to the heap
+#define BUFFER_KEEP_BYTES (2 * 1024 * 1024)
+
+buffer_pool& buffer_pool::instance() {
+	static buffer_pool pool;
+	return pool;
+}
+
+buffer_pool::buffer_pool() : allocated(0), inUse(0) {
+}
+
+buffer_pool::~buffer_pool() {
+	for (int i = 0; i < BUFFER_CLASSES; i++)
+		for (size_t j = 0; j < freeList[i].size(); j++)
+			delete[] freeList[i][j];
+}
+
+int buffer_pool::classOf(size_t size) {
+	int c = 0;
+	for (size_t s = BUFFER_MIN_SIZE; s < size && c < BUFFER_CLASSES - 1; s *= 4)
+		c++;
+	return c;
+}
+
+/**
+ * @param size a wanted buffer size
+ * @return the size of the smallest class which holds size bytes
+ *
+ */
+size_t buffer_pool::fit(size_t size) {
+	return (size_t) BUFFER_MIN_SIZE << (2 * classOf(size));
+}
+
+size_t buffer_pool::grow(size_t size) {
+	return size >= BUFFER_MAX_SIZE ? BUFFER_MAX_SIZE : fit(size) * 4;
+}
+
+size_t buffer_pool::shrink(size_t size) {
+	return size <= BUFFER_MIN_SIZE ? BUFFER_MIN_SIZE : fit(size) / 4;
+}
+
+/**
+ * Hands out a buffer
+ * @param size the size class, as returned by fit()
+ *
+ */
+char* buffer_pool::acquire(size_t size) {
+	int c = classOf(size);
+	inUse += fit(size);
+	{
+		lock_guard<mutex> lock(m);
+		if (!freeList[c].empty()) {
+			char* buffer = freeList[c].back();
+			freeList[c].pop_back();
+			return buffer;
+		}
+	}
+	
+	allocated += fit(size);
+	return new char[fit(size)];
+}
+
+/**
+ * Takes a buffer back
+ * @param buffer the buffer
+ * @param size the size it was acquired with
+ *
+ */
+void buffer_pool::release(char* buffer, size_t size) {
+	if (!buffer) return;
+	
+	int c = classOf(size);
+	inUse -= fit(size);
+	{
+		lock_guard<mutex> lock(m);
+		if ((freeList[c].size() + 1) * fit(size) <= BUFFER_KEEP_BYTES) {
+			freeList[c].push_back(buffer);
+			return;
+		}
+	}
+	
+	allocated -= fit(size);
+	delete[] buffer;
+}
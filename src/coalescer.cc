@@ -0,0 +1,278 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "coalescer.hh"
+
+#include <cstring>
+#include <algorithm>
+
+/**
+ * Constructor of shared_response class
+ * @param window bytes after which no follower may join, and by which a follower may fall behind
+ *
+ */
+shared_response::shared_response(size_t window) : window(window), start_(0), joinable(true), finished(false),
+												  failed(false) {
+}
+
+/**
+ * Passes on the next bytes of the response, as the leader relays them
+ * @return false once no one can join anymore
+ *
+ */
+bool shared_response::append(const char* data, size_t len) {
+	vector<waker> wakers;
+	bool open;
+	{
+		lock_guard<mutex> lock(m);
+		if (finished || failed)
+			return false;
+		
+		data_.append(data, len);
+		if (joinable && start_ + data_.size() > window)
+			joinable = false;
+		trim();
+		
+		for (size_t i = 0; i < followers_.size(); i++)
+			if (followers_[i].active && followers_[i].waiting) {
+				followers_[i].waiting = false;
+				wakers.push_back(followers_[i].wake);
+			}
+		open = joinable;
+	}
+	for (size_t i = 0; i < wakers.size(); i++)
+		wakers[i]();
+	return open;
+}
+
+/**
+ * The response is complete
+ *
+ */
+void shared_response::finish() {
+	vector<waker> wakers;
+	{
+		lock_guard<mutex> lock(m);
+		if (finished || failed)
+			return;
+		finished = true;
+		joinable = false;
+		for (size_t i = 0; i < followers_.size(); i++)
+			if (followers_[i].active)
+				wakers.push_back(followers_[i].wake);
+	}
+	for (size_t i = 0; i < wakers.size(); i++)
+		wakers[i]();
+}
+
+/**
+ * The leader cannot complete the response, e.g. its client went away or the response is not for everyone
+ *
+ */
+void shared_response::fail() {
+	vector<waker> wakers;
+	{
+		lock_guard<mutex> lock(m);
+		if (finished || failed)
+			return;
+		failed = true;
+		joinable = false;
+		for (size_t i = 0; i < followers_.size(); i++)
+			if (followers_[i].active)
+				wakers.push_back(followers_[i].wake);
+		data_.clear();
+	}
+	for (size_t i = 0; i < wakers.size(); i++)
+		wakers[i]();
+}
+
+/**
+ * @param leader woken up once no follower is too far behind anymore
+ * @return true if the leader should not read more from the remote server for now
+ *
+ */
+bool shared_response::lagging(waker leader) {
+	lock_guard<mutex> lock(m);
+	if (!behind())
+		return false;
+	leader_ = leader;
+	return true;
+}
+
+/**
+ * Joins the response
+ * @param follower woken up when the follower waits and the response moves on
+ * @return the id of the follower, -1 if the response cannot be joined anymore
+ *
+ */
+int shared_response::follow(waker follower) {
+	lock_guard<mutex> lock(m);
+	if (!joinable)
+		return -1;
+	
+	struct follower f;
+	f.position = 0;
+	f.wake = follower;
+	f.waiting = false;
+	f.active = true;
+	followers_.push_back(f);
+	return followers_.size() - 1;
+}
+
+/**
+ * Copies the next bytes of the response for a follower
+ * @param id the follower
+ * @param buffer where to copy
+ * @param len at most this many bytes
+ * @param state set to tell what happened
+ * @return the number of bytes copied
+ *
+ */
+size_t shared_response::read(int id, char* buffer, size_t len, state_type& state) {
+	waker leader;
+	size_t n = 0;
+	{
+		lock_guard<mutex> lock(m);
+		follower& f = followers_[id];
+		unsigned long long end = start_ + data_.size();
+		
+		if (failed)
+			state = FAILED;
+		else if (f.position < end) {
+			n = min((unsigned long long) len, end - f.position);
+			memcpy(buffer, data_.data() + (f.position - start_), n);
+			f.position += n;
+			state = DATA;
+			trim();
+		}
+		else if (finished)
+			state = END;
+		else {
+			state = WAIT;
+			f.waiting = true;
+		}
+		
+		if (leader_ && !behind())
+			leader.swap(leader_);
+	}
+	if (leader)
+		leader();
+	return n;
+}
+
+/**
+ * @param id the follower
+ * @return the number of bytes the follower can copy now
+ *
+ */
+size_t shared_response::pending(int id) {
+	lock_guard<mutex> lock(m);
+	return failed ? 0 : start_ + data_.size() - followers_[id].position;
+}
+
+/**
+ * A follower does not need the rest of the response
+ * @param id the follower
+ *
+ */
+void shared_response::leave(int id) {
+	waker leader;
+	{
+		lock_guard<mutex> lock(m);
+		followers_[id].active = false;
+		followers_[id].wake.clear();
+		trim();
+		if (leader_ && !behind())
+			leader.swap(leader_);
+	}
+	if (leader)
+		leader();
+}
+
+/**
+ * Drops the bytes every follower has copied, once no one can join anymore
+ *
+ */
+void shared_response::trim() {
+	if (joinable)
+		return;
+	
+	unsigned long long end = start_ + data_.size();
+	unsigned long long needed = end;
+	for (size_t i = 0; i < followers_.size(); i++)
+		if (followers_[i].active)
+			needed = min(needed, followers_[i].position);
+	
+	// erasing the front of the string moves the rest, so it is done once half of it is not needed
+	size_t drop = needed - start_;
+	if (drop == data_.size())
+		data_.clear();
+	else if (drop < data_.size() / 2)
+		return;
+	else
+		data_.erase(0, drop);
+	start_ = needed;
+}
+
+/**
+ * @return true if a follower is more than the window behind the leader
+ *
+ */
+bool shared_response::behind() const {
+	unsigned long long end = start_ + data_.size();
+	for (size_t i = 0; i < followers_.size(); i++)
+		if (followers_[i].active && end - followers_[i].position > window)
+			return true;
+	return false;
+}
+
+/**
+ * Offers a response to the clients which ask for the same key
+ * @return false if another response is in flight for the key
+ *
+ */
+bool request_coalescer::add(const string& key, shared_response::pointer response) {
+	lock_guard<mutex> lock(m);
+	return inFlight_.insert(make_pair(key, response)).second;
+}
+
+/**
+ * @return the response in flight for the key, empty if there is none
+ *
+ */
+shared_response::pointer request_coalescer::find(const string& key) {
+	lock_guard<mutex> lock(m);
+	map<string, shared_response::pointer>::iterator it = inFlight_.find(key);
+	return it == inFlight_.end() ? shared_response::pointer() : it->second;
+}
+
+/**
+ * Withdraws a response which cannot be joined anymore
+ *
+ */
+void request_coalescer::remove(const string& key, shared_response::pointer response) {
+	lock_guard<mutex> lock(m);
+	map<string, shared_response::pointer>::iterator it = inFlight_.find(key);
+	if (it != inFlight_.end() && it->second == response)
+		inFlight_.erase(it);
+}
@@ -44,7 +44,11 @@ hbox::hbox() {
 	virtualControlPoint.setQueue(&upnpclient_hbox);
 	
 	maxPort = 54400;
-	THREAD_NUM = 2;
+	THREAD_NUM = 0; // one I/O thread per core
+	metricsPort = 0;
+	frontPort = 0;
+	routes.reset(new route_table());
+	tunnelPort = 0;
 }
 
 /**
@@ -56,6 +60,12 @@ hbox::~hbox() {
 	
 	for (list<hbox_info*>::iterator it = remote_hbox_es.begin(); it != remote_hbox_es.end(); it++) delete (*it);		
 	remote_hbox_es.clear();
+	if (metricsServer)
+		metricsServer->close();
+	if (frontDoor)
+		frontDoor->drain();
+	if (tunnelServer)
+		tunnelServer->close();
 }
 
 /**
@@ -134,6 +144,19 @@ void hbox::init() {
 	username = cf.read<string>("username");
 	password = cf.read<string>("password");
 	server = cf.read<string>("server");
+	
+	// read the proxy settings, all of them are optional
+	proxySettings.load(cf);
+	if (proxySettings.mode == RELAY_URING && !uring_engine::supported()) {
+		HBOX_WARN("io_uring is not available, the proxies use the buffered relay");
+		proxySettings.mode = RELAY_BUFFERED;
+	}
+	THREAD_NUM = cf.read<int>("io_threads", THREAD_NUM);
+	metricsPort = cf.read<int>("metrics_port", metricsPort);
+	frontPort = cf.read<int>("front_port", frontPort);
+	tunnelPort = cf.read<int>("tunnel_port", tunnelPort);
+	if (proxySettings.useRangeCache && !range_cache::instance().open(proxySettings.cacheDir, proxySettings.cacheSize * 1024ULL * 1024ULL))
+		proxySettings.useRangeCache = false;
 
 	// create the description.xml file from config file
 	xml_description_file cd = xml_description_file("description.xml");
@@ -381,6 +404,7 @@ void hbox::newNeighborHbox(event& temp) {
 void hbox::delNeighborHbox(event& temp) {
 	for (list<hbox_info*>::iterator it = remote_hbox_es.begin(); it != remote_hbox_es.end(); it++)
 		if ((*it)->getName() == temp.getName()) {
+			closeTunnel(temp.getName());
 			remote_hbox_es.erase(it);
 			delete (*it);
 			break;
@@ -422,18 +446,18 @@ void hbox::addNetworkInfoLocalUPnPDevice(event& temp) {
 	self_hbox.findUpnpDevice(temp.getName())->setRemotePort(atoi(serverPort.c_str()));
 	self_hbox.findUpnpDevice(temp.getName())->setLocalPort(maxPort++);
 	
+	// local media servers are close, only the proxies of remote devices use the range cache, read ahead and share
+	// responses
+	proxy_settings localSettings = proxySettings;
+	localSettings.useRangeCache = false;
+	localSettings.prefetchWindow = 0;
+	localSettings.coalesceWindow = 0;
+	
 	try {
-		ios_deque io_services;
-				
-		for (int i = 0; i < THREAD_NUM; i++) {
-			io_service_ptr ios(new ba::io_service);
-			io_services.push_back(ios);
-			io_service_work.push_back(ba::io_service::work(*ios));
-			thr_grp.create_thread(boost::bind(&ba::io_service::run, ios));
-		}
-		
-		tcp_proxy_server* server = new tcp_proxy_server(io_services, /* listenning port */ maxPort - 1, /* forwarding address */ serverIP, /* forwarding port */ atoi(serverPort.c_str()));
+		tcp_proxy_server::pointer server = tcp_proxy_server::create(ioPool, /* listenning port */ maxPort - 1, /* forwarding address */ serverIP, /* forwarding port */ atoi(serverPort.c_str()), localSettings);
 		self_hbox.findUpnpDevice(temp.getName())->setServer(server); // pass the pointer of server object to upnp device
+		if (tunnelServer)
+			tunnelServer->allow(maxPort - 1);
 	} 
 	catch (exception& e) {
 		HBOX_ERROR("Exception thrown " << e.what());
@@ -494,6 +518,9 @@ void hbox::startLocalUPnPDevice(event& temp) {
  *
  */
 void hbox::delLocalUPnPDevice(event& temp) {
+	upnp_device* device = self_hbox.findUpnpDevice(temp.getName());
+	if (tunnelServer && device)
+		tunnelServer->forbid(device->getLocalPort());
 	self_hbox.removeUpnpDevice(temp.getName());
 	// confirmLocalDatabases();
 	
@@ -534,22 +561,40 @@ void hbox::setRemoteUPnPDevicePort(event& temp) {
 	(hbox->findUpnpDevice(deviceName))->setLocalPort(maxPort++);
 	(hbox->findUpnpDevice(deviceName))->setRemotePort(atoi(remotePort.c_str())); // remotePort
 	
-	try {
-		ios_deque io_services;
-				
-		for (int i = 0; i < THREAD_NUM; i++) {
-			io_service_ptr ios(new ba::io_service);
-			io_services.push_back(ios);
-			io_service_work.push_back(ba::io_service::work(*ios));
-			thr_grp.create_thread(boost::bind(&ba::io_service::run, ios));
+	string forwardIP = (hbox->getCommInfo()).getHip() ? (hbox->getCommInfo()).getLsiAddress() : (hbox->getCommInfo()).getIpAddress();
+	
+	proxy_context::pointer context(new proxy_context(forwardIP, atoi(remotePort.c_str()), proxySettings, maxPort - 1, hbox->getName(), atoi(serverPort.c_str())));
+	
+	// the streams to all media servers of the remote hbox share one tunnel, which the proxy uses while it is up
+	if (tunnelPort > 0) {
+		tunnel_client::pointer& tunnel = tunnels[hbox->getName()];
+		if (tunnel && tunnel->getHost() != forwardIP) {
+			// the hbox moved, the old tunnel would keep connecting the address it left
+			tunnel->close();
+			tunnel.reset();
 		}
-		
-		tcp_proxy_server* server;
-		if ((hbox->getCommInfo()).getHip())
-			server = new tcp_proxy_server(io_services, /* listenning port */ maxPort - 1, /* forwarding address */ (hbox->getCommInfo()).getLsiAddress(), /* forwarding port */ atoi(remotePort.c_str()));
-		else
-			server = new tcp_proxy_server(io_services, /* listenning port */ maxPort - 1, /* forwarding address */ (hbox->getCommInfo()).getIpAddress(), /* forwarding port */ atoi(remotePort.c_str()));
-			
+		if (!tunnel)
+			tunnel = tunnel_client::create(ioPool, forwardIP, tunnelPort, hbox->getName(), proxySettings.tuning,
+										   proxySettings.dscp[TRAFFIC_BULK]);
+		try {
+			context->tunnel.reset(new tunnel_portal(tunnel, atoi(remotePort.c_str())));
+		}
+		catch (exception& e) {
+			HBOX_ERROR("Cannot open the tunnel portal of " << deviceName << ": " << e.what());
+		}
+	}
+	
+	// the path to the remote server is set up in the background, before a renderer asks for it
+	upstream_warmer::create(ioPool.get_io_service(), context);
+	
+	// behind the front door the local port only names the route of the device
+	if (frontDoor) {
+		(hbox->findUpnpDevice(deviceName))->setRoute(new proxy_route(routes, boost::lexical_cast<string>(maxPort - 1), context));
+		return;
+	}
+	
+	try {
+		tcp_proxy_server::pointer server = tcp_proxy_server::create(ioPool, /* listenning port */ maxPort - 1, context);
 		(hbox->findUpnpDevice(deviceName))->setServer(server); // pass the pointer of server object to upnp device
 	} 
 	catch (exception& e) {
@@ -607,6 +652,23 @@ void hbox::delRemoteUPnPDevice(event& temp) {
 	hbox_info* hbox = getHbox(temp.getName());	
 	HBOX_DEBUG("hbox name: " << hbox->getName());
 	bool success = hbox->removeUpnpDevice(temp.getDescription());
+	if (hbox->getDeviceList().empty())
+		closeTunnel(hbox->getName());
+}
+
+/**
+ * Stops connecting the tunnel to a remote hbox once none of its media servers is proxied anymore. The streams
+ * still running on it end with it.
+ * @param hboxName the remote hbox
+ *
+ */
+void hbox::closeTunnel(const string& hboxName) {
+	map<string, tunnel_client::pointer>::iterator it = tunnels.find(hboxName);
+	if (it == tunnels.end())
+		return;
+	if (it->second)
+		it->second->close();
+	tunnels.erase(it);
 }
 
 void hbox::sendAction(event& temp) {
@@ -649,7 +711,10 @@ void hbox::fixResourceURL(event& temp) {
 			string localPortString;
 			localPortStringStream << localPort; 
 			localPortString = localPortStringStream.str();
-			final_address = "http://" + localIp + ":" + localPortString;
+			if (frontDoor)
+				final_address = "http://" + localIp + ":" + boost::lexical_cast<string>(frontPort) + route_table::prefix(localPortString);
+			else
+				final_address = "http://" + localIp + ":" + localPortString;
 		}
 
 		remote_url_start_pointer = new_resource.find(">", remote_url_start_pointer);
@@ -707,6 +772,39 @@ hbox_info* hbox::getHbox(string hboxName) {
 void hbox::start() {
 	HBOX_INFO("Running...");
 	
+	// Start the I/O threads shared by all proxy servers
+	ioPool.start(THREAD_NUM);
+	
+	// Report the proxy metrics on a loopback port
+	if (metricsPort > 0) {
+		try {
+			metricsServer = metrics_server::create(ioPool.get_io_service(), metricsPort);
+		}
+		catch (exception& e) {
+			HBOX_ERROR("Cannot report metrics on port " << metricsPort << ": " << e.what());
+		}
+	}
+	
+	// Serve the media servers of the remote hboxes on one port
+	if (frontPort > 0) {
+		try {
+			frontDoor = tcp_proxy_server::create(ioPool, frontPort, routes, proxySettings);
+		}
+		catch (exception& e) {
+			HBOX_ERROR("Cannot open the front door on port " << frontPort << ": " << e.what());
+		}
+	}
+	
+	// Carry the streams of remote hboxes to the local media servers
+	if (tunnelPort > 0) {
+		try {
+			tunnelServer = tunnel_server::create(ioPool, tunnelPort, proxySettings.tuning, proxySettings.dscp[TRAFFIC_BULK]);
+		}
+		catch (exception& e) {
+			HBOX_ERROR("Cannot open the tunnel port " << tunnelPort << ": " << e.what());
+		}
+	}
+	
 	// Start XMPP in a separate thread
 	thread xmppclient_t((xmppclient_thread(client, hbox_xmpp)));
 	thread upnpserver_t((upnpserver_thread(virtualUpnpServer, hbox_upnpserver)));
@@ -719,7 +817,7 @@ void hbox::start() {
 	xmppclient_t.join();
 	upnpserver_t.join();
 	upnpclient_t.join();
-	thr_grp.join_all();
+	ioPool.join();
 	exit(EXIT_SUCCESS);
 }
 
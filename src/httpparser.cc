@@ -0,0 +1,422 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "httpparser.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <boost/algorithm/string.hpp>
+
+// larger heads are not HTTP we want to look into
+#define HTTP_MAX_HEAD (64 * 1024)
+
+void http_head::clear() {
+	method.clear();
+	uri.clear();
+	version.clear();
+	status = 0;
+	reason.clear();
+	fields.clear();
+	raw.clear();
+}
+
+/**
+ * Parses the start line and the header fields
+ * @param text the head including the terminating empty line
+ * @param request whether the head is a request or a response
+ * @return false if the head is malformed
+ *
+ */
+bool http_head::parse(const string& text, bool request) {
+	vector<string> lines;
+	boost::split(lines, text, boost::is_any_of("\n"));
+	
+	size_t i = 0;
+	for (; i < lines.size(); i++) {
+		boost::trim_right_if(lines[i], boost::is_any_of("\r"));
+		if (!lines[i].empty()) break;
+	}
+	if (i == lines.size()) return false;
+	
+	string::size_type sp1 = lines[i].find(' ');
+	if (sp1 == string::npos) return false;
+	string::size_type sp2 = lines[i].find(' ', sp1 + 1);
+	
+	if (request) {
+		if (sp2 == string::npos) return false;
+		method = lines[i].substr(0, sp1);
+		uri = lines[i].substr(sp1 + 1, sp2 - sp1 - 1);
+		version = lines[i].substr(sp2 + 1);
+	}
+	else {
+		version = lines[i].substr(0, sp1);
+		status = atoi(lines[i].c_str() + sp1 + 1);
+		reason = sp2 == string::npos ? "" : lines[i].substr(sp2 + 1);
+	}
+	if (version.compare(0, 5, "HTTP/") != 0) return false;
+	
+	for (i++; i < lines.size(); i++) {
+		boost::trim_right_if(lines[i], boost::is_any_of("\r"));
+		if (lines[i].empty()) break;
+		
+		if ((lines[i][0] == ' ' || lines[i][0] == '\t') && !fields.empty()) { // obsolete line folding
+			fields.back().second += " " + boost::trim_copy(lines[i]);
+			continue;
+		}
+		
+		string::size_type colon = lines[i].find(':');
+		if (colon == string::npos) return false;
+		fields.push_back(make_pair(boost::trim_copy(lines[i].substr(0, colon)), boost::trim_copy(lines[i].substr(colon + 1))));
+	}
+	
+	raw = text;
+	return true;
+}
+
+/**
+ * @param name the header field name, case insensitive
+ * @return the value of the first field with this name, empty if there is none
+ *
+ */
+string http_head::get(const string& name) const {
+	for (size_t i = 0; i < fields.size(); i++)
+		if (boost::iequals(fields[i].first, name))
+			return fields[i].second;
+	return "";
+}
+
+bool http_head::has(const string& name) const {
+	for (size_t i = 0; i < fields.size(); i++)
+		if (boost::iequals(fields[i].first, name))
+			return true;
+	return false;
+}
+
+/**
+ * Checks a comma separated header field such as Connection or Transfer-Encoding
+ * @param name the header field name
+ * @param token the token to look for, case insensitive
+ *
+ */
+bool http_head::hasToken(const string& name, const string& token) const {
+	for (size_t i = 0; i < fields.size(); i++)
+		if (boost::iequals(fields[i].first, name)) {
+			vector<string> tokens;
+			boost::split(tokens, fields[i].second, boost::is_any_of(","));
+			for (size_t j = 0; j < tokens.size(); j++)
+				if (boost::iequals(boost::trim_copy(tokens[j]), token))
+					return true;
+		}
+	return false;
+}
+
+/**
+ * Parses a single range of the Range header field, multiple ranges are not supported
+ * @param first set to the first byte, -1 for a suffix range
+ * @param last set to the last byte, -1 if the range is open; for a suffix range the suffix length
+ * @return false if there is no usable Range field
+ *
+ */
+bool http_head::getRange(long long& first, long long& last) const {
+	string range = get("Range");
+	if (range.compare(0, 6, "bytes=") != 0 || range.find(',') != string::npos)
+		return false;
+	
+	string::size_type dash = range.find('-', 6);
+	if (dash == string::npos)
+		return false;
+	
+	string a = boost::trim_copy(range.substr(6, dash - 6));
+	string b = boost::trim_copy(range.substr(dash + 1));
+	if (a.empty() && b.empty())
+		return false;
+	
+	first = a.empty() ? -1 : atoll(a.c_str());
+	last = b.empty() ? -1 : atoll(b.c_str());
+	return first < 0 || last < 0 || first <= last;
+}
+
+/**
+ * Parses the Content-Range header field of a 206 response
+ * @param first set to the first byte
+ * @param last set to the last byte
+ * @param total set to the complete length, -1 if unknown
+ * @return false if there is no usable Content-Range field
+ *
+ */
+bool http_head::getContentRange(long long& first, long long& last, long long& total) const {
+	string range = get("Content-Range");
+	if (range.compare(0, 6, "bytes ") != 0)
+		return false;
+	
+	string::size_type dash = range.find('-', 6);
+	string::size_type slash = range.find('/', 6);
+	if (dash == string::npos || slash == string::npos || dash > slash)
+		return false;
+	
+	first = atoll(range.c_str() + 6);
+	last = atoll(range.c_str() + dash + 1);
+	total = range[slash + 1] == '*' ? -1 : atoll(range.c_str() + slash + 1);
+	return first <= last;
+}
+
+/**
+ * Replaces the value of a header field, or appends the field if the head has none
+ * @param name the header field name, case insensitive
+ * @param value the new value
+ *
+ */
+void http_head::set(const string& name, const string& value) {
+	for (size_t i = 0; i < fields.size(); i++)
+		if (boost::iequals(fields[i].first, name)) {
+			fields[i].second = value;
+			return;
+		}
+	fields.push_back(make_pair(name, value));
+}
+
+/**
+ * Removes every header field of a name
+ * @param name the header field name, case insensitive
+ *
+ */
+void http_head::erase(const string& name) {
+	for (size_t i = fields.size(); i > 0; i--)
+		if (boost::iequals(fields[i - 1].first, name))
+			fields.erase(fields.begin() + (i - 1));
+}
+
+/**
+ * @return the head serialized from its parts, for heads the proxy changed; raw keeps the received one
+ *
+ */
+string http_head::text() const {
+	ostringstream out;
+	if (!method.empty())
+		out << method << " " << uri << " " << version << "\r\n";
+	else
+		out << version << " " << status << " " << reason << "\r\n";
+	for (size_t i = 0; i < fields.size(); i++)
+		out << fields[i].first << ": " << fields[i].second << "\r\n";
+	out << "\r\n";
+	return out.str();
+}
+
+/**
+ * Constructor of http_parser class
+ * @param request true to follow requests (client to server), false to follow responses
+ *
+ */
+http_parser::http_parser(bool request) : request_(request), state_(S_HEAD), remaining_(0), keepAlive_(true) {
+}
+
+void http_parser::reset() {
+	state_ = S_HEAD;
+	head_.clear();
+	line_.clear();
+	chunk_.clear();
+	remaining_ = 0;
+	keepAlive_ = true;
+	expected_.clear();
+}
+
+/**
+ * Registers a request whose response will be parsed next (responses come in request order)
+ * @param method the request method, responses to HEAD never have a body
+ *
+ */
+void http_parser::expect_response(const string& method) {
+	expected_.push_back(method);
+}
+
+/**
+ * @return true if the stream is between two messages and, for a response parser, no request waits for its response
+ *
+ */
+bool http_parser::idle() const {
+	return state_ == S_HEAD && line_.empty() && (request_ || expected_.empty());
+}
+
+/**
+ * Decides how the body of the message whose head was just parsed is delimited (RFC 2616 section 4.4)
+ *
+ */
+void http_parser::start_body() {
+	bool http11 = head_.version != "HTTP/1.0";
+	keepAlive_ = http11 ? !head_.hasToken("Connection", "close") : head_.hasToken("Connection", "keep-alive");
+	
+	if (!request_) {
+		string method = expected_.empty() ? "" : expected_.front();
+		if ((head_.status >= 100 && head_.status < 200 && head_.status != 101) || head_.status == 204 || head_.status == 304 || method == "HEAD") {
+			state_ = S_DONE;
+			return;
+		}
+		if (head_.status == 101 || (method == "CONNECT" && head_.status / 100 == 2)) {
+			state_ = S_UNTIL_CLOSE;
+			keepAlive_ = false;
+			return;
+		}
+	}
+	
+	if (head_.has("Transfer-Encoding") && !head_.hasToken("Transfer-Encoding", "identity")) {
+		state_ = head_.hasToken("Transfer-Encoding", "chunked") ? S_CHUNK_SIZE : S_UNTIL_CLOSE;
+		if (state_ == S_UNTIL_CLOSE) keepAlive_ = false;
+	}
+	else if (head_.has("Content-Length")) {
+		remaining_ = strtoull(head_.get("Content-Length").c_str(), NULL, 10);
+		state_ = remaining_ > 0 ? S_LENGTH : S_DONE;
+	}
+	else if (request_)
+		state_ = S_DONE;
+	else {
+		state_ = S_UNTIL_CLOSE;
+		keepAlive_ = false;
+	}
+}
+
+/**
+ * Rejects a stream as soon as the start line cannot be HTTP, so that the bytes of other protocols are not held
+ * back waiting for the end of a head
+ * @param c the character just added to line_
+ * @return false if line_ cannot be the start of a message head
+ *
+ */
+bool http_parser::plausible(char c) const {
+	size_t n = line_.size();
+	
+	if (!request_)
+		return n > 5 || line_.compare(0, n, string("HTTP/", n)) == 0;
+	
+	string::size_type sp = n <= 32 ? line_.find(' ') : 0;
+	if (sp == string::npos) // in the method token
+		return n < 32 && ((c >= 'A' && c <= 'Z') || c == '-' || c == '_');
+	if (c == '\n' && line_.find('\n') == n - 1) // the request line is complete
+		return line_.find(" HTTP/") != string::npos;
+	return true;
+}
+
+/**
+ * Consumes input up to the next event
+ * @param data the stream bytes
+ * @param len number of bytes in data
+ * @param used set to the number of bytes consumed for the returned event
+ * @return the event reached, NEED_MORE when all input was consumed without reaching an event
+ *
+ */
+http_parser::event_type http_parser::parse(const char* data, size_t len, size_t& used) {
+	used = 0;
+	
+	switch (state_) {
+	case S_FAILED:
+		return ERROR;
+		
+	case S_DONE: {
+		bool interim = !request_ && head_.status >= 100 && head_.status < 200;
+		if (!request_ && !interim && !expected_.empty())
+			expected_.pop_front();
+		state_ = S_HEAD;
+		return END;
+	}
+	
+	case S_HEAD:
+		while (used < len) {
+			char c = data[used++];
+			if (line_.empty() && (c == '\r' || c == '\n')) // stray line ends between messages
+				continue;
+			line_ += c;
+			if (!plausible(c)) {
+				state_ = S_FAILED;
+				return ERROR; // line_ keeps the bytes of the rejected head
+			}
+			
+			size_t n = line_.size();
+			if ((n >= 4 && line_.compare(n - 4, 4, "\r\n\r\n") == 0) || (n >= 2 && line_.compare(n - 2, 2, "\n\n") == 0)) {
+				head_.clear();
+				if (!head_.parse(line_, request_)) {
+					state_ = S_FAILED;
+					return ERROR; // line_ keeps the bytes of the rejected head
+				}
+				line_.clear();
+				start_body();
+				return HEAD;
+			}
+			if (n > HTTP_MAX_HEAD) {
+				state_ = S_FAILED;
+				return ERROR; // line_ keeps the bytes of the rejected head
+			}
+		}
+		return NEED_MORE;
+		
+	case S_LENGTH:
+	case S_CHUNK_DATA:
+		if (len == 0) return NEED_MORE;
+		used = remaining_ < len ? (size_t) remaining_ : len;
+		remaining_ -= used;
+		if (remaining_ == 0)
+			state_ = state_ == S_LENGTH ? S_DONE : S_CHUNK_END;
+		return BODY;
+		
+	case S_CHUNK_SIZE:
+	case S_CHUNK_END:
+	case S_TRAILER:
+		while (used < len) {
+			char c = data[used++];
+			if (c != '\n') {
+				chunk_ += c;
+				if (chunk_.size() > HTTP_MAX_HEAD) {
+					state_ = S_FAILED;
+					chunk_.clear();
+					used = 0;
+					return ERROR;
+				}
+				continue;
+			}
+			
+			boost::trim(chunk_);
+			if (state_ == S_CHUNK_END)
+				state_ = S_CHUNK_SIZE;
+			else if (state_ == S_CHUNK_SIZE) {
+				if (chunk_.empty()) {
+					state_ = S_FAILED;
+					chunk_.clear();
+					used = 0;
+					return ERROR;
+				}
+				remaining_ = strtoull(chunk_.c_str(), NULL, 16);
+				state_ = remaining_ > 0 ? S_CHUNK_DATA : S_TRAILER;
+			}
+			else if (chunk_.empty())
+				state_ = S_DONE;
+			chunk_.clear();
+			return BODY;
+		}
+		return used > 0 ? BODY : NEED_MORE;
+		
+	case S_UNTIL_CLOSE:
+		used = len;
+		return len > 0 ? BODY : NEED_MORE;
+	}
+	
+	return NEED_MORE;
+}
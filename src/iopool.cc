@@ -0,0 +1,82 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "iopool.hh"
+#include "hbox.hh"
+
+io_service_pool::io_service_pool() : next_(0) {
+}
+
+io_service_pool::~io_service_pool() {
+	stop();
+	join();
+}
+
+/**
+ * Creates the io_services and starts one thread for each of them
+ * @param pool_size number of io_services, 0 means one per core
+ *
+ */
+void io_service_pool::start(size_t pool_size) {
+	if (!io_services_.empty())
+		return;
+	
+	if (pool_size == 0)
+		pool_size = boost::thread::hardware_concurrency();
+	if (pool_size == 0)
+		pool_size = 1;
+	
+	for (size_t i = 0; i < pool_size; i++) {
+		io_service_ptr ios(new ba::io_service);
+		io_services_.push_back(ios);
+		work_.push_back(ba::io_service::work(*ios));
+	}
+	
+	for (size_t i = 0; i < io_services_.size(); i++)
+		threads_.create_thread(boost::bind(&ba::io_service::run, io_services_[i]));
+	
+	HBOX_INFO("I/O pool started with " << pool_size << " threads");
+}
+
+/**
+ * Stops all io_services, pending handlers are abandoned
+ *
+ */
+void io_service_pool::stop() {
+	work_.clear();
+	for (size_t i = 0; i < io_services_.size(); i++)
+		io_services_[i]->stop();
+}
+
+void io_service_pool::join() {
+	threads_.join_all();
+}
+
+/**
+ * Picks the io_service for a new object in round robin
+ * @return the next io_service of the pool
+ *
+ */
+ba::io_service& io_service_pool::get_io_service() {
+	return *io_services_[next_++ % io_services_.size()];
+}
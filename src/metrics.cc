@@ -0,0 +1,289 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "metrics.hh"
+#include "bufferpool.hh"
+#include "rangecache.hh"
+#include "hbox.hh"
+
+#include <ctime>
+#include <sstream>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/lexical_cast.hpp>
+
+unsigned long long metrics_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+histogram::histogram() : count(0), sum(0) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		buckets[i] = 0;
+}
+
+void histogram::record(unsigned long long value) {
+	int i = 0;
+	while (i < HISTOGRAM_BUCKETS - 1 && value >= (1ULL << i))
+		i++;
+	buckets[i]++;
+	count++;
+	sum += value;
+}
+
+/**
+ * @param p the percentile, between 0 and 1
+ * @return the upper bound of the bucket the percentile falls in, 0 if nothing was recorded
+ *
+ */
+unsigned long long histogram::percentile(double p) const {
+	unsigned long long total = count;
+	if (total == 0)
+		return 0;
+	
+	unsigned long long rank = (unsigned long long) (p * total + 0.5), seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= rank && seen > 0)
+			return 1ULL << i;
+	}
+	return 1ULL << (HISTOGRAM_BUCKETS - 1);
+}
+
+void histogram::report(ostream& out, const string& name, const string& labels) const {
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+		out << name << "{" << labels << ",quantile=\"" << quantiles[i] << "\"} " << percentile(quantiles[i]) << "\n";
+	out << name << "_count{" << labels << "} " << getCount() << "\n";
+	out << name << "_sum{" << labels << "} " << getSum() << "\n";
+}
+
+/**
+ * Constructor of proxy_metrics class
+ * @param port the listening port of the proxy
+ * @param target the forwarding address and port
+ * @param peer the remote hbox, empty for a local media server
+ *
+ */
+proxy_metrics::proxy_metrics(int port, const string& target, const string& peer) : port(port),
+	target(target),
+	peer(peer),
+	accepted(0),
+	rejected(0),
+	idleTimeouts(0),
+	readTimeouts(0),
+	active(0),
+	tunneled(0),
+	connectFailures(0),
+	resumed(0),
+	upstreamReused(0),
+	warmed(0),
+	requests(0),
+	localResponses(0),
+	coalesced(0),
+	rewritten(0),
+	readPauses(0),
+	readResumes(0),
+	bytesToServer(0),
+	bytesToClient(0),
+	tuningFailures(0),
+	receiveBuffer(0),
+	sendBuffer(0) {
+	for (int c = 0; c < TRAFFIC_CLASSES; c++)
+		responses[c] = 0;
+}
+
+void proxy_metrics::report(ostream& out) const {
+	ostringstream labels;
+	labels << "port=\"" << port << "\",target=\"" << target << "\",peer=\"" << (peer.empty() ? "local" : peer) << "\"";
+	string l = labels.str();
+	
+	out << "hbox_proxy_connections_accepted{" << l << "} " << accepted << "\n";
+	out << "hbox_proxy_connections_active{" << l << "} " << active << "\n";
+	out << "hbox_proxy_connections_rejected{" << l << "} " << rejected << "\n";
+	out << "hbox_proxy_idle_timeouts{" << l << "} " << idleTimeouts << "\n";
+	out << "hbox_proxy_read_timeouts{" << l << "} " << readTimeouts << "\n";
+	out << "hbox_proxy_tunneled_connections{" << l << "} " << tunneled << "\n";
+	out << "hbox_proxy_connect_failures{" << l << "} " << connectFailures << "\n";
+	out << "hbox_proxy_resumed_responses{" << l << "} " << resumed << "\n";
+	out << "hbox_proxy_upstream_reused{" << l << "} " << upstreamReused << "\n";
+	out << "hbox_proxy_warmed_upstreams{" << l << "} " << warmed << "\n";
+	out << "hbox_proxy_requests{" << l << "} " << requests << "\n";
+	out << "hbox_proxy_local_responses{" << l << "} " << localResponses << "\n";
+	out << "hbox_proxy_coalesced_requests{" << l << "} " << coalesced << "\n";
+	out << "hbox_proxy_rewritten_responses{" << l << "} " << rewritten << "\n";
+	for (int c = 0; c < TRAFFIC_CLASSES; c++)
+		out << "hbox_proxy_responses{" << l << ",class=\"" << traffic_class_name((traffic_class) c) << "\"} " << responses[c] << "\n";
+	out << "hbox_proxy_read_pauses{" << l << "} " << readPauses << "\n";
+	out << "hbox_proxy_read_resumes{" << l << "} " << readResumes << "\n";
+	out << "hbox_proxy_bytes_to_server{" << l << "} " << bytesToServer << "\n";
+	out << "hbox_proxy_bytes_to_client{" << l << "} " << bytesToClient << "\n";
+	out << "hbox_proxy_socket_receive_buffer_bytes{" << l << "} " << receiveBuffer << "\n";
+	out << "hbox_proxy_socket_send_buffer_bytes{" << l << "} " << sendBuffer << "\n";
+	out << "hbox_proxy_socket_tuning_failures{" << l << "} " << tuningFailures << "\n";
+	if (!congestion.empty())
+		out << "hbox_proxy_socket_congestion_control{" << l << ",algorithm=\"" << congestion << "\"} 1\n";
+	connectTime.report(out, "hbox_proxy_connect_time_us", l);
+	firstByte.report(out, "hbox_proxy_first_byte_us", l);
+	throughput.report(out, "hbox_proxy_throughput_bytes_per_second", l);
+}
+
+metrics_registry& metrics_registry::instance() {
+	static metrics_registry registry;
+	return registry;
+}
+
+void metrics_registry::add(proxy_metrics::pointer metrics) {
+	lock_guard<mutex> lock(m);
+	proxies.push_back(metrics);
+}
+
+/**
+ * Writes all metrics in the Prometheus text format
+ * @param out the report
+ *
+ */
+void metrics_registry::report(ostream& out) {
+	out << "hbox_connections_active " << activeConnections << "\n";
+	
+	buffer_pool& buffers = buffer_pool::instance();
+	out << "hbox_buffer_pool_allocated_bytes " << buffers.getAllocated() << "\n";
+	out << "hbox_buffer_pool_in_use_bytes " << buffers.getInUse() << "\n";
+	
+	range_cache& cache = range_cache::instance();
+	if (cache.enabled()) {
+		out << "hbox_range_cache_hits " << cache.getHits() << "\n";
+		out << "hbox_range_cache_misses " << cache.getMisses() << "\n";
+		out << "hbox_range_cache_bytes " << cache.getSize() << "\n";
+	}
+	
+	lock_guard<mutex> lock(m);
+	for (list<boost::weak_ptr<proxy_metrics> >::iterator it = proxies.begin(); it != proxies.end(); ) {
+		proxy_metrics::pointer metrics = it->lock();
+		if (!metrics) {
+			it = proxies.erase(it);
+			continue;
+		}
+		metrics->report(out);
+		it++;
+	}
+}
+
+/**
+ * A request on the metrics port: the request is read and answered with the report, then the socket is closed
+ *
+ */
+class metrics_session : public boost::enable_shared_from_this<metrics_session> {
+public:
+	metrics_session(boost::shared_ptr<ba::ip::tcp::socket> socket) : socket(socket) {}
+	
+	void start() {
+		ba::async_read_until(*socket, request, "\r\n\r\n",
+							 boost::bind(&metrics_session::handle_read, shared_from_this(), ba::placeholders::error));
+	}
+	
+private:
+	void handle_read(const bs::error_code& err) {
+		if (err)
+			return;
+		
+		ostringstream body;
+		metrics_registry::instance().report(body);
+		response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+				   boost::lexical_cast<string>(body.str().size()) + "\r\nConnection: close\r\n\r\n" + body.str();
+		ba::async_write(*socket, ba::buffer(response),
+						boost::bind(&metrics_session::handle_write, shared_from_this()));
+	}
+	
+	void handle_write() {
+		bs::error_code ignored;
+		socket->shutdown(ba::ip::tcp::socket::shutdown_both, ignored);
+		socket->close(ignored);
+	}
+	
+	boost::shared_ptr<ba::ip::tcp::socket> socket;
+	ba::streambuf request;
+	string response;
+};
+
+/**
+ * Opens the metrics port and starts accepting
+ * @param io_service the io_service which runs the server
+ * @param port the loopback port to listen on
+ * @return the server, which runs until it is closed
+ *
+ */
+metrics_server::pointer metrics_server::create(ba::io_service& io_service, int port) {
+	pointer server(new metrics_server(io_service, port));
+	io_service.post(boost::bind(&metrics_server::start_accept, server));
+	return server;
+}
+
+metrics_server::metrics_server(ba::io_service& io_service, int port) : io_service_(io_service),
+	acceptor_(io_service,
+	ba::ip::tcp::endpoint(ba::ip::address_v4::loopback(), port)),
+	retry_(io_service) {
+	HBOX_INFO("Metrics are reported on 127.0.0.1:" << port);
+}
+
+void metrics_server::start_accept() {
+	boost::shared_ptr<ba::ip::tcp::socket> socket(new ba::ip::tcp::socket(io_service_));
+	acceptor_.async_accept(*socket, boost::bind(&metrics_server::handle_accept, shared_from_this(), socket,
+												ba::placeholders::error));
+}
+
+void metrics_server::handle_accept(boost::shared_ptr<ba::ip::tcp::socket> socket, const bs::error_code& err) {
+	if (err == ba::error::operation_aborted || !acceptor_.is_open())
+		return;
+	if (err) {
+		// a lack of file descriptors passes, the port accepts again after a while instead of spinning
+		HBOX_WARN("Cannot accept on the metrics port: " << err.message());
+		retry_.expires_from_now(boost::posix_time::seconds(METRICS_ACCEPT_RETRY));
+		retry_.async_wait(boost::bind(&metrics_server::handle_retry, shared_from_this(), ba::placeholders::error));
+		return;
+	}
+	
+	boost::shared_ptr<metrics_session> session(new metrics_session(socket));
+	session->start();
+	start_accept();
+}
+
+void metrics_server::handle_retry(const bs::error_code& err) {
+	if (!err && acceptor_.is_open())
+		start_accept();
+}
+
+/**
+ * Closes the metrics port. May be called from any thread.
+ *
+ */
+void metrics_server::close() {
+	io_service_.post(boost::bind(&metrics_server::handle_close, shared_from_this()));
+}
+
+void metrics_server::handle_close() {
+	bs::error_code ignored;
+	acceptor_.close(ignored);
+	retry_.cancel(ignored);
+}
@@ -23,151 +23,652 @@ THE SOFTWARE.
 #include "proxyconnection.hh"
 #include "hbox.hh"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdio>
+
+// largest amount of data moved by one splice() call
+#define SPLICE_CHUNK (1 << 16)
+// requested capacity of the splice pipes, large enough to keep a high-RTT link busy
+#define SPLICE_PIPE_SIZE (1 << 18)
+
 /** 
  * 
  * 
  * @param io_service 
  */
-tcp_connection::tcp_connection(ba::io_service& io_service, string forwardIP, int forwardPort) : io_service_(io_service),
-																						forwardIP(forwardIP),
-																						forwardPort(forwardPort),
+tcp_connection::tcp_connection(ba::io_service& io_service, proxy_context::pointer context) : io_service_(io_service),
+																						home_(context),
+																						context_(context),
 																						csocket_(io_service),
 																						ssocket_(io_service),
 																						resolver_(io_service),
-																						proxy_closed(false),
-																						isPersistent(false),
-																						isOpened(false) {
+																						stagger_(io_service),
+																						raced(0),
+																						racing(0),
+																						isTunneled(false),
+																						isOpened(false),
+																						isFailed(false),
+																						isClosed(false),
+																						isDraining(false),
+																						drainStart(0),
+																						mode(context->settings.mode),
+																						generation_(0),
+																						isTracking(true),
+																						requests(true),
+																						responses(false),
+																						resumed_(false),
+																						isResuming(false),
+																						resumer_(io_service),
+																						isServingLocal(false),
+																						trafficClass(TRAFFIC_CLASSES),
+																						isHeldBack(false),
+																						followId(-1),
+																						followed(0),
+																						startTime(0),
+																						connectStart(0),
+																						clientBytes(0),
+																						lastActivity(0),
+																						cpipe_pending(0),
+																						spipe_pending(0),
+																						uring_(NULL) {
+	cpipe[0] = cpipe[1] = spipe[0] = spipe[1] = -1;
+	for (int i = 0; i < 2; i++) {
+		ubuffer[i] = NULL;
+		uslot[i] = -1;
+		uheld[i] = usent[i] = 0;
+	}
+	
+	if (context->routes)
+		mode = RELAY_BUFFERED; // requests are routed by their head
+	if (mode == RELAY_SPLICE && !open_splice_pipes()) {
+		HBOX_WARN("Zero-copy relay is not available, falling back to buffered relay");
+		mode = RELAY_BUFFERED;
+	}
+	if (mode == RELAY_URING) {
+		uring_ = &ba::use_service<uring_engine>(io_service);
+		if (!uring_->available())
+			mode = RELAY_BUFFERED; // the engine warned when its ring could not be set up
+	}
+	isTracking = mode == RELAY_BUFFERED;
+}
+
+tcp_connection::~tcp_connection() {
+	abandon_shared();
+	leave_shared();
+	
+	if (startTime) {
+		unsigned long long duration = metrics_now() - startTime;
+		home_->metrics->active--;
+		metrics_registry::instance().activeConnections--;
+		if (clientBytes >= BUFFER_MAX_SIZE && duration > 0)
+			context_->metrics->throughput.record(clientBytes * 1000000 / duration);
+	}
+	
+	for (int i = 0; i < 2; i++) {
+		relay_direction& f = flow(i == 0);
+		release_buffer(i == 0);
+		for (size_t j = 0; j < f.queue.size(); j++)
+			buffer_pool::instance().release(f.queue[j].buffer, f.queue[j].bufferSize);
+	}
+	
+	for (int i = 0; i < 2; i++)
+		if (ubuffer[i])
+			uring_->release(ubuffer[i], uslot[i]);
+	
+	int* fds[] = { cpipe, spipe };
+	for (int i = 0; i < 2; i++)
+		for (int j = 0; j < 2; j++)
+			if (fds[i][j] >= 0) ::close(fds[i][j]);
 }
 
 /** 
- * 
+ * Starts the connection on its own io_service, the acceptor may run on another thread.
  * 
  */
 void tcp_connection::start() {
-	async_read(csocket_, ba::buffer(cbuffer), ba::transfer_at_least(1),
-			   boost::bind(&tcp_connection::handle_client_read_data,
-						   shared_from_this(),
-						   ba::placeholders::error,
-						   ba::placeholders::bytes_transferred));
+	startTime = lastActivity = metrics_now();
+	home_->metrics->active++;
+	metrics_registry::instance().activeConnections++;
+	io_service_.post(boost::bind(&tcp_connection::handle_start, shared_from_this()));
+}
+
+/** 
+ * Called by the proxy server every second from its own thread, the check runs on the io_service of the connection
+ * 
+ */
+void tcp_connection::check_timeouts() {
+	io_service_.post(boost::bind(&tcp_connection::handle_check_timeouts, shared_from_this()));
 }
 
 /** 
+ * Asks the connection to close once it is between exchanges, may be called from any thread
  * 
+ */
+void tcp_connection::drain() {
+	io_service_.post(boost::bind(&tcp_connection::handle_drain, shared_from_this()));
+}
+
+void tcp_connection::handle_drain() {
+	if (isClosed || isDraining)
+		return;
+	
+	HBOX_DEBUG("Draining a connection");
+	isDraining = true;
+	drainStart = metrics_now();
+	update_close_state();
+}
+
+/** 
+ * Closes a connection which moved no data for the idle timeout, or which waits longer than the read timeout for
+ * data it is owed: the connect of the remote server, the response to a forwarded request or the rest of a request
+ * the client started. A direction paused by its watermark is not waiting. A front door connection connects once a
+ * request names its remote server. A connection to a remote server whose device went away drains, and is closed
+ * when it has not finished draining by the drain timeout.
  * 
- * @param err 
- * @param len 
  */
-void tcp_connection::handle_client_read_data(const bs::error_code& err, size_t len) {
-	if(!err) 
-	{
-	    HBOX_DEBUG("Read something from client, with len: " << len);
-		start_connect(len);
+void tcp_connection::handle_check_timeouts() {
+	if (isClosed)
+		return;
+	
+	const proxy_settings& settings = context_->settings;
+	unsigned long long now = metrics_now();
+	
+	if (!isDraining && context_->retired)
+		handle_drain();
+	if (isDraining && !isClosed && now - drainStart > settings.drainTimeout * 1000000ULL) {
+		HBOX_INFO("Closing a connection which did not drain in " << settings.drainTimeout << " seconds");
+		shutdown();
+	}
+	if (isClosed)
+		return;
+	
+	if (settings.idleTimeout > 0 && now - lastActivity > settings.idleTimeout * 1000000ULL) {
+		HBOX_INFO("Closing a connection idle for " << settings.idleTimeout << " seconds");
+		context_->metrics->idleTimeouts++;
+		if (upstream_reusable() && sflow.drained() && !isServingLocal)
+			recycle_upstream();
+		else
+			shutdown();
+		return;
+	}
+	
+	if (settings.readTimeout <= 0)
+		return;
+	unsigned long long limit = settings.readTimeout * 1000000ULL;
+	bool late = false;
+	
+	if (!isOpened && !isFailed) {
+		if (!home_->routes || context_ != home_)
+			late = now - max(startTime, connectStart) > limit;
+	}
+	else if (isTracking) {
+		if (!exchanges.empty() && !sflow.finished && !sflow.paused && !isHeldBack)
+			late = now - max(sflow.lastRead, exchanges.front().sent) > limit;
+		if (!requests.idle() && !cflow.finished && !cflow.paused)
+			late = late || now - cflow.lastRead > limit;
+	}
+	
+	if (late && isOpened && resume_upstream())
+		return;
+	if (late) {
+		HBOX_INFO("Closing a connection which waited " << settings.readTimeout << " seconds for data");
+		context_->metrics->readTimeouts++;
+		shutdown();
 	}
-	else 
-		shutdown();	
 }
 
 /** 
+ * Starts both directions of the relay. The client is read while the connection to the remote server is
+ * still being set up, so the first request does not wait for the connect.
  * 
+ */
+void tcp_connection::handle_start() {
+	home_->settings.tuning.apply(csocket_.native_handle(), false, *home_->metrics);
+	if (!context_->routes)
+		start_connect();
+	if (mode == RELAY_BUFFERED)
+		start_read(true);
+}
+
+/** 
+ * Waits until the source socket of a direction has data. Reading pauses when the queue of the direction reaches
+ * its high watermark and resumes once the queue is written down to the low watermark, so a slow consumer makes
+ * the producer wait instead of growing the queue. The client is not read while a response is served locally, and
+ * the remote server is not read while a follower of the shared response is a whole window behind.
  * 
- * @param err 
- * @param len 
+ * @param toServer the direction
  */
-void tcp_connection::handle_server_write(const bs::error_code& err, size_t len) {
-	if(!err) {
-	    HBOX_DEBUG("Successfully write to the server, with len: " << len);
-		async_read(ssocket_, ba::buffer(sbuffer), ba::transfer_at_least(1),
-				   boost::bind(&tcp_connection::handle_server_read_data,
-							   shared_from_this(),
-							   ba::placeholders::error,
-							   ba::placeholders::bytes_transferred));
+void tcp_connection::start_read(bool toServer) {
+	relay_direction& f = flow(toServer);
+	if (isClosed || f.reading || f.finished || (toServer && isServingLocal))
+		return;
+	if (!toServer && !isOpened)
+		return;
+	if (!toServer && shared_ && (isHeldBack = shared_->lagging(waker_)))
+		return; // the follower wakes the connection up
+	
+	if (!f.paused && !f.queue.empty() && f.queued >= high_watermark(toServer)) {
+		HBOX_DEBUG("Pausing " << (toServer ? "client" : "server") << " reads at " << f.queued << " queued bytes");
+		f.paused = true;
+		context_->metrics->readPauses++;
 	}
-	else {
-		shutdown();
+	if (f.paused) {
+		if (f.queued > low_watermark(toServer))
+			return;
+		f.paused = false;
+		context_->metrics->readResumes++;
 	}
+	
+	ba::ip::tcp::socket& from = toServer ? csocket_ : ssocket_;
+	f.reading = true;
+	from.async_read_some(ba::null_buffers(),
+						 make_alloc_handler(f.readMemory,
+											boost::bind(&tcp_connection::handle_readable,
+														shared_from_this(),
+														ba::placeholders::error,
+														toServer, generation_)));
 }
 
 /** 
  * 
  * 
  * @param err 
- * @param len 
+ * @param toServer the direction
+ * @param generation the connection to the remote server the read was started on
  */
-void tcp_connection::handle_server_read_data(const bs::error_code& err, size_t len) {
-	if(!err || err == ba::error::eof) {
-		if(err == ba::error::eof)
-			proxy_closed = true;
-		ba::async_write(csocket_, ba::buffer(sbuffer,len),
-						boost::bind(&tcp_connection::handle_client_write,
-									shared_from_this(),
-									ba::placeholders::error,
-									ba::placeholders::bytes_transferred));
-	} 
-	else {
+void tcp_connection::handle_readable(const bs::error_code& err, bool toServer, unsigned generation) {
+	if (!toServer && generation != generation_)
+		return; // the front door moved to another remote server
+	flow(toServer).reading = false;
+	if (isClosed)
+		return;
+	
+	bs::error_code ec = err;
+	size_t len = 0;
+	
+	if(!ec) {
+		len = read_available(toServer, ec);
+		if(ec == ba::error::would_block) {
+			start_read(toServer);
+			return;
+		}
+	}
+	
+	if(!ec) {
+		HBOX_DEBUG("Read something from " << (toServer ? "client" : "server") << ", with len: " << len);
+		flow(toServer).lastRead = lastActivity = metrics_now();
+		process(toServer, len);
+	}
+	else if(!toServer && resume_upstream())
+		return;
+	else if(ec == ba::error::eof)
+		handle_end_of_stream(toServer);
+	else
 		shutdown();
+}
+
+/** 
+ * Server data may be queued up to the read-ahead window, so that the stream keeps flowing while the client is
+ * slow to take it.
+ * 
+ * @param toServer the direction
+ * @return the number of queued bytes which pauses reading the direction
+ */
+size_t tcp_connection::high_watermark(bool toServer) const {
+	const proxy_settings& settings = context_->settings;
+	return toServer ? settings.highWatermark : max(settings.highWatermark, settings.prefetchWindow);
+}
+
+/** 
+ * @param toServer the direction
+ * @return the number of queued bytes at which a paused direction is read again, in the same proportion to the
+ * high watermark for both directions
+ */
+size_t tcp_connection::low_watermark(bool toServer) const {
+	const proxy_settings& settings = context_->settings;
+	return (unsigned long long) high_watermark(toServer) * settings.lowWatermark / max(settings.highWatermark, (size_t) 1);
+}
+
+/** 
+ * Reads what the source socket of a direction holds into a pooled buffer. The size class of the direction grows
+ * when a read fills the buffer and shrinks when reads stay short.
+ * 
+ * @param toServer the direction
+ * @param err set to would_block if there was nothing to read after all
+ * @return number of bytes read
+ */
+size_t tcp_connection::read_available(bool toServer, bs::error_code& err) {
+	ba::ip::tcp::socket& from = toServer ? csocket_ : ssocket_;
+	relay_direction& f = flow(toServer);
+	
+	if(!from.non_blocking())
+		from.non_blocking(true, err);
+	
+	f.size = f.want;
+	f.buffer = buffer_pool::instance().acquire(f.size);
+	size_t len = from.read_some(ba::buffer(f.buffer, f.size), err);
+	if(err) {
+		release_buffer(toServer);
+		return 0;
 	}
+	
+	if(len == f.size)
+		f.want = buffer_pool::grow(f.size);
+	else if(len <= f.size / 4)
+		f.want = buffer_pool::shrink(f.size);
+	return len;
 }
 
 /** 
+ * Gives the read buffer of a direction back to the pool
  * 
+ * @param toServer the direction
+ */
+void tcp_connection::release_buffer(bool toServer) {
+	relay_direction& f = flow(toServer);
+	
+	buffer_pool::instance().release(f.buffer, f.size);
+	f.buffer = NULL;
+	f.size = 0;
+}
+
+/** 
+ * Passes the data just read to the other side. While the connection is tracked, message heads are parsed first
+ * so that the range cache can answer or store them; body bytes are queued straight from the read buffer.
  * 
- * @param err 
- * @param len 
+ * @param toServer the direction
+ * @param len number of bytes in the read buffer of the direction
  */
-void tcp_connection::handle_client_write(const bs::error_code& err, size_t len) {
-	if(!err) {
-		if(!proxy_closed)
-			async_read(ssocket_, ba::buffer(sbuffer,len), ba::transfer_at_least(1),
-					   boost::bind(&tcp_connection::handle_server_read_data,
-								   shared_from_this(),
-								   ba::placeholders::error,
-								   ba::placeholders::bytes_transferred));
-		else {
- 			if(isPersistent && !proxy_closed) {  				
-  				start();
- 			}
+void tcp_connection::process(bool toServer, size_t len) {
+	relay_direction& f = flow(toServer);
+	http_parser& parser = toServer ? requests : responses;
+	const char* data = f.buffer;
+	size_t used;
+	http_parser::event_type ev;
+	
+	if(!toServer && isResuming)
+		on_resumed_head(data, len);
+	if(!toServer && isTracking && len > 0 && responses.pending() == 0) {
+		HBOX_DEBUG("Remote server sent data nobody asked for, the connection is not HTTP");
+		stop_tracking();
+	}
+	
+	while(isTracking && !isClosed && !f.finished && (ev = parser.parse(data, len, used)) != http_parser::NEED_MORE) {
+		if(ev == http_parser::ERROR) {
+			HBOX_DEBUG("Connection does not speak HTTP, the upstream connection will not be reused");
+			stop_tracking(); // queues the bytes the parsers held back
+			break;
+		}
+		
+		data += used;
+		len -= used;
+		
+		if(ev == http_parser::HEAD) {
+			if(toServer ? on_request_head(len) : on_response_head())
+				continue; // answered locally or forwarded with a changed head
+			enqueue(toServer, parser.head().raw);
+		}
+		else if(ev == http_parser::BODY) {
+			if(!toServer && fill_.active() && !responses.chunked())
+				fill_.write(data - used, used);
+			if(!toServer && on_response_body(data - used, used))
+				continue;
+			enqueue(toServer, data - used, used);
+		}
+		else if(ev == http_parser::END && !toServer)
+			on_response_end();
+	}
+	
+	if(!isTracking && len > 0)
+		enqueue(toServer, data, len);
+	
+	// the last chunk which points into the read buffer gives it back
+	for (size_t i = f.queue.size(); i > 0 && f.buffer; i--) {
+		relay_chunk& chunk = f.queue[i - 1];
+		if (!chunk.buffer && !chunk.text && chunk.data >= f.buffer && chunk.data < f.buffer + f.size) {
+			chunk.buffer = f.buffer;
+			chunk.bufferSize = f.size;
+			f.buffer = NULL;
+			f.size = 0;
 		}
-	} 
-	else {
-		shutdown();
 	}
+	release_buffer(toServer);
+	
+	if(toServer && isFailed && !f.queue.empty()) {
+		shutdown(); // a request needs the remote server which is not there
+		return;
+	}
+	
+	flush(toServer);
+	start_read(toServer);
 }
 
-void tcp_connection::shutdown() {
-	ssocket_.close();
-	csocket_.close();
+/** 
+ * Queues bytes of the read buffer of a direction
+ * 
+ */
+void tcp_connection::enqueue(bool toServer, const char* data, size_t len) {
+	if (len == 0) return;
+	
+	relay_direction& f = flow(toServer);
+	relay_chunk chunk;
+	chunk.data = data;
+	chunk.len = len;
+	if (f.queue.full())
+		f.queue.set_capacity(2 * f.queue.capacity());
+	f.queue.push_back(chunk);
+	f.queued += len;
 }
 
 /** 
+ * Queues a copy of some text, used for message heads and rewritten bodies
  * 
+ */
+void tcp_connection::enqueue(bool toServer, const string& text) {
+	if (text.empty()) return;
+	
+	relay_direction& f = flow(toServer);
+	if (f.queue.full())
+		f.queue.set_capacity(2 * f.queue.capacity());
+	f.queue.push_back(relay_chunk());
+	f.queue.back().text = boost::make_shared<const string>(text);
+	f.queued += text.size();
+}
+
+/** 
+ * Writes the queue of a direction to its destination with one gathered write. The write takes its handler memory
+ * and its list of buffers from the direction, so it allocates nothing.
  * 
+ * @param toServer the direction
  */
-void tcp_connection::start_connect(size_t len) {
-	std::string server = forwardIP;
-	std::string port =  boost::lexical_cast<string>(forwardPort);
+void tcp_connection::flush(bool toServer) {
+	relay_direction& f = flow(toServer);
+	if (isClosed || f.writing || f.queue.empty() || (toServer && !isOpened))
+		return;
+	
+	size_t n = min(f.queue.size(), (size_t) RELAY_GATHER);
+	for (size_t i = 0; i < n; i++)
+		f.gather[i] = f.queue[i].bytes();
 	
-	if(!isOpened) {
-		HBOX_DEBUG("Trying to connect to remote server at: " << server << ":" << port);
-		ba::ip::tcp::resolver::query query(server, port);
-		resolver_.async_resolve(query, boost::bind(&tcp_connection::handle_resolve, shared_from_this(),
-									   boost::asio::placeholders::error,
-									   boost::asio::placeholders::iterator,
-									   len));
-	} 
+	f.writing = true;
+	f.inFlight = n;
+	ba::async_write(toServer ? ssocket_ : csocket_, buffer_range(f.gather, f.gather + n),
+					make_alloc_handler(f.writeMemory,
+									   boost::bind(&tcp_connection::handle_write, shared_from_this(),
+												   ba::placeholders::error,
+												   ba::placeholders::bytes_transferred,
+												   toServer)));
+}
+
+/** 
+ * 
+ * 
+ * @param err 
+ * @param len 
+ * @param toServer the direction
+ */
+void tcp_connection::handle_write(const bs::error_code& err, size_t len, bool toServer) {
+	relay_direction& f = flow(toServer);
+	f.writing = false;
+	
+	for (; f.inFlight > 0; f.inFlight--) {
+		buffer_pool::instance().release(f.queue.front().buffer, f.queue.front().bufferSize);
+		f.queued -= f.queue.front().size();
+		f.queue.pop_front();
+	}
+	
+	if(err || isClosed) {
+		shutdown();
+		return;
+	}
+	HBOX_DEBUG("Successfully write to the " << (toServer ? "server" : "client") << ", with len: " << len);
+	lastActivity = metrics_now();
+	if (toServer)
+		context_->metrics->bytesToServer += len;
 	else {
-	    start_forward_to_server(len);
+		context_->metrics->bytesToClient += len;
+		clientBytes += len;
 	}
+	
+	if(!toServer && isServingLocal)
+		feed_local();
+	
+	flush(toServer);
+	start_read(toServer);
+	update_close_state();
 }
 
 /** 
+ * Forwards the end of stream of one direction to the peer while the other direction keeps running.
  * 
+ * @param socket the socket which will not be written anymore
+ */
+void tcp_connection::half_close(ba::ip::tcp::socket& socket) {
+	bs::error_code ignored;
+	socket.shutdown(ba::ip::tcp::socket::shutdown_send, ignored);
+}
+
+/** 
+ * One side has finished sending
  * 
+ * @param toServer true when the client finished, false when the remote server finished
  */
-void tcp_connection::start_forward_to_server(size_t len) {
-	ba::async_write(ssocket_, ba::buffer(cbuffer,len),
-					boost::bind(&tcp_connection::handle_server_write, shared_from_this(),
-								ba::placeholders::error,
-								ba::placeholders::bytes_transferred));
+void tcp_connection::handle_end_of_stream(bool toServer) {
+	flow(toServer).finished = true;
+	if (!toServer) {
+		fill_.commit(); // a body cut short still leaves a valid range
+		abandon_shared();
+		ahead_.end = min(ahead_.end, ahead_.received());
+		if (isServingLocal && local_.fd < 0)
+			feed_local();
+	}
+	update_close_state();
+}
+
+/** 
+ * Passes the end of stream of a direction on once its queue is written and closes the connection when both
+ * directions are done. A keep-alive upstream stays open until the responses the client waits for are delivered.
+ * 
+ */
+void tcp_connection::update_close_state() {
+	if (isClosed)
+		return;
+	
+	if (isDraining && isTracking && cflow.drained() && sflow.drained() && !isServingLocal && exchanges.empty() &&
+		requests.idle() && responses.idle()) {
+		HBOX_DEBUG("A draining connection is between exchanges, closing it");
+		shutdown();
+		return;
+	}
+	
+	if (sflow.finished && !sflow.shut && sflow.drained()) {
+		sflow.shut = true;
+		half_close(csocket_);
+	}
+	
+	if (cflow.finished && !cflow.shut && cflow.drained()) {
+		if (!isOpened) {
+			bool unrouted = home_->routes && context_ == home_;
+			if ((isFailed || unrouted) && sflow.drained() && !isServingLocal)
+				shutdown();
+			return; // handle_connect comes back here
+		}
+		
+		if (isTracking && sflow.drained() && !isServingLocal && responses.idle()) {
+			// the last response of a client which already left is delivered
+			if (upstream_reusable())
+				recycle_upstream();
+			else
+				shutdown();
+			return;
+		}
+		if (!isTracking || !requests.idle() || !requests.keepAlive() || responses.untilClose()) {
+			cflow.shut = true;
+			half_close(ssocket_);
+		}
+	}
+	
+	if (cflow.finished && sflow.finished && cflow.drained() && sflow.drained() && !isServingLocal)
+		shutdown();
+}
+
+void tcp_connection::shutdown() {
+	isClosed = true;
+	local_.close();
+	abandon_shared();
+	leave_shared();
+	stop_racing();
+	
+	bs::error_code ignored;
+	resumer_.cancel(ignored);
+	if (mode == RELAY_URING) {
+		// the operations in the ring keep the sockets open, this completes them
+		csocket_.shutdown(ba::ip::tcp::socket::shutdown_both, ignored);
+		ssocket_.shutdown(ba::ip::tcp::socket::shutdown_both, ignored);
+	}
+	ssocket_.close(ignored);
+	csocket_.close(ignored);
+}
+
+/** 
+ * Connects the remote server: through a pooled connection, the tunnel to its hbox while the tunnel is up, or
+ * directly
+ * 
+ */
+void tcp_connection::start_connect() {
+	if(context_->upstreams.acquire(ssocket_)) {
+		context_->metrics->upstreamReused++;
+		handle_connect(bs::error_code());
+		return;
+	}
+	
+	connectStart = metrics_now();
+	raced = racing = 0;
+	isTunneled = false;
+	if(context_->tunnel && context_->tunnel->ready()) {
+		// the tunnel to the remote hbox is already connected, its portal is on the loopback
+		context_->metrics->tunneled++;
+		isTunneled = true;
+		endpoints_.assign(1, ba::ip::tcp::endpoint(ba::ip::address_v4::loopback(), context_->tunnel->port()));
+		race_next();
+		return;
+	}
+	if(context_->resolved.lookup(endpoints_)) {
+		race_next();
+		return;
+	}
+	
+	std::string server = context_->forwardIP;
+	std::string port =  boost::lexical_cast<string>(context_->forwardPort);
+	
+	HBOX_DEBUG("Trying to connect to remote server at: " << server << ":" << port);
+	ba::ip::tcp::resolver::query query(server, port);
+	resolver_.async_resolve(query, boost::bind(&tcp_connection::handle_resolve, shared_from_this(),
+								   boost::asio::placeholders::error,
+								   boost::asio::placeholders::iterator, generation_));
 }
 
 /** 
@@ -175,45 +676,1184 @@ void tcp_connection::start_forward_to_server(size_t len) {
  * 
  * @param err 
  * @param endpoint_iterator 
+ * @param generation the route the resolve was started for, a resolve of a previous route is dropped
  */
 void tcp_connection::handle_resolve(const boost::system::error_code& err,
-								ba::ip::tcp::resolver::iterator endpoint_iterator, size_t len) {
+								ba::ip::tcp::resolver::iterator endpoint_iterator, unsigned generation) {
+	if (isClosed || generation != generation_)
+		return;
     if (!err) {
-		ba::ip::tcp::endpoint endpoint = *endpoint_iterator;
-		ssocket_.async_connect(endpoint,
-							  boost::bind(&tcp_connection::handle_connect, shared_from_this(),
-										  boost::asio::placeholders::error,
-										  ++endpoint_iterator,
-										  len));
+		endpoints_.assign(endpoint_iterator, ba::ip::tcp::resolver::iterator());
+		context_->resolved.store(endpoints_);
+		race_next();
     }
-    else {
-		shutdown();
+    else
+		handle_connect(err);
+}
+
+/** 
+ * Starts the connect to the next candidate of the remote server on a socket of its own. Unless it fails first,
+ * the candidate after it joins the race once the stagger delay has passed, so a blackholed address only delays
+ * the connection by that much.
+ * 
+ */
+void tcp_connection::race_next() {
+	if (raced == 0)
+		racers_.assign(endpoints_.size(), boost::shared_ptr<ba::ip::tcp::socket>());
+	
+	size_t index = raced++;
+	racing++;
+	racers_[index].reset(new ba::ip::tcp::socket(io_service_));
+	bs::error_code err;
+	racers_[index]->open(endpoints_[index].protocol(), err);
+	if (!err) {
+		// the buffers set before the connect decide the window scale, Fast Open only pays off across the WAN
+		bool peer = !context_->peer.empty() && !endpoints_[index].address().is_loopback();
+		context_->settings.tuning.apply(racers_[index]->native_handle(), peer, *context_->metrics);
+	}
+	racers_[index]->async_connect(endpoints_[index],
+								  boost::bind(&tcp_connection::handle_race, shared_from_this(),
+											  boost::asio::placeholders::error,
+											  index, generation_));
+	
+	if (raced < endpoints_.size() && context_->settings.connectStagger > 0) {
+		stagger_.expires_from_now(boost::posix_time::milliseconds(context_->settings.connectStagger));
+		stagger_.async_wait(boost::bind(&tcp_connection::handle_stagger, shared_from_this(),
+										boost::asio::placeholders::error, generation_));
 	}
 }
 
+/** 
+ * The first candidate to connect becomes the socket to the remote server and is remembered for the next
+ * connections, the others are closed. A failed candidate hands its turn to the next one right away; the
+ * connect fails once all candidates did.
+ * 
+ * @param err 
+ * @param index the position of the candidate in endpoints_
+ * @param generation the connection to a remote server the race was started for
+ */
+void tcp_connection::handle_race(const boost::system::error_code& err, size_t index, unsigned generation) {
+	if (generation != generation_ || index >= racers_.size() || !racers_[index])
+		return; // the race is over
+	
+	boost::shared_ptr<ba::ip::tcp::socket> racer = racers_[index];
+	racers_[index].reset();
+	racing--;
+	if (isClosed)
+		return;
+	
+	if (!err) {
+		stop_racing();
+		ssocket_ = std::move(*racer);
+		if (endpoints_.size() > 1 && !isTunneled)
+			context_->resolved.prefer(endpoints_[index]);
+		handle_connect(err);
+		return;
+	}
+	
+	HBOX_DEBUG("Could not connect " << endpoints_[index] << ": " << err.message());
+	if (raced < endpoints_.size())
+		race_next();
+	else if (racing == 0)
+		handle_connect(err);
+}
+
 /** 
  * 
  * 
  * @param err 
- * @param endpoint_iterator 
+ * @param generation the connection to a remote server the race was started for
+ */
+void tcp_connection::handle_stagger(const boost::system::error_code& err, unsigned generation) {
+	if (err || generation != generation_ || isClosed || isOpened || raced == 0 || raced >= endpoints_.size())
+		return;
+	if (stagger_.expires_at() > ba::deadline_timer::traits_type::now())
+		return; // restarted by a failed candidate after this wait completed
+	
+	race_next();
+}
+
+/** 
+ * Closes the connects still in flight
+ * 
  */
-void tcp_connection::handle_connect(const boost::system::error_code& err,
-								ba::ip::tcp::resolver::iterator endpoint_iterator, size_t len) {
+void tcp_connection::stop_racing() {
+	bs::error_code ignored;
+	stagger_.cancel(ignored);
+	for (size_t i = 0; i < racers_.size(); i++) {
+		if (racers_[i])
+			racers_[i]->close(ignored);
+	}
+	racers_.clear();
+	racing = 0;
+}
+
+/** 
+ * Once the remote server is connected both pumps run: the server is read right away and the client data that
+ * arrived during the connect is flushed. If it cannot be connected, a client whose requests are all answered by
+ * the range cache is still served.
+ * 
+ * @param err 
+ */
+void tcp_connection::handle_connect(const boost::system::error_code& err) {
+	if (isClosed)
+		return;
+	
     if (!err) {
         HBOX_DEBUG("Successfully open the connection to remote server");
 		isOpened = true;
-		start_forward_to_server(len);
-    } 
-    else if (endpoint_iterator != ba::ip::tcp::resolver::iterator()) {
-		ssocket_.close();
-		ba::ip::tcp::endpoint endpoint = *endpoint_iterator;
-		ssocket_.async_connect(endpoint,
-							  boost::bind(&tcp_connection::handle_connect, shared_from_this(),
-										  boost::asio::placeholders::error,
-										  ++endpoint_iterator,
-										  len));
+		if(trafficClass != TRAFFIC_CLASSES) {
+			mark_traffic(ssocket_, context_->settings.dscp[trafficClass], trafficClass);
+			context_->settings.tuning.apply_class(ssocket_.native_handle(), trafficClass);
+		}
+		if(connectStart)
+			context_->metrics->connectTime.record(metrics_now() - connectStart);
+		if(mode == RELAY_SPLICE) {
+			start_splice_read(true);
+			start_splice_read(false);
+			return;
+		}
+		if(mode == RELAY_URING) {
+			for (int i = 0; i < 2; i++)
+				ubuffer[i] = uring_->acquire(uslot[i]);
+			start_uring_read(true);
+			start_uring_read(false);
+			return;
+		}
+		
+		start_read(false);
+		flush(true);
+		update_close_state();
     } 
     else {
+		if (!isTunneled)
+			context_->resolved.invalidate(); // resolve again on the next connection
+		context_->metrics->connectFailures++;
+		if (isResuming && exchanges.front().resumes < context_->settings.resumeAttempts) {
+			resumer_.expires_from_now(boost::posix_time::seconds(exchanges.front().resumes++));
+			resumer_.async_wait(boost::bind(&tcp_connection::handle_resume, shared_from_this(),
+											ba::placeholders::error, generation_));
+			return;
+		}
+		isFailed = true;
+		if (!isTracking || !cflow.queue.empty() || !range_cache::instance().enabled() || !context_->settings.useRangeCache)
+			shutdown();
+		else
+			update_close_state();
+	}
+}
+
+/** 
+ * Follows a request head the client sent. A GET which is alone in the read data and comes after all responses
+ * the client waits for is answered locally when the range cache or the read-ahead holds it, or joins the response
+ * to an identical request in flight; otherwise the request is forwarded, a small Range request widened to the
+ * read-ahead window when the remote server is idle, any other GET offered to identical requests.
+ * 
+ * @param rest number of bytes read after the head
+ * @return true if the request is answered locally or forwarded with a changed head
+ */
+bool tcp_connection::on_request_head(size_t rest) {
+	if (isDraining) {
+		// the remote server is going away
+		if (client_answered())
+			reply_error("503 Service Unavailable");
+		else
+			shutdown();
+		return true;
+	}
+	if (home_->routes && !route_request())
+		return true;
+	
+	const http_head& request = home_->routes ? routed_ : requests.head();
+	bool alone = rest == 0 && requests.keepAlive() && request.method == "GET";
+	if (exchanges.empty())
+		set_traffic_class(classify_request(request));
+	
+	if (alone && client_answered()) {
+		if (context_->settings.useRangeCache && range_cache::instance().lookup(cache_key(request), request, local_)) {
+			HBOX_DEBUG("Serving " << request.uri << " from the range cache");
+			context_->metrics->localResponses++;
+			isServingLocal = true;
+			enqueue(false, local_.head);
+			feed_local();
+			flush(false);
+			return true;
+		}
+		if (serve_ahead(request))
+			return true;
+		if (follow_shared(request))
+			return true;
+	}
+	
+	bool idle = exchanges.empty() && responses.idle();
+	context_->metrics->requests++;
+	responses.expect_response(request.method);
+	exchanges.push_back(http_exchange(request));
+	if (context_->originPort > 0 && context_->settings.rewriteUrls)
+		exchanges.back().base = rewrite_base(request);
+	if (alone && idle && widen_request(request))
+		return true;
+	if (alone && idle)
+		offer_shared(request);
+	if (home_->routes) {
+		enqueue(true, request.text());
+		return true;
+	}
+	return false;
+}
+
+/** 
+ * Picks the remote server of a request which came through the front door and takes the route prefix out of its
+ * target. The connection moves to another remote server only once the client has all its responses; a connection
+ * to the previous one which can be kept alive is parked in its upstream pool, one still sending a read-ahead is
+ * closed.
+ * 
+ * @return false if the request was answered with an error or the connection was closed
+ */
+bool tcp_connection::route_request() {
+	routed_ = requests.head();
+	bool answered = client_answered(); // a read-ahead may still be arriving
+	
+	string id, rest;
+	proxy_context::pointer route;
+	if (route_table::split(routed_.uri, id, rest))
+		route = home_->routes->find(id);
+	if (!route) {
+		HBOX_INFO("The front door has no route for " << routed_.uri);
+		if (answered)
+			reply_error("404 Not Found");
+		else
+			shutdown();
+		return false;
+	}
+	
+	routed_.uri = rest;
+	if (route == context_)
+		return true;
+	
+	if (context_ != home_) {
+		if (!answered || !sflow.drained() || !cflow.drained()) {
+			HBOX_INFO("Requests for two remote servers are pipelined, closing the connection");
+			shutdown();
+			return false;
+		}
+		
+		bool idle = isOpened && !sflow.finished && exchanges.empty() && responses.idle() && responses.keepAlive();
+		bs::error_code ignored;
+		if (!idle || !context_->upstreams.release(ssocket_))
+			ssocket_.close(ignored);
+		fill_.commit();
+		ahead_.clear();
+		exchanges.clear();
+		responses.reset();
+		rewriter_.clear();
+		sflow.reset();
+	}
+	
+	HBOX_DEBUG("Routing " << routed_.uri << " to " << route->forwardIP << ":" << route->forwardPort);
+	generation_++;
+	resolver_.cancel(); // a resolve of the previous route completes with an error and is dropped
+	isOpened = isFailed = false;
+	connectStart = 0;
+	endpoints_.clear();
+	context_ = route;
+	start_connect();
+	return true;
+}
+
+/** 
+ * Answers the client with an error and closes the connection once the answer is written
+ * 
+ * @param status the status code and reason phrase
+ */
+void tcp_connection::reply_error(const string& status) {
+	enqueue(false, "HTTP/1.1 " + status + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+	cflow.finished = sflow.finished = true;
+	flush(false);
+}
+
+/** 
+ * @return true if every response the client waits for is queued, so that a local response keeps the order
+ */
+bool tcp_connection::client_answered() const {
+	if (isServingLocal)
+		return false;
+	if (exchanges.empty())
+		return responses.idle();
+	return exchanges.size() == 1 && exchanges.front().widened && exchanges.front().owed == 0;
+}
+
+/** 
+ * Answers a Range request from the read-ahead window. The range may start beyond the bytes which arrived so far:
+ * the response head is sent right away and feed_local() sends the body as the window fills up.
+ * 
+ * @param request the request head
+ * @return true if the read-ahead covers the request
+ */
+bool tcp_connection::serve_ahead(const http_head& request) {
+	long long first, last;
+	if (ahead_.total <= 0 || !request.getRange(first, last) || first < 0)
+		return false;
+	if (last < 0 || last >= ahead_.total)
+		last = ahead_.total - 1;
+	if (!ahead_.covers(cache_key(request), first, last))
+		return false;
+	
+	HBOX_DEBUG("Serving " << request.uri << " bytes " << first << "-" << last << " from the read-ahead");
+	context_->metrics->localResponses++;
+	http_head head = ahead_.head;
+	head.set("Content-Range", "bytes " + boost::lexical_cast<string>(first) + "-" + boost::lexical_cast<string>(last) +
+							  "/" + boost::lexical_cast<string>(ahead_.total));
+	head.set("Content-Length", boost::lexical_cast<string>(last - first + 1));
+	
+	local_.close();
+	local_.offset = first;
+	local_.length = last - first + 1;
+	isServingLocal = true;
+	enqueue(false, head.text());
+	feed_local();
+	flush(false);
+	return true;
+}
+
+/** 
+ * Forwards a small Range request as a request for the whole read-ahead window
+ * 
+ * @param request the request head
+ * @return true if the request was widened and queued
+ */
+bool tcp_connection::widen_request(const http_head& request) {
+	long long first, last;
+	size_t window = context_->settings.prefetchWindow;
+	if (window == 0 || request.version != "HTTP/1.1" || !request.getRange(first, last) || first < 0 || last < 0 ||
+		(unsigned long long) (last - first + 1) >= window)
+		return false;
+	
+	http_exchange& x = exchanges.back();
+	x.widened = true;
+	x.first = first;
+	x.last = last;
+	
+	http_head wide = request;
+	wide.set("Range", "bytes=" + boost::lexical_cast<string>(first) + "-" + boost::lexical_cast<string>(first + window - 1));
+	enqueue(true, wide.text());
+	return true;
+}
+
+/** 
+ * Prepares storing the body of a response in the range cache, rewrites the URLs in it, and gives the client the
+ * part of a widened response it asked for
+ * 
+ * @return true if the response head was changed and queued
+ */
+bool tcp_connection::on_response_head() {
+	const http_head& response = responses.head();
+	if (exchanges.empty() || response.status < 200)
+		return false;
+	
+	http_exchange& x = exchanges.front();
+	context_->metrics->firstByte.record(metrics_now() - x.sent);
+	traffic_class c = classify_response(classify_request(x.request), response);
+	context_->metrics->responses[c]++;
+	set_traffic_class(c);
+	if (!x.base.empty() && !x.widened && rewrite_response(x)) {
+		abandon_shared(); // the followers would get the URLs of another client
+		return true;
+	}
+	if (shared_) {
+		// a response meant for one client only, or one which cannot be relayed apart from its connection
+		if ((response.status != 200 && response.status != 206) || !responses.keepAlive() || response.has("Set-Cookie") ||
+			response.hasToken("Cache-Control", "private") || response.hasToken("Cache-Control", "no-store"))
+			abandon_shared();
+		else if (!shared_->append(response.raw.data(), response.raw.size()))
+			withdraw_shared();
+	}
+	if (context_->settings.useRangeCache)
+		range_cache::instance().fill(cache_key(x.request), x.request, response, fill_);
+	if (!x.widened) {
+		prepare_resume(x, response);
+		return false;
+	}
+	
+	long long first, last, total;
+	if (response.status != 206 || !response.getContentRange(first, last, total) || first != x.first || total <= 0 ||
+		!response.has("Content-Length") || response.has("Transfer-Encoding") || !responses.keepAlive()) {
+		x.widened = false; // relayed as it is
+		return false;
+	}
+	
+	last = min(last, x.last);
+	x.owed = last - first + 1;
+	
+	ahead_.clear();
+	ahead_.key = cache_key(x.request);
+	ahead_.total = total;
+	ahead_.start = first;
+	ahead_.end = first + atoll(response.get("Content-Length").c_str());
+	ahead_.head = response;
+	
+	http_head head = response;
+	head.set("Content-Range", "bytes " + boost::lexical_cast<string>(first) + "-" + boost::lexical_cast<string>(last) +
+							  "/" + boost::lexical_cast<string>(total));
+	head.set("Content-Length", boost::lexical_cast<string>(x.owed));
+	enqueue(false, head.text());
+	return true;
+}
+
+/** 
+ * Queues a rewritten body, or keeps the body of a widened response in the read-ahead and passes on the part the
+ * client asked for
+ * 
+ * @return true if the bytes were taken
+ */
+bool tcp_connection::on_response_body(const char* data, size_t len) {
+	if (rewriter_.active()) {
+		string text;
+		rewriter_.feed(data, len, text);
+		enqueue_rewritten(text);
+		return true;
+	}
+	if (!exchanges.empty() && exchanges.front().resumable)
+		exchanges.front().resumeFrom += len;
+	if (shared_ && !shared_->append(data, len))
+		withdraw_shared();
+	if (exchanges.empty() || !exchanges.front().widened)
+		return false;
+	
+	http_exchange& x = exchanges.front();
+	ahead_.data.append(data, len);
+	size_t n = min((long long) len, x.owed);
+	enqueue(false, data, n);
+	x.owed -= n;
+	
+	if (isServingLocal && local_.fd < 0)
+		feed_local();
+	return true;
+}
+
+/** 
+ * Notes where the body of a response lies in its resource, so that its rest can be asked for again. Only GET
+ * responses with a known length qualify, the ones of a server which refuses ranges excepted.
+ * 
+ * @param x the exchange of the response
+ * @param response the response head
+ */
+void tcp_connection::prepare_resume(http_exchange& x, const http_head& response) {
+	x.resumable = false;
+	if (context_->settings.resumeAttempts <= 0 || x.request.method != "GET" || !response.has("Content-Length") ||
+		response.has("Transfer-Encoding") || response.hasToken("Accept-Ranges", "none"))
+		return;
+	
+	long long length = atoll(response.get("Content-Length").c_str());
+	long long first = 0, last = length - 1, total = length;
+	if (length <= 0 || (response.status != 200 && response.status != 206))
+		return;
+	if (response.status == 206 && (!response.getContentRange(first, last, total) || last - first + 1 != length))
+		return;
+	
+	x.resumable = true;
+	x.resumeFrom = first;
+	x.resumeTo = last;
+	x.total = total;
+	string etag = response.get("ETag");
+	x.validator = !etag.empty() && etag.compare(0, 2, "W/") != 0 ? etag : response.get("Last-Modified");
+}
+
+/** 
+ * Asks a new connection to the remote server for the rest of the response the client is being sent, after the
+ * remote server dropped or stalled. The first attempt goes out right away, the next ones after a growing delay.
+ * 
+ * @return false if the response cannot be resumed, the caller gives up on the connection
+ */
+bool tcp_connection::resume_upstream() {
+	if (isClosed || !isTracking || mode != RELAY_BUFFERED || isServingLocal || exchanges.size() != 1 ||
+		!cflow.drained() || !requests.idle())
+		return false;
+	
+	http_exchange& x = exchanges.front();
+	if (!x.resumable || x.resumeFrom > x.resumeTo || x.resumes >= context_->settings.resumeAttempts)
+		return false;
+	
+	HBOX_INFO("The remote server dropped " << x.request.uri << ", asking for bytes " << x.resumeFrom << "-" << x.resumeTo << " again");
+	bs::error_code ignored;
+	ssocket_.close(ignored);
+	generation_++; // a read pending on the dropped connection is ignored
+	isOpened = false;
+	isResuming = true;
+	sflow.reading = false;
+	sflow.lastRead = metrics_now();
+	
+	http_head request = x.request;
+	request.set("Range", "bytes=" + boost::lexical_cast<string>(x.resumeFrom) + "-" + boost::lexical_cast<string>(x.resumeTo));
+	if (!x.validator.empty())
+		request.set("If-Range", x.validator);
+	enqueue(true, request.text());
+	resumed_.reset();
+	resumed_.expect_response(request.method);
+	
+	resumer_.expires_from_now(boost::posix_time::seconds(x.resumes++));
+	resumer_.async_wait(boost::bind(&tcp_connection::handle_resume, shared_from_this(),
+									ba::placeholders::error, generation_));
+	return true;
+}
+
+/** 
+ * 
+ * 
+ * @param err 
+ * @param generation the connection to the remote server the resume was started for
+ */
+void tcp_connection::handle_resume(const bs::error_code& err, unsigned generation) {
+	if (err || isClosed || generation != generation_)
+		return;
+	start_connect();
+}
+
+/** 
+ * Follows the head of the response which brings the rest of a dropped one. It is not passed on: once it is
+ * known to start where the dropped one stopped, its body continues the body the client is being sent.
+ * 
+ * @param data set past the head
+ * @param len set to the number of bytes after the head
+ */
+void tcp_connection::on_resumed_head(const char*& data, size_t& len) {
+	size_t used;
+	http_parser::event_type ev = resumed_.parse(data, len, used);
+	if (ev == http_parser::NEED_MORE) {
+		data += len;
+		len = 0;
+		return;
+	}
+	
+	const http_head& response = resumed_.head();
+	http_exchange& x = exchanges.front();
+	long long first, last, total;
+	string etag = response.get("ETag");
+	if (ev != http_parser::HEAD || response.status != 206 || !response.getContentRange(first, last, total) ||
+		first != x.resumeFrom || last != x.resumeTo || (x.total >= 0 && total >= 0 && total != x.total) ||
+		response.has("Transfer-Encoding") || (!etag.empty() && x.validator[0] == '"' && etag != x.validator)) {
+		HBOX_INFO("The remote server did not send the rest of " << x.request.uri << ", closing the connection");
+		shutdown();
+		return;
+	}
+	
+	HBOX_INFO("Resumed " << x.request.uri << " at byte " << first);
+	context_->metrics->resumed++;
+	isResuming = false;
+	data += used;
+	len -= used;
+}
+
+void tcp_connection::on_response_end() {
+	if (responses.head().status < 200)
+		return;
+	
+	fill_.commit();
+	if (rewriter_.active()) {
+		string text;
+		rewriter_.finish(text);
+		enqueue_rewritten(text);
+		enqueue(false, string("0\r\n\r\n"));
+	}
+	if (shared_) {
+		withdraw_shared();
+		shared_->finish();
+		shared_.reset();
+		isHeldBack = false;
+	}
+	if (!exchanges.empty())
+		exchanges.pop_front();
+}
+
+/** 
+ * Gives up following the connection as HTTP. The bytes the parsers held back as partial heads are queued so the
+ * rest of the stream is relayed unchanged.
+ * 
+ */
+void tcp_connection::stop_tracking() {
+	if ((!exchanges.empty() && exchanges.front().widened) || rewriter_.active()) {
+		shutdown(); // the client cannot be given what it asked for anymore
+		return;
+	}
+	
+	isTracking = false;
+	fill_.commit();
+	abandon_shared();
+	exchanges.clear();
+	ahead_.clear();
+	enqueue(true, requests.held());
+	enqueue(false, responses.held());
+	flush(true);
+	flush(false);
+}
+
+/** 
+ * @return true if the connection to the remote server is between keep-alive exchanges and can serve another client
+ */
+bool tcp_connection::upstream_reusable() {
+	return isTracking && isOpened && !sflow.finished && cflow.drained() &&
+		   requests.idle() && responses.idle() && requests.keepAlive() && responses.keepAlive();
+}
+
+/** 
+ * Parks the connection to the remote server in the upstream pool, unless the remote server is going away, and
+ * closes the client side
+ * 
+ */
+void tcp_connection::recycle_upstream() {
+	if(!isDraining && context_->upstreams.release(ssocket_))
+		HBOX_DEBUG("Connection to the remote server parked for reuse");
+	shutdown();
+}
+
+/** 
+ * @return the range cache key of a request: the remote server and the request target
+ */
+string tcp_connection::cache_key(const http_head& request) const {
+	return context_->forwardIP + ":" + boost::lexical_cast<string>(context_->forwardPort) + request.uri;
+}
+
+/** 
+ * Queues the next pieces of the response served from the range cache, the read-ahead or a shared response, up to
+ * one large buffer ahead of the client. The client is read again once the response is complete.
+ * 
+ */
+void tcp_connection::feed_local() {
+	while (isServingLocal && sflow.queued < BUFFER_MAX_SIZE) {
+		if (following_) {
+			if (!feed_shared())
+				break;
+			continue;
+		}
+		if (local_.length == 0) {
+			local_.close();
+			isServingLocal = false;
+			start_read(true);
+			break;
+		}
+		
+		size_t want = min(local_.length, (unsigned long long) BUFFER_MAX_SIZE);
+		ssize_t n;
+		if (local_.fd < 0) {
+			// from the read-ahead, which may still be arriving
+			if (local_.offset < ahead_.start || local_.offset + local_.length > ahead_.end) {
+				HBOX_DEBUG("The read-ahead was cut short, closing the connection");
+				shutdown();
+				return;
+			}
+			// the body handler calls again as more of the window arrives
+			if (local_.offset >= ahead_.received())
+				return;
+			want = min((unsigned long long) want, ahead_.received() - local_.offset);
+		}
+		
+		size_t size = buffer_pool::fit(want);
+		char* buffer = buffer_pool::instance().acquire(size);
+		if (local_.fd < 0) {
+			memcpy(buffer, ahead_.data.data() + (local_.offset - ahead_.start), want);
+			n = want;
+		}
+		else
+			n = ::pread(local_.fd, buffer, want, local_.offset);
+		if (n <= 0) {
+			HBOX_WARN("Cannot read the range cache, closing the connection");
+			buffer_pool::instance().release(buffer, size);
+			shutdown();
+			return;
+		}
+		
+		enqueue(false, buffer, n);
+		sflow.queue.back().buffer = buffer;
+		sflow.queue.back().bufferSize = size;
+		local_.offset += n;
+		local_.length -= n;
+	}
+}
+
+/** 
+ * @return the key of the responses identical requests can share: the range cache key, and the fields of the
+ * request the response depends on
+ */
+string tcp_connection::share_key(const http_head& request) const {
+	return cache_key(request) + "\n" + request.version + "\n" + request.get("Range") + "\n" + request.get("Accept-Encoding");
+}
+
+/** 
+ * @return true if the response to a request can be given to another client which sent the same request
+ */
+bool tcp_connection::shareable(const http_head& request) const {
+	static const char* const personal[] = { "Authorization", "Cookie", "If-Match", "If-None-Match", "If-Modified-Since",
+											"If-Unmodified-Since", "If-Range", "Content-Length", "Transfer-Encoding" };
+	if (context_->settings.coalesceWindow == 0 || request.method != "GET")
+		return false;
+	for (size_t i = 0; i < sizeof(personal) / sizeof(personal[0]); i++)
+		if (request.has(personal[i]))
+			return false;
+	return true;
+}
+
+/** 
+ * Lets identical requests join the response to a request just forwarded
+ * 
+ * @param request the request head
+ */
+void tcp_connection::offer_shared(const http_head& request) {
+	if (!shareable(request))
+		return;
+	
+	shared_response::pointer response(new shared_response(context_->settings.coalesceWindow));
+	string key = share_key(request);
+	if (!context_->coalescer.add(key, response))
+		return; // the response to an identical request is too far along to be joined
+	
+	if (!waker_)
+		waker_ = boost::bind(&tcp_connection::wake, boost::weak_ptr<tcp_connection>(shared_from_this()));
+	shared_ = response;
+	sharedKey = key;
+}
+
+/** 
+ * Answers a request with the response to an identical request in flight, instead of forwarding it
+ * 
+ * @param request the request head
+ * @return true if the request joined a shared response
+ */
+bool tcp_connection::follow_shared(const http_head& request) {
+	if (!shareable(request))
+		return false;
+	shared_response::pointer response = context_->coalescer.find(share_key(request));
+	if (!response)
+		return false;
+	
+	if (!waker_)
+		waker_ = boost::bind(&tcp_connection::wake, boost::weak_ptr<tcp_connection>(shared_from_this()));
+	int id = response->follow(waker_);
+	if (id < 0)
+		return false;
+	
+	HBOX_DEBUG("Joining the response in flight for " << request.uri);
+	context_->metrics->coalesced++;
+	following_ = response;
+	followId = id;
+	followRequest = request;
+	followed = 0;
+	isServingLocal = true;
+	feed_local();
+	flush(false);
+	return true;
+}
+
+/** 
+ * Queues what the shared response has for the client. If the response fails before the client got any of it, the
+ * request is forwarded after all.
+ * 
+ * @return true if more may be queued right away
+ */
+bool tcp_connection::feed_shared() {
+	size_t want = min(following_->pending(followId), (size_t) BUFFER_MAX_SIZE);
+	size_t size = 0;
+	char* buffer = NULL;
+	if (want > 0) {
+		size = buffer_pool::fit(want);
+		buffer = buffer_pool::instance().acquire(size);
+	}
+	
+	shared_response::state_type state;
+	size_t n = following_->read(followId, buffer, want, state);
+	if (n > 0) {
+		enqueue(false, buffer, n);
+		sflow.queue.back().buffer = buffer;
+		sflow.queue.back().bufferSize = size;
+		followed += n;
+		return true;
+	}
+	buffer_pool::instance().release(buffer, size);
+	if (state == shared_response::DATA)
+		return true; // more arrived since pending()
+	if (state == shared_response::WAIT)
+		return false;
+	
+	leave_shared();
+	isServingLocal = false;
+	if (state == shared_response::END) {
+		start_read(true);
+		return false;
+	}
+	
+	if (followed > 0 || isFailed) {
+		HBOX_DEBUG("The shared response for " << followRequest.uri << " failed, closing the connection");
+		shutdown();
+		return false;
+	}
+	HBOX_DEBUG("The shared response for " << followRequest.uri << " failed, forwarding the request");
+	context_->metrics->requests++;
+	responses.expect_response(followRequest.method);
+	exchanges.push_back(http_exchange(followRequest));
+	enqueue(true, home_->routes ? followRequest.text() : followRequest.raw);
+	flush(true);
+	start_read(true);
+	return false;
+}
+
+/** 
+ * Stops identical requests from joining the shared response, the followers which joined keep it
+ * 
+ */
+void tcp_connection::withdraw_shared() {
+	if (sharedKey.empty())
+		return;
+	context_->coalescer.remove(sharedKey, shared_);
+	sharedKey.clear();
+}
+
+/** 
+ * The shared response will not be complete, its followers fetch it themselves or close
+ * 
+ */
+void tcp_connection::abandon_shared() {
+	if (!shared_)
+		return;
+	withdraw_shared();
+	shared_->fail();
+	shared_.reset();
+	isHeldBack = false;
+}
+
+/** 
+ * Stops following a shared response, which then does not wait for this connection anymore
+ * 
+ */
+void tcp_connection::leave_shared() {
+	if (!following_)
+		return;
+	following_->leave(followId);
+	following_.reset();
+	followId = -1;
+}
+
+/** 
+ * Called from the thread of the other side of a shared response when it moved on
+ * 
+ * @param connection the connection to wake up, gone if it was closed meanwhile
+ */
+void tcp_connection::wake(boost::weak_ptr<tcp_connection> connection) {
+	pointer self = connection.lock();
+	if (self)
+		self->io_service_.post(boost::bind(&tcp_connection::handle_wake, self));
+}
+
+/** 
+ * Continues where the connection waited for the other side of a shared response
+ * 
+ */
+void tcp_connection::handle_wake() {
+	if (isClosed)
+		return;
+	if (following_)
+		feed_local();
+	flush(false);
+	start_read(false);
+	update_close_state();
+}
+
+/** 
+ * Marks the packets of both sockets for the traffic class of the current exchange, whose class also decides
+ * whether small writes wait for Nagle's algorithm
+ * 
+ * @param c the traffic class
+ */
+void tcp_connection::set_traffic_class(traffic_class c) {
+	if (c == trafficClass)
+		return;
+	trafficClass = c;
+	mark_traffic(csocket_, context_->settings.dscp[c], c);
+	mark_traffic(ssocket_, context_->settings.dscp[c], c);
+	if (csocket_.is_open())
+		context_->settings.tuning.apply_class(csocket_.native_handle(), c);
+	if (ssocket_.is_open())
+		context_->settings.tuning.apply_class(ssocket_.native_handle(), c);
+}
+
+/** 
+ * @param request the request head as the client sent it, the route prefix taken out
+ * @return the scheme, authority and route prefix at which the client reaches the remote server, empty if unknown
+ */
+string tcp_connection::rewrite_base(const http_head& request) const {
+	string host = request.get("Host");
+	if (host.empty()) {
+		bs::error_code err;
+		ba::ip::tcp::endpoint local = csocket_.local_endpoint(err);
+		if (err)
+			return "";
+		string address = local.address().to_string();
+		host = (local.address().is_v6() ? "[" + address + "]" : address) + ":" + boost::lexical_cast<string>(local.port());
+	}
+	
+	string base = "http://" + host;
+	string id, rest;
+	if (home_->routes && route_table::split(requests.head().uri, id, rest))
+		base += route_table::prefix(id);
+	return base;
+}
+
+/** 
+ * Rewrites the URLs of the remote server in the Location fields of a response and, for a text body, prepares
+ * rewriting the body. The client of a rewritten body must take it chunked, its length is not known in advance.
+ * 
+ * @param x the exchange of the response
+ * @return true if the response head was changed and queued
+ */
+bool tcp_connection::rewrite_response(const http_exchange& x) {
+	const http_head& response = responses.head();
+	bool body = x.request.method != "HEAD" && x.request.version == "HTTP/1.1" && !responses.untilClose() &&
+				url_rewriter::rewritable(response);
+	if (!body && !response.has("Location") && !response.has("Content-Location"))
+		return false;
+	
+	http_head head = response;
+	bool changed = false;
+	const char* const located[] = { "Location", "Content-Location" };
+	for (int i = 0; i < 2; i++) {
+		if (!head.has(located[i]))
+			continue;
+		string value = head.get(located[i]);
+		string rewritten = url_rewriter::rewrite(value, context_->originPort, x.base);
+		if (rewritten != value) {
+			head.set(located[i], rewritten);
+			changed = true;
+		}
+	}
+	if (body) {
+		head.erase("Content-Length");
+		head.set("Transfer-Encoding", "chunked");
+		rewriter_.start(context_->originPort, x.base, responses.chunked());
+		changed = true;
+	}
+	if (!changed)
+		return false;
+	
+	HBOX_DEBUG("Rewriting the URLs of the response to " << x.request.uri << " to " << x.base);
+	context_->metrics->rewritten++;
+	enqueue(false, head.text());
+	return true;
+}
+
+/** 
+ * Queues rewritten body bytes for the client as one chunk
+ * 
+ */
+void tcp_connection::enqueue_rewritten(const string& text) {
+	if (text.empty())
+		return;
+	
+	char size[20];
+	snprintf(size, sizeof(size), "%lx\r\n", (unsigned long) text.size());
+	enqueue(false, size + text + "\r\n");
+}
+
+/** 
+ * Creates one pipe per direction for the zero-copy relay and switches both sockets to non-blocking mode.
+ * 
+ * @return false if splice() cannot be used, the connection then relays through its buffers
+ */
+bool tcp_connection::open_splice_pipes() {
+#ifdef __linux__
+	if (::pipe2(cpipe, O_NONBLOCK | O_CLOEXEC) < 0)
+		return false;
+	if (::pipe2(spipe, O_NONBLOCK | O_CLOEXEC) < 0)
+		return false;
+#ifdef F_SETPIPE_SZ
+	::fcntl(cpipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	::fcntl(spipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+#endif
+	return true;
+#else
+	return false;
+#endif
+}
+
+/** 
+ * Waits until the source socket of a direction becomes readable, without reading anything into user space.
+ * 
+ * @param toServer the direction
+ */
+void tcp_connection::start_splice_read(bool toServer) {
+	ba::ip::tcp::socket& from = toServer ? csocket_ : ssocket_;
+	from.async_read_some(ba::null_buffers(),
+						 make_alloc_handler(flow(toServer).readMemory,
+											boost::bind(&tcp_connection::handle_splice_read, shared_from_this(),
+														ba::placeholders::error,
+														toServer)));
+}
+
+/** 
+ * Moves the readable data of the source socket into the pipe of the direction.
+ * 
+ * @param err 
+ * @param toServer the direction
+ */
+void tcp_connection::handle_splice_read(const bs::error_code& err, bool toServer) {
+#ifdef __linux__
+	if (err) {
+		shutdown();
+		return;
+	}
+	
+	ba::ip::tcp::socket& from = toServer ? csocket_ : ssocket_;
+	int* fds = toServer ? cpipe : spipe;
+	size_t& held = toServer ? cpipe_pending : spipe_pending;
+	
+	if (!from.non_blocking())
+		from.non_blocking(true);
+	
+	ssize_t n = ::splice(from.native_handle(), NULL, fds[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n > 0) {
+		held += n;
+		flow(toServer).lastRead = lastActivity = metrics_now();
+		flush_splice(toServer);
+	}
+	else if (n == 0)
+		handle_end_of_stream(toServer);
+	else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		start_splice_read(toServer);
+	else
+		shutdown();
+#endif
+}
+
+/** 
+ * Drains the pipe of a direction into its destination socket, then waits for more data from the source.
+ * 
+ * @param toServer the direction
+ */
+void tcp_connection::flush_splice(bool toServer) {
+#ifdef __linux__
+	ba::ip::tcp::socket& to = toServer ? ssocket_ : csocket_;
+	int* fds = toServer ? cpipe : spipe;
+	size_t& held = toServer ? cpipe_pending : spipe_pending;
+	
+	if (!to.non_blocking())
+		to.non_blocking(true);
+	
+	while (held > 0) {
+		ssize_t n = ::splice(fds[0], NULL, to.native_handle(), NULL, held, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			held -= n;
+			if (toServer)
+				context_->metrics->bytesToServer += n;
+			else {
+				context_->metrics->bytesToClient += n;
+				clientBytes += n;
+			}
+		}
+		else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			to.async_write_some(ba::null_buffers(),
+								make_alloc_handler(flow(toServer).writeMemory,
+												   boost::bind(&tcp_connection::handle_splice_write, shared_from_this(),
+															   ba::placeholders::error,
+															   toServer)));
+			return;
+		}
+		else {
+			shutdown();
+			return;
+		}
+	}
+	
+	start_splice_read(toServer);
+#endif
+}
+
+/** 
+ * 
+ * 
+ * @param err 
+ * @param toServer the direction
+ */
+void tcp_connection::handle_splice_write(const bs::error_code& err, bool toServer) {
+	if (!err)
+		flush_splice(toServer);
+	else
 		shutdown();
+}
+
+/** 
+ * Asks the io_uring to read the source socket of a direction into the buffer of the direction
+ * 
+ * @param toServer the direction
+ */
+void tcp_connection::start_uring_read(bool toServer) {
+	int i = toServer ? 0 : 1;
+	ba::ip::tcp::socket& from = toServer ? csocket_ : ssocket_;
+	uring_->read(from.native_handle(), ubuffer[i], URING_BUFFER_SIZE, uslot[i],
+				 boost::bind(&tcp_connection::handle_uring_read, shared_from_this(), _1, toServer));
+}
+
+/** 
+ * 
+ * 
+ * @param result bytes read, 0 at the end of stream or -errno
+ * @param toServer the direction
+ */
+void tcp_connection::handle_uring_read(int result, bool toServer) {
+	if (isClosed)
+		return;
+	
+	int i = toServer ? 0 : 1;
+	if (result > 0) {
+		uheld[i] = result;
+		usent[i] = 0;
+		flow(toServer).lastRead = lastActivity = metrics_now();
+		flush_uring(toServer);
 	}
+	else if (result == 0)
+		handle_end_of_stream(toServer);
+	else if (result == -EINTR || result == -EAGAIN)
+		start_uring_read(toServer);
+	else
+		shutdown();
+}
+
+/** 
+ * Asks the io_uring to write what is left in the buffer of a direction to its destination
+ * 
+ * @param toServer the direction
+ */
+void tcp_connection::flush_uring(bool toServer) {
+	int i = toServer ? 0 : 1;
+	ba::ip::tcp::socket& to = toServer ? ssocket_ : csocket_;
+	uring_->write(to.native_handle(), ubuffer[i] + usent[i], uheld[i] - usent[i], uslot[i],
+				  boost::bind(&tcp_connection::handle_uring_write, shared_from_this(), _1, toServer));
+}
+
+/** 
+ * Writes the rest of the buffer after a short write, otherwise reads the source again
+ * 
+ * @param result bytes written or -errno
+ * @param toServer the direction
+ */
+void tcp_connection::handle_uring_write(int result, bool toServer) {
+	if (isClosed)
+		return;
+	if (result < 0 && result != -EINTR && result != -EAGAIN) {
+		shutdown();
+		return;
+	}
+	
+	int i = toServer ? 0 : 1;
+	if (result > 0) {
+		usent[i] += result;
+		lastActivity = metrics_now();
+		if (toServer)
+			context_->metrics->bytesToServer += result;
+		else {
+			context_->metrics->bytesToClient += result;
+			clientBytes += result;
+		}
+	}
+	
+	if (usent[i] < uheld[i])
+		flush_uring(toServer);
+	else
+		start_uring_read(toServer);
 }
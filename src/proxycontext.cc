@@ -0,0 +1,117 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "proxycontext.hh"
+
+#include <algorithm>
+#include <boost/lexical_cast.hpp>
+
+/**
+ * Constructor of proxy_settings class, sets the defaults
+ *
+ */
+proxy_settings::proxy_settings() {
+	mode = RELAY_BUFFERED;
+	upstreamPoolSize = 4;
+	upstreamIdleTimeout = 15;
+	warmConnections = 2;
+	resolveTtl = 60;
+	connectStagger = 250;
+	cacheSize = 1024;
+	useRangeCache = false;
+	prefetchWindow = 2048 * 1024;
+	coalesceWindow = 4096 * 1024;
+	highWatermark = 256 * 1024;
+	lowWatermark = 64 * 1024;
+	maxConnections = 0;
+	maxTotalConnections = 0;
+	idleTimeout = 0;
+	readTimeout = 0;
+	resumeAttempts = 3;
+	drainTimeout = 10;
+	reusePort = false;
+	rewriteUrls = true;
+	dscp[TRAFFIC_CONTROL] = 26;		// AF31
+	dscp[TRAFFIC_INTERACTIVE] = 18;	// AF21
+	dscp[TRAFFIC_BULK] = 10;		// AF11
+}
+
+/**
+ * Overrides the defaults with the keys found in the configuration file
+ * @param cf the hbox configuration file
+ *
+ */
+void proxy_settings::load(const ConfigFile& cf) {
+	string relay = cf.read<string>("relay_mode", "buffered");
+	if (relay == "splice")
+		mode = RELAY_SPLICE;
+	else if (relay == "uring")
+		mode = RELAY_URING;
+	upstreamPoolSize = cf.read<int>("upstream_pool_size", upstreamPoolSize);
+	upstreamIdleTimeout = cf.read<int>("upstream_idle_timeout", upstreamIdleTimeout);
+	warmConnections = cf.read<int>("warm_connections", warmConnections);
+	resolveTtl = cf.read<int>("resolve_ttl", resolveTtl);
+	connectStagger = cf.read<int>("connect_stagger", connectStagger);
+	cacheDir = cf.read<string>("cache_dir", cacheDir);
+	cacheSize = cf.read<int>("cache_size", cacheSize);
+	useRangeCache = !cacheDir.empty();
+	prefetchWindow = cf.read<size_t>("prefetch_window", prefetchWindow / 1024) * 1024;
+	coalesceWindow = cf.read<size_t>("coalesce_window", coalesceWindow / 1024) * 1024;
+	highWatermark = cf.read<size_t>("high_watermark", highWatermark / 1024) * 1024;
+	lowWatermark = min(cf.read<size_t>("low_watermark", lowWatermark / 1024) * 1024, highWatermark);
+	maxConnections = cf.read<int>("max_connections", maxConnections);
+	maxTotalConnections = cf.read<int>("max_total_connections", maxTotalConnections);
+	idleTimeout = cf.read<int>("idle_timeout", idleTimeout);
+	readTimeout = cf.read<int>("read_timeout", readTimeout);
+	resumeAttempts = cf.read<int>("resume_attempts", resumeAttempts);
+	drainTimeout = cf.read<int>("drain_timeout", drainTimeout);
+	reusePort = cf.read<string>("reuse_port", "no") == "yes";
+	rewriteUrls = cf.read<string>("rewrite_urls", "yes") == "yes";
+	for (int c = 0; c < TRAFFIC_CLASSES; c++)
+		dscp[c] = cf.read<int>(string("dscp_") + traffic_class_name((traffic_class) c), dscp[c]);
+	tuning.load(cf);
+}
+
+/**
+ * Constructor of proxy_context class, registers the metrics of the proxy
+ * @param forwardIP the address of the remote server, empty for the front door
+ * @param forwardPort the port of the remote server
+ * @param settings the proxy tunables
+ * @param listeningPort the port of the proxy, for the metrics
+ * @param peer the hbox the remote server belongs to, empty for a local server
+ * @param originPort the port of the remote server in its own network, URLs with it are rewritten; 0 for none
+ *
+ */
+proxy_context::proxy_context(const string& forwardIP, int forwardPort, const proxy_settings& settings, int listeningPort,
+							 const string& peer, int originPort) : forwardIP(forwardIP),
+	forwardPort(forwardPort),
+	settings(settings),
+	originPort(originPort),
+	peer(peer),
+	upstreams(settings.upstreamPoolSize, settings.upstreamIdleTimeout),
+	resolved(settings.resolveTtl, forwardIP),
+	metrics(new proxy_metrics(listeningPort, forwardIP.empty() ? "routed" : forwardIP + ":" + boost::lexical_cast<string>(forwardPort), peer)),
+	retired(false) {
+	metrics->congestion = settings.tuning.congestion;
+	metrics_registry::instance().add(metrics);
+}
@@ -23,28 +23,295 @@ THE SOFTWARE.
 #include "proxyserver.hh"
 #include "hbox.hh"
 
-tcp_proxy_server::tcp_proxy_server(const ios_deque& io_services, int listeningPort, string forwardIP, int forwardPort) : io_services_(io_services),
-	  acceptor_(*io_services.front(), ba::ip::tcp::endpoint(ba::ip::tcp::v4(), listeningPort)) {
+#include <errno.h>
+#include <sys/socket.h>
+
+/**
+ * Creates a proxy server and starts listening
+ * @param io_pool the I/O threads
+ * @param listeningPort the port of the proxy
+ * @param forwardIP the address of the remote server
+ * @param forwardPort the port of the remote server
+ * @param settings the proxy tunables
+ * @param peer the hbox the remote server belongs to, empty for a local server
+ * @param originPort the port of the remote server in its own network, URLs with it are rewritten; 0 for none
+ * @return the server, which runs until it is drained
+ *
+ */
+tcp_proxy_server::pointer tcp_proxy_server::create(io_service_pool& io_pool, int listeningPort, string forwardIP, int forwardPort,
+												   const proxy_settings& settings, const string& peer, int originPort) {
+	pointer server(new tcp_proxy_server(io_pool, listeningPort, forwardIP, forwardPort, settings, peer, originPort));
+	server->open();
+	return server;
+}
+
+/**
+ * Creates the front door and starts listening
+ * @param io_pool the I/O threads
+ * @param listeningPort the port of the front door
+ * @param routes the remote servers the requests are forwarded to
+ * @param settings the proxy tunables, connection limits and timeouts apply to the front door as a whole
+ * @return the server, which runs until it is drained
+ *
+ */
+tcp_proxy_server::pointer tcp_proxy_server::create(io_service_pool& io_pool, int listeningPort, route_table::pointer routes,
+												   const proxy_settings& settings) {
+	pointer server(new tcp_proxy_server(io_pool, listeningPort, routes, settings));
+	server->open();
+	return server;
+}
+
+/**
+ * Creates a proxy server for a context built by the caller, e.g. one with a tunnel, and starts listening
+ * @param io_pool the I/O threads
+ * @param listeningPort the port of the proxy
+ * @param context where to forward and the resources shared by the connections
+ * @return the server, which runs until it is drained
+ *
+ */
+tcp_proxy_server::pointer tcp_proxy_server::create(io_service_pool& io_pool, int listeningPort, proxy_context::pointer context) {
+	pointer server(new tcp_proxy_server(io_pool, listeningPort, context));
+	server->open();
+	return server;
+}
+
+tcp_proxy_server::tcp_proxy_server(io_service_pool& io_pool, int listeningPort, string forwardIP, int forwardPort, const proxy_settings& settings, const string& peer, int originPort) : io_pool_(io_pool),
+	  sweeper_(io_pool.get_io_service()),
+	  context_(new proxy_context(forwardIP, forwardPort, settings, listeningPort, peer, originPort)),
+	  isSharded(false),
+	  isDraining(false) {
+	this->listeningPort = listeningPort;
+}
+
+/**
+ * Constructor of the front door
+ *
+ */
+tcp_proxy_server::tcp_proxy_server(io_service_pool& io_pool, int listeningPort, route_table::pointer routes, const proxy_settings& settings) : io_pool_(io_pool),
+	  sweeper_(io_pool.get_io_service()),
+	  context_(new proxy_context("", 0, settings, listeningPort, "front")),
+	  isSharded(false),
+	  isDraining(false) {
+	this->listeningPort = listeningPort;
+	context_->routes = routes;
+}
+
+tcp_proxy_server::tcp_proxy_server(io_service_pool& io_pool, int listeningPort, proxy_context::pointer context) : io_pool_(io_pool),
+	  sweeper_(io_pool.get_io_service()),
+	  context_(context),
+	  isSharded(false),
+	  isDraining(false) {
 	this->listeningPort = listeningPort;
-	this->forwardIP = forwardIP;
-	this->forwardPort = forwardPort;
+}
+
+/**
+ * Closes the listening port and lets the connections finish the exchanges they are in. A connection which is
+ * not between exchanges after the drain timeout is closed, see tcp_connection::drain(). May be called from any
+ * thread, the acceptors are closed on their own threads.
+ *
+ */
+void tcp_proxy_server::drain() {
+	if (isDraining.exchange(true))
+		return;
+	
+	HBOX_INFO("Draining the proxy on port " << listeningPort);
+	context_->retired = true;
+	for (size_t i = 0; i < acceptors_.size(); i++)
+		acceptors_[i]->io_service.post(boost::bind(&tcp_proxy_server::close_acceptor, shared_from_this(), acceptors_[i]));
 	
-	start_accept();
+	lock_guard<mutex> lock(m);
+	for (list<boost::weak_ptr<tcp_connection> >::iterator it = connections_.begin(); it != connections_.end(); it++) {
+		tcp_connection::pointer connection = it->lock();
+		if (connection)
+			connection->drain();
+	}
+}
+
+/**
+ * @return the number of connections which are still open
+ *
+ */
+size_t tcp_proxy_server::live() {
+	lock_guard<mutex> lock(m);
+	size_t n = 0;
+	for (list<boost::weak_ptr<tcp_connection> >::iterator it = connections_.begin(); it != connections_.end(); it++)
+		if (!it->expired())
+			n++;
+	return n;
 }
 
-void tcp_proxy_server::start_accept() {
-	// Round robin.
-	io_services_.push_back(io_services_.front());
-	io_services_.pop_front();
-	tcp_connection::pointer new_connection = tcp_connection::create(*io_services_.front(), forwardIP, forwardPort);
+/**
+ * Releases a listening socket, its pending accept completes with operation_aborted
+ *
+ */
+void tcp_proxy_server::close_acceptor(proxy_acceptor::pointer acceptor) {
+	bs::error_code ignored;
+	acceptor->acceptor.close(ignored);
+}
 
-	acceptor_.async_accept(new_connection->socket(), boost::bind(&tcp_proxy_server::handle_accept, this, new_connection, ba::placeholders::error));
+/**
+ * Opens the acceptors and starts accepting and sweeping
+ *
+ */
+void tcp_proxy_server::open() {
+	const proxy_settings& settings = context_->settings;
+	
+	if (settings.reusePort && io_pool_.size() > 1) {
+		const ios_deque& services = io_pool_.get_io_services();
+		for (size_t i = 0; i < services.size(); i++) {
+			proxy_acceptor::pointer acceptor(new proxy_acceptor(*services[i]));
+			if (!listen(*acceptor, true)) {
+				HBOX_WARN("SO_REUSEPORT is not available, port " << listeningPort << " uses one acceptor");
+				acceptors_.clear();
+				break;
+			}
+			acceptors_.push_back(acceptor);
+		}
+		isSharded = !acceptors_.empty();
+	}
+	
+	if (acceptors_.empty()) {
+		proxy_acceptor::pointer acceptor(new proxy_acceptor(io_pool_.get_io_service()));
+		if (!listen(*acceptor, false))
+			throw bs::system_error(bs::error_code(errno, bs::system_category()), "cannot listen");
+		acceptors_.push_back(acceptor);
+	}
+	
+	for (size_t i = 0; i < acceptors_.size(); i++)
+		start_accept(acceptors_[i]);
+	start_sweep();
 }
 
-void tcp_proxy_server::handle_accept(tcp_connection::pointer new_connection, const bs::error_code& error) {
-	if (!error) {
+/**
+ * Opens a listening socket on the port of the proxy
+ * @param acceptor the acceptor to open
+ * @param reusePort whether other sockets may listen on the same port
+ * @return false if the socket cannot listen, errno tells why
+ *
+ */
+bool tcp_proxy_server::listen(proxy_acceptor& acceptor, bool reusePort) {
+	bs::error_code err;
+	ba::ip::tcp::acceptor& a = acceptor.acceptor;
+	
+	a.open(ba::ip::tcp::v4(), err);
+	if (!err)
+		a.set_option(ba::ip::tcp::acceptor::reuse_address(true), err);
+	if (!err)
+		context_->settings.tuning.listen(a.native_handle(), *context_->metrics);
+	if (!err && reusePort) {
+#ifdef SO_REUSEPORT
+		int one = 1;
+		if (::setsockopt(a.native_handle(), SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+			return false;
+#else
+		return false;
+#endif
+	}
+	if (!err)
+		a.bind(ba::ip::tcp::endpoint(ba::ip::tcp::v4(), listeningPort), err);
+	if (!err)
+		a.listen(ba::socket_base::max_connections, err);
+	
+	if (err) {
+		errno = err.value();
+		a.close(err);
+		return false;
+	}
+	return true;
+}
+
+void tcp_proxy_server::start_accept(proxy_acceptor::pointer acceptor) {
+	// A sharded acceptor keeps its connections on its own thread, the single one goes round robin over the pool.
+	tcp_connection::pointer new_connection = tcp_connection::create(isSharded ? acceptor->io_service : io_pool_.get_io_service(), context_);
+
+	acceptor->isAccepting = true;
+	acceptor->acceptor.async_accept(new_connection->socket(), boost::bind(&tcp_proxy_server::handle_accept, shared_from_this(), acceptor, new_connection, ba::placeholders::error));
+}
+
+void tcp_proxy_server::handle_accept(proxy_acceptor::pointer acceptor, tcp_connection::pointer new_connection, const bs::error_code& error) {
+	if (error == ba::error::operation_aborted)
+		return;
+	if (isDraining) {
+		bs::error_code ignored;
+		new_connection->socket().close(ignored);
+		return;
+	}
+	
+	if (error) {
+		// the sweeper tries again, so a lack of file descriptors does not spin
+		HBOX_WARN("Cannot accept on port " << listeningPort << ": " << error.message());
+		acceptor->isAccepting = false;
+		return;
+	}
+	
+	if (admit()) {
         HBOX_DEBUG("A client connection is created");
+		context_->metrics->accepted++;
 		new_connection->start();
-		start_accept();
+		lock_guard<mutex> lock(m);
+		connections_.push_back(new_connection);
+	}
+	else {
+		HBOX_WARN("Connection limit reached on port " << listeningPort << ", refusing a client");
+		context_->metrics->rejected++;
+		bs::error_code ignored;
+		new_connection->socket().close(ignored);
+	}
+	start_accept(acceptor);
+}
+
+/**
+ * @return true if neither this proxy nor all proxies together have reached their connection limit
+ *
+ */
+bool tcp_proxy_server::admit() {
+	const proxy_settings& settings = context_->settings;
+	if (settings.maxConnections > 0 && context_->metrics->active >= (unsigned long) settings.maxConnections)
+		return false;
+	if (settings.maxTotalConnections > 0 &&
+		metrics_registry::instance().activeConnections >= (unsigned long) settings.maxTotalConnections)
+		return false;
+	return true;
+}
+
+void tcp_proxy_server::start_sweep() {
+	sweeper_.expires_from_now(boost::posix_time::seconds(1));
+	sweeper_.async_wait(boost::bind(&tcp_proxy_server::handle_sweep, shared_from_this(), ba::placeholders::error));
+}
+
+/**
+ * Asks every open connection to check its timeouts and forgets the finished ones. A draining server stops
+ * sweeping once its last connection is gone, which releases it.
+ *
+ */
+void tcp_proxy_server::handle_sweep(const bs::error_code& error) {
+	if (error == ba::error::operation_aborted)
+		return;
+	
+	bool empty;
+	{
+		lock_guard<mutex> lock(m);
+		for (list<boost::weak_ptr<tcp_connection> >::iterator it = connections_.begin(); it != connections_.end(); ) {
+			tcp_connection::pointer connection = it->lock();
+			if (!connection) {
+				it = connections_.erase(it);
+				continue;
+			}
+			connection->check_timeouts();
+			it++;
+		}
+		empty = connections_.empty();
+	}
+	
+	if (isDraining) {
+		if (empty) {
+			HBOX_INFO("The proxy on port " << listeningPort << " is drained");
+			return;
+		}
 	}
+	else
+		for (size_t i = 0; i < acceptors_.size(); i++)
+			if (!acceptors_[i]->isAccepting)
+				acceptors_[i]->io_service.post(boost::bind(&tcp_proxy_server::start_accept, shared_from_this(), acceptors_[i]));
+	start_sweep();
 }
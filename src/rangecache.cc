@@ -0,0 +1,490 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "rangecache.hh"
+#include "hbox.hh"
+
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <boost/algorithm/string.hpp>
+
+// header fields which describe one message or one connection, never replayed from the cache
+static const char* transient_fields[] = { "Content-Length", "Content-Range", "Transfer-Encoding", "Connection",
+										  "Keep-Alive", "Proxy-Connection", "Date", "Set-Cookie", "Trailer",
+										  "Upgrade", NULL };
+
+cache_hit::~cache_hit() {
+	close();
+}
+
+void cache_hit::close() {
+	if (fd >= 0) ::close(fd);
+	fd = -1;
+}
+
+cache_fill::~cache_fill() {
+	commit();
+}
+
+/**
+ * Stores the next bytes of the body
+ * @param data body bytes
+ * @param len number of bytes
+ *
+ */
+void cache_fill::write(const char* data, size_t len) {
+	if (fd < 0 || failed) return;
+	
+	while (len > 0) {
+		ssize_t n = ::pwrite(fd, data, len, offset + written);
+		if (n <= 0) {
+			failed = true;
+			return;
+		}
+		data += n;
+		len -= n;
+		written += n;
+	}
+}
+
+/**
+ * Records the stored bytes in the cache index, also for a body which was cut short
+ *
+ */
+void cache_fill::commit() {
+	if (fd < 0) return;
+	
+	::close(fd);
+	fd = -1;
+	if (written > 0)
+		range_cache::instance().commit(key, generation, offset, written);
+}
+
+range_cache& range_cache::instance() {
+	static range_cache cache;
+	return cache;
+}
+
+range_cache::range_cache() : maxBytes(0), size(0), hits(0), misses(0), generations(0) {
+}
+
+/**
+ * Enables the cache and loads the index of a previous run
+ * @param dir the cache directory, created if missing
+ * @param maxBytes disk space the cached ranges may use
+ * @return false if the directory cannot be used, the cache stays disabled
+ *
+ */
+bool range_cache::open(const string& dir, unsigned long long maxBytes) {
+	::mkdir(dir.c_str(), 0700);
+	if (::access(dir.c_str(), R_OK | W_OK | X_OK) != 0) {
+		HBOX_ERROR("Cannot use cache directory " << dir);
+		return false;
+	}
+	
+	lock_guard<mutex> lock(m);
+	this->dir = dir;
+	this->maxBytes = maxBytes;
+	load();
+	evict();
+	HBOX_INFO("Range cache in " << dir << " holds " << size << " of " << maxBytes << " bytes");
+	return true;
+}
+
+/**
+ * 64-bit FNV-1a of the key, the key itself is kept in the index file
+ *
+ */
+string range_cache::nameOf(const string& key) {
+	unsigned long long h = 14695981039346656037ULL;
+	for (size_t i = 0; i < key.size(); i++) {
+		h ^= (unsigned char) key[i];
+		h *= 1099511628211ULL;
+	}
+	
+	char name[17];
+	snprintf(name, sizeof(name), "%016llx", h);
+	return name;
+}
+
+string range_cache::validatorOf(const http_head& head) {
+	return head.has("ETag") ? head.get("ETag") : head.get("Last-Modified");
+}
+
+/**
+ * Whether Cache-Control lets a shared cache keep the response: neither no-store, private nor no-cache, with or
+ * without a list of field names. The cache does not revalidate, so a response which must be revalidated is not kept.
+ *
+ */
+bool range_cache::storable(const http_head& response) {
+	for (size_t i = 0; i < response.fields.size(); i++)
+		if (boost::iequals(response.fields[i].first, "Cache-Control")) {
+			vector<string> tokens;
+			boost::split(tokens, response.fields[i].second, boost::is_any_of(","));
+			for (size_t j = 0; j < tokens.size(); j++) {
+				string directive = boost::trim_copy(tokens[j].substr(0, tokens[j].find('=')));
+				if (boost::iequals(directive, "no-store") || boost::iequals(directive, "private") ||
+					boost::iequals(directive, "no-cache"))
+					return false;
+			}
+		}
+	return true;
+}
+
+/**
+ * When the response stops being fresh: s-maxage or max-age of Cache-Control less its Age, or else Expires. An
+ * Expires which cannot be parsed is in the past.
+ * @param response the response head
+ * @param now the time the response was received
+ * @return the expiry time, 0 if the response gives no lifetime
+ *
+ */
+time_t range_cache::expiryOf(const http_head& response, time_t now) {
+	long long maxAge = -1;
+	for (size_t i = 0; i < response.fields.size(); i++)
+		if (boost::iequals(response.fields[i].first, "Cache-Control")) {
+			vector<string> tokens;
+			boost::split(tokens, response.fields[i].second, boost::is_any_of(","));
+			for (size_t j = 0; j < tokens.size(); j++) {
+				string::size_type eq = tokens[j].find('=');
+				if (eq == string::npos)
+					continue;
+				string directive = boost::trim_copy(tokens[j].substr(0, eq));
+				long long value = atoll(boost::trim_copy_if(tokens[j].substr(eq + 1), boost::is_any_of(" \t\"")).c_str());
+				if (boost::iequals(directive, "s-maxage"))
+					return now + max(0LL, value - atoll(response.get("Age").c_str()));
+				if (boost::iequals(directive, "max-age"))
+					maxAge = value;
+			}
+		}
+	if (maxAge >= 0)
+		return now + max(0LL, maxAge - atoll(response.get("Age").c_str()));
+	
+	if (!response.has("Expires"))
+		return 0;
+	struct tm expires = {};
+	const char* end = ::strptime(response.get("Expires").c_str(), "%a, %d %b %Y %H:%M:%S GMT", &expires);
+	return end ? ::timegm(&expires) : 1;
+}
+
+/**
+ * Reads all index files of the cache directory. The caller holds the lock.
+ *
+ */
+void range_cache::load() {
+	DIR* d = ::opendir(dir.c_str());
+	if (!d) return;
+	
+	struct dirent* de;
+	while ((de = ::readdir(d)) != NULL) {
+		string file = de->d_name;
+		if (file.size() != 20 || file.compare(16, 4, ".idx") != 0)
+			continue;
+		
+		ifstream in((dir + "/" + file).c_str());
+		entry e;
+		string line;
+		if (!getline(in, e.key) || !(in >> e.total) || !getline(in, line) || !getline(in, e.validator))
+			continue;
+		
+		e.name = file.substr(0, 16);
+		e.bytes = 0;
+		e.expires = 0;
+		e.generation = ++generations;
+		struct stat st;
+		e.lastUse = ::stat((dir + "/" + file).c_str(), &st) == 0 ? st.st_mtime : time(NULL);
+		
+		while (getline(in, line)) {
+			if (line.compare(0, 2, "R ") == 0) {
+				unsigned long long first, end;
+				istringstream is(line.substr(2));
+				if (is >> first >> end && first < end) {
+					e.ranges[first] = end;
+					e.bytes += end - first;
+				}
+			}
+			else if (line.compare(0, 2, "E ") == 0)
+				e.expires = atoll(line.c_str() + 2);
+			else if (line.compare(0, 2, "H ") == 0) {
+				string::size_type colon = line.find(':');
+				if (colon != string::npos)
+					e.fields.push_back(make_pair(line.substr(2, colon - 2), boost::trim_copy(line.substr(colon + 1))));
+			}
+		}
+		
+		if (e.bytes > 0 && nameOf(e.key) == e.name) {
+			size += e.bytes;
+			entries[e.key] = e;
+		}
+	}
+	::closedir(d);
+}
+
+/**
+ * Writes the index file of an entry. The caller holds the lock.
+ *
+ */
+void range_cache::save(const entry& e) {
+	string tmp = dir + "/" + e.name + ".tmp";
+	{
+		ofstream out(tmp.c_str());
+		out << e.key << "\n" << e.total << "\n" << e.validator << "\n";
+		if (e.expires)
+			out << "E " << (long long) e.expires << "\n";
+		for (size_t i = 0; i < e.fields.size(); i++)
+			out << "H " << e.fields[i].first << ": " << e.fields[i].second << "\n";
+		for (map<unsigned long long, unsigned long long>::const_iterator it = e.ranges.begin(); it != e.ranges.end(); it++)
+			out << "R " << it->first << " " << it->second << "\n";
+	}
+	::rename(tmp.c_str(), (dir + "/" + e.name + ".idx").c_str());
+}
+
+/**
+ * Removes an entry and its files. The caller holds the lock.
+ *
+ */
+void range_cache::drop(map<string, entry>::iterator it) {
+	::unlink((dir + "/" + it->second.name + ".idx").c_str());
+	::unlink((dir + "/" + it->second.name + ".data").c_str());
+	size -= it->second.bytes;
+	entries.erase(it);
+}
+
+/**
+ * Drops the least recently used entries until the cache fits its size. The caller holds the lock.
+ *
+ */
+void range_cache::evict() {
+	while (size > maxBytes && !entries.empty()) {
+		map<string, entry>::iterator oldest = entries.begin();
+		for (map<string, entry>::iterator it = entries.begin(); it != entries.end(); it++)
+			if (it->second.lastUse < oldest->second.lastUse)
+				oldest = it;
+		HBOX_DEBUG("Evicting " << oldest->first << " from the range cache");
+		drop(oldest);
+	}
+}
+
+/**
+ * Looks for a GET request which the cached ranges can answer completely
+ * @param key the cache key of the requested resource
+ * @param request the request head
+ * @param hit filled with the local response on success
+ * @return true on a hit
+ *
+ */
+bool range_cache::lookup(const string& key, const http_head& request, cache_hit& hit) {
+	if (!enabled() || request.method != "GET")
+		return false;
+	
+	lock_guard<mutex> lock(m);
+	map<string, entry>::iterator it = entries.find(key);
+	if (it == entries.end() || it->second.total <= 0) {
+		misses++;
+		return false;
+	}
+	entry& e = it->second;
+	
+	// a stale entry is not revalidated, the remote server answers and the fill renews it
+	if (e.expires && e.expires <= time(NULL)) {
+		misses++;
+		return false;
+	}
+	
+	// the requested bytes
+	bool partial = request.has("Range");
+	long long first = 0, last = e.total - 1;
+	if (partial) {
+		if (!request.getRange(first, last)) {
+			misses++;
+			return false;
+		}
+		if (first < 0) {
+			first = last >= e.total ? 0 : e.total - last;
+			last = e.total - 1;
+		}
+		if (last < 0 || last >= e.total)
+			last = e.total - 1;
+		if (first > last) {
+			misses++;
+			return false;
+		}
+		
+		// a client holding another representation wants all of the current one, which only the remote server knows
+		if (request.has("If-Range")) {
+			string condition = request.get("If-Range");
+			if (e.validator.empty() || e.validator.compare(0, 2, "W/") == 0 || condition != e.validator) {
+				misses++;
+				return false;
+			}
+		}
+	}
+	
+	// one stored range must cover them
+	map<unsigned long long, unsigned long long>::iterator r = e.ranges.upper_bound(first);
+	if (r == e.ranges.begin() || (--r)->second < (unsigned long long) last + 1) {
+		misses++;
+		return false;
+	}
+	
+	hit.fd = ::open((dir + "/" + e.name + ".data").c_str(), O_RDONLY | O_CLOEXEC);
+	if (hit.fd < 0) {
+		drop(it);
+		misses++;
+		return false;
+	}
+	
+	hit.offset = first;
+	hit.length = last - first + 1;
+	
+	ostringstream head;
+	head << "HTTP/1.1 " << (partial ? "206 Partial Content" : "200 OK") << "\r\n";
+	for (size_t i = 0; i < e.fields.size(); i++)
+		head << e.fields[i].first << ": " << e.fields[i].second << "\r\n";
+	if (partial)
+		head << "Content-Range: bytes " << first << "-" << last << "/" << e.total << "\r\n";
+	head << "Content-Length: " << hit.length << "\r\n";
+	if (request.version == "HTTP/1.0")
+		head << "Connection: keep-alive\r\n";
+	head << "\r\n";
+	hit.head = head.str();
+	
+	e.lastUse = time(NULL);
+	hits++;
+	return true;
+}
+
+/**
+ * Prepares storing the body of a response
+ * @param key the cache key of the requested resource
+ * @param request the request head
+ * @param response the response head
+ * @param fill set up to store the body if the response can be cached
+ * @return true if the body will be stored
+ *
+ */
+bool range_cache::fill(const string& key, const http_head& request, const http_head& response, cache_fill& fill) {
+	if (!enabled() || request.method != "GET" || response.has("Transfer-Encoding") || response.has("Content-Encoding"))
+		return false;
+	
+	time_t now = time(NULL);
+	time_t expires = expiryOf(response, now);
+	if (!storable(response) || (expires && expires <= now)) {
+		// the stored ranges are not to be served anymore either
+		lock_guard<mutex> lock(m);
+		map<string, entry>::iterator it = entries.find(key);
+		if (it != entries.end())
+			drop(it);
+		return false;
+	}
+	
+	long long first, last, total;
+	if (response.status == 200 && !request.has("Range") && response.has("Content-Length")) {
+		first = 0;
+		total = atoll(response.get("Content-Length").c_str());
+	}
+	else if (response.status == 206 && response.getContentRange(first, last, total) && total > 0) {
+	}
+	else
+		return false;
+	if (total <= 0)
+		return false;
+	
+	lock_guard<mutex> lock(m);
+	entry& e = entries[key];
+	string validator = validatorOf(response);
+	if (e.key.empty() || e.total != total || e.validator != validator) {
+		// new resource, or the remote one changed
+		if (!e.key.empty())
+			::unlink((dir + "/" + e.name + ".data").c_str());
+		size -= e.bytes;
+		e.key = key;
+		e.name = nameOf(key);
+		e.total = total;
+		e.validator = validator;
+		e.ranges.clear();
+		e.bytes = 0;
+		e.generation = ++generations;	// fills still writing the old data file are not committed anymore
+	}
+	
+	e.fields.clear();
+	for (size_t i = 0; i < response.fields.size(); i++) {
+		bool keep = true;
+		for (int j = 0; transient_fields[j] && keep; j++)
+			keep = !boost::iequals(response.fields[i].first, transient_fields[j]);
+		if (keep)
+			e.fields.push_back(response.fields[i]);
+	}
+	e.expires = expires;
+	e.lastUse = now;
+	
+	fill.commit();
+	fill.fd = ::open((dir + "/" + e.name + ".data").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+	fill.key = key;
+	fill.generation = e.generation;
+	fill.offset = first;
+	fill.written = 0;
+	fill.failed = false;
+	return fill.active();
+}
+
+/**
+ * Adds a stored range to the index of an entry and merges it with its neighbours
+ * @param key the cache key
+ * @param generation of the entry when the fill started, the range is dropped if the entry was renewed since
+ * @param offset first byte of the range
+ * @param length number of bytes
+ *
+ */
+void range_cache::commit(const string& key, unsigned long generation, unsigned long long offset, unsigned long long length) {
+	lock_guard<mutex> lock(m);
+	map<string, entry>::iterator it = entries.find(key);
+	if (it == entries.end() || it->second.generation != generation)
+		return;
+	entry& e = it->second;
+	
+	unsigned long long first = offset, end = offset + length;
+	map<unsigned long long, unsigned long long>::iterator r = e.ranges.upper_bound(first);
+	if (r != e.ranges.begin()) {
+		--r;
+		if (r->second < first)
+			++r;
+	}
+	while (r != e.ranges.end() && r->first <= end) {
+		first = min(first, r->first);
+		end = max(end, r->second);
+		e.bytes -= r->second - r->first;
+		size -= r->second - r->first;
+		e.ranges.erase(r++);
+	}
+	e.ranges[first] = end;
+	e.bytes += end - first;
+	size += end - first;
+	
+	save(e);
+	evict();
+}
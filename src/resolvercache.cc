@@ -0,0 +1,144 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "resolvercache.hh"
+
+map<string, ba::ip::address> resolver_cache::winners;
+mutex resolver_cache::winnersLock;
+
+/**
+ * Constructor of resolver_cache class
+ * @param ttl seconds a resolution stays valid, 0 disables the cache
+ * @param host the forward target, the connect races to it share their winner
+ *
+ */
+resolver_cache::resolver_cache(int ttl, const string& host) : host(host), expires(0), ttl(ttl), hits(0), misses(0) {
+}
+
+/**
+ * @param endpoints set to the cached endpoints
+ * @return false if nothing valid is cached, the caller resolves and stores the result
+ *
+ */
+bool resolver_cache::lookup(endpoint_list& endpoints) {
+	lock_guard<mutex> lock(m);
+	if (endpoints_.empty() || time(NULL) >= expires) {
+		misses++;
+		return false;
+	}
+	
+	endpoints = endpoints_;
+	promote(endpoints);	// another proxy to the host may have found a better address since the store
+	hits++;
+	return true;
+}
+
+/**
+ * @param endpoints the resolved endpoints, put in the order they are raced
+ *
+ */
+void resolver_cache::store(endpoint_list& endpoints) {
+	lock_guard<mutex> lock(m);
+	order(endpoints);
+	endpoints_ = endpoints;
+	expires = time(NULL) + ttl;
+}
+
+/**
+ * Remembers the address a connection got through first, the next connections to the host try it first
+ * @param winner the endpoint of the connect which won the race
+ *
+ */
+void resolver_cache::prefer(const ba::ip::tcp::endpoint& winner) {
+	lock_guard<mutex> lock(m);
+	{
+		lock_guard<mutex> shared(winnersLock);
+		ba::ip::address& preferred = winners[host];
+		if (preferred == winner.address())
+			return;
+		preferred = winner.address();
+	}
+	promote(endpoints_);
+}
+
+/**
+ * Forgets the cached endpoints and the last winner of the host, called when none of them could be connected
+ *
+ */
+void resolver_cache::invalidate() {
+	lock_guard<mutex> lock(m);
+	endpoints_.clear();
+	lock_guard<mutex> shared(winnersLock);
+	winners.erase(host);
+}
+
+/**
+ * Alternates the address families, starting with the family the resolver put first, and moves the last winner
+ * of the host to the front
+ * @param endpoints the endpoints to order
+ *
+ */
+void resolver_cache::order(endpoint_list& endpoints) const {
+	if (endpoints.empty())
+		return;
+	
+	endpoint_list first, second;
+	for (endpoint_list::const_iterator it = endpoints.begin(); it != endpoints.end(); it++) {
+		if (it->address().is_v6() == endpoints.front().address().is_v6())
+			first.push_back(*it);
+		else
+			second.push_back(*it);
+	}
+	
+	endpoints.clear();
+	for (size_t i = 0; i < first.size() || i < second.size(); i++) {
+		if (i < first.size())
+			endpoints.push_back(first[i]);
+		if (i < second.size())
+			endpoints.push_back(second[i]);
+	}
+	
+	promote(endpoints);
+}
+
+/**
+ * Moves the endpoint with the address which last won a race to the host to the front
+ * @param endpoints the endpoints to order
+ *
+ */
+void resolver_cache::promote(endpoint_list& endpoints) const {
+	ba::ip::address preferred;
+	{
+		lock_guard<mutex> shared(winnersLock);
+		map<string, ba::ip::address>::const_iterator it = winners.find(host);
+		if (it == winners.end())
+			return;
+		preferred = it->second;
+	}
+	
+	for (endpoint_list::iterator winner = endpoints.begin(); winner != endpoints.end(); winner++)
+		if (winner->address() == preferred) {
+			rotate(endpoints.begin(), winner, winner + 1);
+			return;
+		}
+}
@@ -0,0 +1,91 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "routetable.hh"
+
+#include <cstring>
+
+/**
+ * Registers a remote server under an id, replacing the one it had before
+ * @param id the route id, the first path segment after the prefix
+ * @param context the proxy context which connects to the remote server
+ *
+ */
+void route_table::add(const string& id, proxy_context::pointer context) {
+	lock_guard<mutex> lock(m);
+	routes_[id] = context;
+}
+
+/**
+ * Forgets a route, connections already forwarding to it keep their context
+ * @param id the route id
+ *
+ */
+void route_table::remove(const string& id) {
+	lock_guard<mutex> lock(m);
+	routes_.erase(id);
+}
+
+/**
+ * @param id the route id
+ * @return the proxy context of the route, empty if there is none
+ *
+ */
+proxy_context::pointer route_table::find(const string& id) {
+	lock_guard<mutex> lock(m);
+	map<string, proxy_context::pointer>::iterator it = routes_.find(id);
+	return it == routes_.end() ? proxy_context::pointer() : it->second;
+}
+
+/**
+ * @param id the route id
+ * @return the path prefix resource URLs of the route start with
+ *
+ */
+string route_table::prefix(const string& id) {
+	return ROUTE_PREFIX + id;
+}
+
+/**
+ * Takes the route id out of a request target of the form /hbox/<id>/<path>
+ * @param uri the request target
+ * @param id set to the route id
+ * @param rest set to the request target on the remote server
+ * @return false if the target does not start with the prefix
+ *
+ */
+bool route_table::split(const string& uri, string& id, string& rest) {
+	if (uri.compare(0, strlen(ROUTE_PREFIX), ROUTE_PREFIX) != 0)
+		return false;
+	
+	size_t start = strlen(ROUTE_PREFIX);
+	size_t end = uri.find_first_of("/?", start);
+	if (end == start)
+		return false;
+	
+	id = uri.substr(start, end == string::npos ? string::npos : end - start);
+	rest = end == string::npos ? "/" : uri.substr(end);
+	if (rest[0] == '?')
+		rest = "/" + rest;
+	return true;
+}
@@ -0,0 +1,155 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+
+
+#include "sockettuning.hh"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// pending Fast Open requests a listener accepts
+#define TUNING_FASTOPEN_QUEUE 64
+
+/**
+ * Constructor of socket_tuning class, sets the defaults: Nagle's algorithm only for bulk transfers, buffers left
+ * to the kernel, at most 128 kilobytes not yet sent in a socket, and keepalive after a minute of silence
+ *
+ */
+socket_tuning::socket_tuning() {
+	noDelay[TRAFFIC_CONTROL] = true;
+	noDelay[TRAFFIC_INTERACTIVE] = true;
+	noDelay[TRAFFIC_BULK] = false;
+	receiveBuffer = 0;
+	sendBuffer = 0;
+	notSentLowat = 128 * 1024;
+	keepIdle = 60;
+	keepInterval = 10;
+	keepCount = 6;
+	fastOpen = false;
+}
+
+/**
+ * Overrides the defaults with the keys found in the configuration file, sizes are given in kilobytes
+ * @param cf the hbox configuration file
+ *
+ */
+void socket_tuning::load(const ConfigFile& cf) {
+	for (int c = 0; c < TRAFFIC_CLASSES; c++)
+		noDelay[c] = cf.read<string>(string("nodelay_") + traffic_class_name((traffic_class) c), noDelay[c] ? "yes" : "no") == "yes";
+	receiveBuffer = cf.read<int>("socket_receive_buffer", receiveBuffer / 1024) * 1024;
+	sendBuffer = cf.read<int>("socket_send_buffer", sendBuffer / 1024) * 1024;
+	notSentLowat = cf.read<int>("notsent_lowat", notSentLowat / 1024) * 1024;
+	keepIdle = cf.read<int>("keepalive_idle", keepIdle);
+	keepInterval = cf.read<int>("keepalive_interval", keepInterval);
+	keepCount = cf.read<int>("keepalive_count", keepCount);
+	congestion = cf.read<string>("congestion_control", congestion);
+	fastOpen = cf.read<string>("fast_open", "no") == "yes";
+}
+
+/**
+ * Sets an integer option, counting a refusal in the metrics
+ *
+ */
+static void set_option(int fd, int level, int name, int value, proxy_metrics& metrics) {
+	if (::setsockopt(fd, level, name, &value, sizeof(value)) < 0)
+		metrics.tuningFailures++;
+}
+
+/**
+ * Records the buffer sizes the kernel granted a socket
+ *
+ */
+static void measure_buffers(int fd, proxy_metrics& metrics) {
+	int size;
+	socklen_t len = sizeof(size);
+	if (::getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &len) == 0)
+		metrics.receiveBuffer = size;
+	len = sizeof(size);
+	if (::getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, &len) == 0)
+		metrics.sendBuffer = size;
+}
+
+/**
+ * Tunes a listening socket before it binds. The accepted sockets inherit its buffers.
+ * @param fd the listening socket
+ * @param metrics the metrics of the proxy
+ *
+ */
+void socket_tuning::listen(int fd, proxy_metrics& metrics) const {
+	if (receiveBuffer > 0)
+		set_option(fd, SOL_SOCKET, SO_RCVBUF, receiveBuffer, metrics);
+	if (sendBuffer > 0)
+		set_option(fd, SOL_SOCKET, SO_SNDBUF, sendBuffer, metrics);
+#ifdef TCP_FASTOPEN
+	if (fastOpen)
+		set_option(fd, IPPROTO_TCP, TCP_FASTOPEN, TUNING_FASTOPEN_QUEUE, metrics);
+#endif
+}
+
+/**
+ * Tunes an accepted socket, or an upstream socket before it connects
+ * @param fd the socket
+ * @param peer true for a connect to another hbox, which may use Fast Open
+ * @param metrics the metrics of the proxy
+ *
+ */
+void socket_tuning::apply(int fd, bool peer, proxy_metrics& metrics) const {
+	if (receiveBuffer > 0)
+		set_option(fd, SOL_SOCKET, SO_RCVBUF, receiveBuffer, metrics);
+	if (sendBuffer > 0)
+		set_option(fd, SOL_SOCKET, SO_SNDBUF, sendBuffer, metrics);
+#ifdef TCP_NOTSENT_LOWAT
+	if (notSentLowat > 0)
+		set_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, notSentLowat, metrics);
+#endif
+	if (keepIdle > 0) {
+		set_option(fd, SOL_SOCKET, SO_KEEPALIVE, 1, metrics);
+#ifdef TCP_KEEPIDLE
+		set_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, keepIdle, metrics);
+		set_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, keepInterval, metrics);
+		set_option(fd, IPPROTO_TCP, TCP_KEEPCNT, keepCount, metrics);
+#endif
+	}
+#ifdef TCP_CONGESTION
+	if (!congestion.empty() && ::setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, congestion.data(), congestion.size()) < 0)
+		metrics.tuningFailures++;
+#endif
+#ifdef TCP_FASTOPEN_CONNECT
+	if (fastOpen && peer)
+		set_option(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, metrics);
+#endif
+	measure_buffers(fd, metrics);
+}
+
+/**
+ * Turns Nagle's algorithm on or off for the traffic class of the exchange the socket carries
+ * @param fd the socket
+ * @param c the traffic class
+ *
+ */
+void socket_tuning::apply_class(int fd, traffic_class c) const {
+	int value = noDelay[c] ? 1 : 0;
+	::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+}
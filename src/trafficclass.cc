@@ -0,0 +1,109 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "trafficclass.hh"
+
+#include <cstdlib>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <sys/socket.h>
+#include <boost/algorithm/string.hpp>
+
+/**
+ * Classifies a request before its response is known: actions and subscriptions are control, a GET is
+ * interactive until its response tells more, unless it asks for a media stream from some offset on
+ * @param request the request head
+ * @return the traffic class of the exchange
+ *
+ */
+traffic_class classify_request(const http_head& request) {
+	if (request.has("SOAPAction") || (request.method != "GET" && request.method != "HEAD"))
+		return TRAFFIC_CONTROL;
+	
+	long long first, last;
+	if (request.getRange(first, last) && first >= 0 && last < 0)
+		return TRAFFIC_BULK;
+	return TRAFFIC_INTERACTIVE;
+}
+
+/**
+ * Classifies an exchange by its response head: descriptions and other documents are control, images
+ * interactive, media and any large body bulk
+ * @param requested the class given to the request
+ * @param response the response head
+ * @return the traffic class of the exchange
+ *
+ */
+traffic_class classify_response(traffic_class requested, const http_head& response) {
+	if (requested == TRAFFIC_CONTROL)
+		return TRAFFIC_CONTROL;
+	
+	string type = response.get("Content-Type");
+	if (boost::istarts_with(type, "video/") || boost::istarts_with(type, "audio/"))
+		return TRAFFIC_BULK;
+	if (response.has("Content-Length") && atoll(response.get("Content-Length").c_str()) > TRAFFIC_BULK_SIZE)
+		return TRAFFIC_BULK;
+	if (boost::istarts_with(type, "text/") || boost::icontains(type, "xml") || boost::icontains(type, "json"))
+		return TRAFFIC_CONTROL;
+	if (boost::istarts_with(type, "image/"))
+		return TRAFFIC_INTERACTIVE;
+	return requested;
+}
+
+/**
+ * @return the name of a traffic class, used as metrics label and in the configuration keys
+ *
+ */
+const char* traffic_class_name(traffic_class c) {
+	static const char* const names[TRAFFIC_CLASSES] = { "control", "interactive", "bulk" };
+	return names[c];
+}
+
+/**
+ * Marks the packets a socket sends: the DSCP tells the routers and the Wi-Fi access point of the home how
+ * urgent they are, and on Linux the socket priority picks the band of the local queueing discipline, so that
+ * control packets leave ahead of queued media
+ * @param socket an open socket
+ * @param dscp the differentiated services code point, -1 for unmarked packets of the default priority
+ * @param c the traffic class, for the socket priority
+ *
+ */
+void mark_traffic(ba::ip::tcp::socket& socket, int dscp, traffic_class c) {
+	if (!socket.is_open())
+		return;
+	
+	bs::error_code ec;
+	int fd = socket.native_handle();
+	int tos = dscp < 0 ? 0 : dscp << 2;
+	if (socket.local_endpoint(ec).address().is_v6())
+		::setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+	else
+		::setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+	
+#ifdef SO_PRIORITY
+	// TC_PRIO_INTERACTIVE, TC_PRIO_BESTEFFORT and TC_PRIO_BULK, the highest ones need no privilege
+	static const int priorities[TRAFFIC_CLASSES] = { 6, 0, 2 };
+	int priority = dscp < 0 ? 0 : priorities[c];
+	::setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority));
+#endif
+}
@@ -0,0 +1,941 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+
+#include "tunnel.hh"
+#include "hbox.hh"
+
+#include <cstring>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+/**
+ * Constructor of tunnel_session class
+ * @param io_service the thread of the tunnel and its streams
+ * @param client true for the end which opens the streams
+ * @param admit tells the ports the other end may open streams to, server end only
+ * @param onEnd called once when the tunnel is lost
+ * @param onRefuse given the streams which were not accepted by the other end, client end only
+ *
+ */
+tunnel_session::tunnel_session(ba::io_service& io_service, bool client, admission admit, ended onEnd, refusal onRefuse) : io_service_(io_service),
+	socket_(io_service),
+	isClient(client),
+	isClosed(false),
+	isWriting(false),
+	admit_(admit),
+	onEnd_(onEnd),
+	onRefuse_(onRefuse),
+	in_(64 * 1024),
+	writingFrames(0),
+	nextId(1) {
+}
+
+/**
+ * Starts the tunnel once its socket is connected: the client sends the preface, the server waits for it
+ *
+ */
+void tunnel_session::start() {
+	bs::error_code ignored;
+	socket_.set_option(ba::ip::tcp::no_delay(true), ignored);
+	socket_.set_option(ba::socket_base::keep_alive(true), ignored);
+	
+	if (!isClient) {
+		ba::async_read(socket_, ba::buffer(preface_), boost::bind(&tunnel_session::handle_preface, shared_from_this(),
+																 ba::placeholders::error));
+		return;
+	}
+	
+	frames_.push_back(frame());
+	frames_.back().bytes = TUNNEL_PREFACE;
+	frames_.back().stream = 0;
+	flush();
+	start_read();
+}
+
+void tunnel_session::handle_preface(const bs::error_code& err) {
+	if (isClosed)
+		return;
+	if (err || memcmp(preface_, TUNNEL_PREFACE, sizeof(preface_)) != 0) {
+		HBOX_WARN("A tunnel client does not speak " << TUNNEL_PREFACE << ", closing it");
+		close();
+		return;
+	}
+	start_read();
+}
+
+void tunnel_session::start_read() {
+	socket_.async_read_some(ba::buffer(in_), boost::bind(&tunnel_session::handle_read, shared_from_this(),
+														  ba::placeholders::error, ba::placeholders::bytes_transferred));
+}
+
+/**
+ * Takes the complete frames out of what the tunnel delivered
+ *
+ */
+void tunnel_session::handle_read(const bs::error_code& err, size_t len) {
+	if (isClosed)
+		return;
+	if (err) {
+		if (err != ba::error::eof)
+			HBOX_INFO("Tunnel read failed: " << err.message());
+		close();
+		return;
+	}
+	
+	// frames are taken from the read buffer itself unless one was cut at the end of the previous read
+	const char* data = &in_[0];
+	size_t size = len;
+	if (!pending_.empty()) {
+		pending_.append(data, len);
+		data = pending_.data();
+		size = pending_.size();
+	}
+	
+	size_t pos = 0;
+	while (size - pos >= TUNNEL_HEADER) {
+		const unsigned char* h = (const unsigned char*) data + pos;
+		unsigned id = ((unsigned) h[0] << 24) | ((unsigned) h[1] << 16) | ((unsigned) h[2] << 8) | h[3];
+		size_t n = ((size_t) h[6] << 8) | h[7];
+		if (size - pos < TUNNEL_HEADER + n)
+			break;
+		if (!dispatch(id, h[4], data + pos + TUNNEL_HEADER, n)) {
+			HBOX_WARN("Tunnel protocol error on stream " << id << ", closing the tunnel");
+			close();
+			return;
+		}
+		pos += TUNNEL_HEADER + n;
+	}
+	
+	if (pending_.empty())
+		pending_.assign(data + pos, size - pos);
+	else
+		pending_.erase(0, pos);
+	start_read();
+}
+
+/**
+ * Handles one frame
+ * @param id the stream of the frame
+ * @param type the frame type, see tunnel_frame_type
+ * @param payload the payload bytes
+ * @param len number of bytes in payload
+ * @return false if the frame breaks the protocol
+ *
+ */
+bool tunnel_session::dispatch(unsigned id, int type, const char* payload, size_t len) {
+	const unsigned char* p = (const unsigned char*) payload;
+	if (type == TUNNEL_OPEN) {
+		if (isClient || id == 0 || len != 2 || streams_.count(id))
+			return false;
+		open_stream(id, (p[0] << 8) | p[1]);
+		return true;
+	}
+	
+	map<unsigned, tunnel_stream::pointer>::iterator it = streams_.find(id);
+	if (it == streams_.end())
+		return true; // a stream this end reset, the frames sent before the other end knew it are dropped
+	tunnel_stream::pointer stream = it->second;
+	
+	switch (type) {
+	case TUNNEL_DATA:
+		if (stream->peerEnd || stream->queued + len > TUNNEL_STREAM_WINDOW)
+			return false;
+		stream->out.push_back(string(payload, len));
+		stream->queued += len;
+		flush_stream(stream);
+		return true;
+		
+	case TUNNEL_WINDOW:
+		if (len != 4)
+			return false;
+		stream->credit += ((size_t) p[0] << 24) | ((size_t) p[1] << 16) | ((size_t) p[2] << 8) | p[3];
+		start_stream_read(stream);
+		return true;
+		
+	case TUNNEL_FIN:
+		stream->peerEnd = true;
+		flush_stream(stream);
+		return true;
+		
+	case TUNNEL_RESET:
+		if (isClient && !stream->accepted)
+			refuse_stream(stream);
+		else
+			reset_stream(stream, false);
+		return true;
+		
+	case TUNNEL_ACCEPT:
+		if (!isClient || stream->accepted || len != 0)
+			return false;
+		stream->accepted = true;
+		start_stream_read(stream);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Opens a stream the other end asked for by connecting the local port, if it is one the tunnel serves
+ * @param id the stream id given by the other end
+ * @param port the local port
+ *
+ */
+void tunnel_session::open_stream(unsigned id, int port) {
+	if (streams_.size() >= TUNNEL_MAX_STREAMS || !admit_ || !admit_(port)) {
+		HBOX_INFO("Tunnel stream to port " << port << " refused");
+		send(id, TUNNEL_RESET, NULL, 0);
+		return;
+	}
+	
+	tunnel_stream::pointer stream(new tunnel_stream(io_service_));
+	stream->id = id;
+	streams_[id] = stream;
+	stream->socket.async_connect(ba::ip::tcp::endpoint(ba::ip::address_v4::loopback(), port),
+								 boost::bind(&tunnel_session::handle_stream_connect, shared_from_this(), stream,
+											 ba::placeholders::error));
+}
+
+void tunnel_session::handle_stream_connect(tunnel_stream::pointer stream, const bs::error_code& err) {
+	if (stream->closed)
+		return;
+	if (err) {
+		reset_stream(stream, true);
+		return;
+	}
+	
+	bs::error_code ignored;
+	stream->socket.set_option(ba::ip::tcp::no_delay(true), ignored);
+	stream->connected = true;
+	stream->accepted = true;
+	send(stream->id, TUNNEL_ACCEPT, NULL, 0);
+	flush_stream(stream);
+	start_stream_read(stream);
+}
+
+/**
+ * Carries a connection accepted at this end to a port of the other end. Its socket is read once the other end
+ * accepted the stream.
+ * @param stream the stream whose socket is connected
+ * @param port the port of the other end
+ * @return false if the tunnel cannot take the stream, which is left to the caller
+ *
+ */
+bool tunnel_session::attach(tunnel_stream::pointer stream, int port) {
+	if (isClosed || streams_.size() >= TUNNEL_MAX_STREAMS)
+		return false;
+	
+	stream->id = nextId++;
+	if (nextId == 0)
+		nextId = 1;
+	stream->port = port;
+	stream->connected = true;
+	bs::error_code ignored;
+	stream->socket.set_option(ba::ip::tcp::no_delay(true), ignored);
+	streams_[stream->id] = stream;
+	
+	char target[2] = { (char) (port >> 8), (char) port };
+	send(stream->id, TUNNEL_OPEN, target, 2);
+	return true;
+}
+
+/**
+ * Closes the tunnel and all its streams
+ *
+ */
+void tunnel_session::close() {
+	if (isClosed)
+		return;
+	isClosed = true;
+	
+	bs::error_code ignored;
+	socket_.close(ignored);
+	vector<tunnel_stream::pointer> waiting;
+	for (map<unsigned, tunnel_stream::pointer>::iterator it = streams_.begin(); it != streams_.end(); it++) {
+		if (isClient && !it->second->accepted && onRefuse_) {
+			waiting.push_back(it->second);
+			continue;
+		}
+		it->second->closed = true;
+		it->second->socket.close(ignored);
+	}
+	streams_.clear();
+	for (size_t i = 0; i < waiting.size(); i++)
+		onRefuse_(waiting[i]);
+	
+	ended onEnd;
+	onEnd.swap(onEnd_);
+	if (onEnd)
+		onEnd();
+}
+
+/**
+ * Queues a frame for the tunnel
+ * @param data true for the data frames of a stream, whose local socket is read again once the frame is written
+ *
+ */
+void tunnel_session::send(unsigned id, int type, const char* payload, size_t len, bool data) {
+	if (isClosed)
+		return;
+	
+	frames_.push_back(frame());
+	frame& f = frames_.back();
+	f.stream = data ? id : 0;
+	f.bytes.resize(TUNNEL_HEADER + len);
+	char* h = &f.bytes[0];
+	h[0] = (char) (id >> 24);
+	h[1] = (char) (id >> 16);
+	h[2] = (char) (id >> 8);
+	h[3] = (char) id;
+	h[4] = (char) type;
+	h[5] = 0;
+	h[6] = (char) (len >> 8);
+	h[7] = (char) len;
+	if (len > 0)
+		memcpy(h + TUNNEL_HEADER, payload, len);
+	flush();
+}
+
+/**
+ * Writes the queued frames to the tunnel with one gathered write
+ *
+ */
+void tunnel_session::flush() {
+	if (isWriting || isClosed || frames_.empty())
+		return;
+	
+	vector<ba::const_buffer> buffers;
+	for (size_t i = 0; i < frames_.size() && i < 64; i++)
+		buffers.push_back(ba::buffer(frames_[i].bytes));
+	writingFrames = buffers.size();
+	isWriting = true;
+	ba::async_write(socket_, buffers, boost::bind(&tunnel_session::handle_write, shared_from_this(),
+												  ba::placeholders::error));
+}
+
+void tunnel_session::handle_write(const bs::error_code& err) {
+	isWriting = false;
+	if (isClosed)
+		return;
+	if (err) {
+		HBOX_INFO("Tunnel write failed: " << err.message());
+		close();
+		return;
+	}
+	
+	vector<unsigned> written;
+	for (; writingFrames > 0; writingFrames--) {
+		if (frames_.front().stream)
+			written.push_back(frames_.front().stream);
+		frames_.pop_front();
+	}
+	for (size_t i = 0; i < written.size(); i++) {
+		map<unsigned, tunnel_stream::pointer>::iterator it = streams_.find(written[i]);
+		if (it == streams_.end())
+			continue;
+		it->second->inFlight = false;
+		start_stream_read(it->second);
+	}
+	flush();
+}
+
+/**
+ * Reads the local socket of a stream, as much as the other end has given credit for
+ *
+ */
+void tunnel_session::start_stream_read(tunnel_stream::pointer stream) {
+	if (stream->closed || !stream->accepted || stream->reading || stream->inFlight || stream->localEnd ||
+		stream->credit == 0)
+		return;
+	
+	if (stream->buffer.empty())
+		stream->buffer.resize(TUNNEL_FRAME_MAX);
+	stream->reading = true;
+	stream->socket.async_read_some(ba::buffer(&stream->buffer[0], min(stream->credit, (size_t) TUNNEL_FRAME_MAX)),
+								   boost::bind(&tunnel_session::handle_stream_read, shared_from_this(), stream,
+											   ba::placeholders::error, ba::placeholders::bytes_transferred));
+}
+
+void tunnel_session::handle_stream_read(tunnel_stream::pointer stream, const bs::error_code& err, size_t len) {
+	stream->reading = false;
+	if (stream->closed)
+		return;
+	if (err == ba::error::eof) {
+		stream->localEnd = true;
+		send(stream->id, TUNNEL_FIN, NULL, 0);
+		finish_stream(stream);
+		return;
+	}
+	if (err) {
+		reset_stream(stream, true);
+		return;
+	}
+	
+	stream->credit -= len;
+	stream->inFlight = true;
+	send(stream->id, TUNNEL_DATA, &stream->buffer[0], len, true);
+}
+
+/**
+ * Writes what the other end sent to the local socket of a stream, and passes on its end of stream once all of it
+ * is written
+ *
+ */
+void tunnel_session::flush_stream(tunnel_stream::pointer stream) {
+	if (stream->closed || !stream->connected || stream->writing)
+		return;
+	
+	if (stream->out.empty()) {
+		if (stream->peerEnd && !stream->shut) {
+			bs::error_code ignored;
+			stream->socket.shutdown(ba::ip::tcp::socket::shutdown_send, ignored);
+			stream->shut = true;
+			finish_stream(stream);
+		}
+		return;
+	}
+	
+	stream->writing = true;
+	ba::async_write(stream->socket, ba::buffer(stream->out.front()),
+					boost::bind(&tunnel_session::handle_stream_write, shared_from_this(), stream,
+								ba::placeholders::error, ba::placeholders::bytes_transferred));
+}
+
+void tunnel_session::handle_stream_write(tunnel_stream::pointer stream, const bs::error_code& err, size_t len) {
+	stream->writing = false;
+	if (stream->closed)
+		return;
+	if (err) {
+		reset_stream(stream, true);
+		return;
+	}
+	
+	stream->out.pop_front();
+	stream->queued -= len;
+	stream->written += len;
+	// give credit back in batches, the other end is not stalled before a quarter of the window is written
+	if (!stream->peerEnd && stream->written >= TUNNEL_STREAM_WINDOW / 4) {
+		char credit[4] = { (char) (stream->written >> 24), (char) (stream->written >> 16),
+						   (char) (stream->written >> 8), (char) stream->written };
+		send(stream->id, TUNNEL_WINDOW, credit, 4);
+		stream->written = 0;
+	}
+	flush_stream(stream);
+}
+
+/**
+ * Forgets a stream once both of its directions ended
+ *
+ */
+void tunnel_session::finish_stream(tunnel_stream::pointer stream) {
+	if (!stream->localEnd || !stream->shut || stream->closed)
+		return;
+	
+	bs::error_code ignored;
+	stream->closed = true;
+	stream->socket.close(ignored);
+	streams_.erase(stream->id);
+}
+
+/**
+ * Aborts a stream
+ * @param tell true to tell the other end, false if the other end aborted it
+ *
+ */
+void tunnel_session::reset_stream(tunnel_stream::pointer stream, bool tell) {
+	if (stream->closed)
+		return;
+	if (tell)
+		send(stream->id, TUNNEL_RESET, NULL, 0);
+	
+	bs::error_code ignored;
+	stream->closed = true;
+	stream->socket.close(ignored);
+	streams_.erase(stream->id);
+}
+
+/**
+ * Gives a stream the other end did not accept back to the client, which carries its connection another way.
+ * Nothing was read from its socket yet.
+ *
+ */
+void tunnel_session::refuse_stream(tunnel_stream::pointer stream) {
+	streams_.erase(stream->id);
+	if (onRefuse_) {
+		onRefuse_(stream);
+		return;
+	}
+	
+	bs::error_code ignored;
+	stream->closed = true;
+	stream->socket.close(ignored);
+}
+
+/**
+ * Creates the tunnel to a remote hbox and starts connecting it
+ * @param io_pool the I/O threads, the tunnel and its portals run on one of them
+ * @param host the address of the remote hbox
+ * @param port the tunnel port of the remote hbox
+ * @param peer the name of the remote hbox, for the metrics
+ * @param tuning the socket options of the proxies, the tunnel carries their traffic across the WAN
+ * @param dscp the code point of the tunnel. The streams of all traffic classes share its socket, so they cannot
+ * be marked apart; the tunnel is marked like the media streams which make up most of its bytes.
+ * @return the client end of the tunnel
+ *
+ */
+tunnel_client::pointer tunnel_client::create(io_service_pool& io_pool, const string& host, int port, const string& peer,
+											 const socket_tuning& tuning, int dscp) {
+	pointer client(new tunnel_client(io_pool.get_io_service(), host, port, peer, tuning, dscp));
+	client->io_service_.post(boost::bind(&tunnel_client::start_connect, client));
+	return client;
+}
+
+tunnel_client::tunnel_client(ba::io_service& io_service, const string& host, int port, const string& peer,
+							 const socket_tuning& tuning, int dscp) : io_service_(io_service),
+	resolver_(io_service),
+	retry_(io_service),
+	host(host),
+	port(port),
+	tuning(tuning),
+	dscp(dscp),
+	metrics(new proxy_metrics(port, host + ":" + boost::lexical_cast<string>(port), peer)),
+	backoff(TUNNEL_RETRY),
+	isReady(false),
+	isClosed(false) {
+	metrics->congestion = tuning.congestion;
+	metrics_registry::instance().add(metrics);
+}
+
+void tunnel_client::start_connect() {
+	ba::ip::tcp::resolver::query query(host, boost::lexical_cast<string>(port));
+	resolver_.async_resolve(query, boost::bind(&tunnel_client::handle_resolve, shared_from_this(),
+											   ba::placeholders::error, ba::placeholders::iterator));
+}
+
+void tunnel_client::handle_resolve(const bs::error_code& err, ba::ip::tcp::resolver::iterator endpoints) {
+	if (isClosed)
+		return;
+	if (err) {
+		handle_end();
+		return;
+	}
+	
+	endpoints_.assign(endpoints, ba::ip::tcp::resolver::iterator());
+	connect(0);
+}
+
+/**
+ * Connects the next candidate of the remote hbox on a socket tuned before the connect, so that its buffers decide
+ * the window scale and Fast Open can be used
+ * @param index the position of the candidate in endpoints_
+ *
+ */
+void tunnel_client::connect(size_t index) {
+	boost::weak_ptr<tunnel_client> self(shared_from_this());
+	session_ = tunnel_session::create(io_service_, true, tunnel_session::admission(),
+									  boost::bind(&tunnel_client::lost, self),
+									  boost::bind(&tunnel_client::refused, self, _1));
+	bs::error_code err;
+	session_->socket().open(endpoints_[index].protocol(), err);
+	if (!err) {
+		tuning.apply(session_->socket().native_handle(), true, *metrics);
+		mark_traffic(session_->socket(), dscp, TRAFFIC_BULK);
+	}
+	session_->socket().async_connect(endpoints_[index], boost::bind(&tunnel_client::handle_connect, shared_from_this(),
+																	ba::placeholders::error, index));
+}
+
+void tunnel_client::handle_connect(const bs::error_code& err, size_t index) {
+	if (isClosed)
+		return;
+	if (err) {
+		if (index + 1 < endpoints_.size()) {
+			connect(index + 1);
+			return;
+		}
+		HBOX_DEBUG("Cannot connect the tunnel to " << host << ":" << port << ": " << err.message());
+		metrics->connectFailures++;
+		handle_end();
+		return;
+	}
+	
+	HBOX_INFO("Tunnel to " << host << ":" << port << " is up");
+	backoff = TUNNEL_RETRY;
+	session_->start();
+	isReady = true;
+}
+
+void tunnel_client::lost(boost::weak_ptr<tunnel_client> client) {
+	pointer c = client.lock();
+	if (c)
+		c->handle_end();
+}
+
+/**
+ * The streams of the session the other end refused, or which were not accepted when the tunnel was lost
+ *
+ */
+void tunnel_client::refused(boost::weak_ptr<tunnel_client> client, tunnel_stream::pointer stream) {
+	pointer c = client.lock();
+	if (c) {
+		HBOX_DEBUG("Tunnel stream to port " << stream->port << " refused, connecting it directly");
+		c->bypass(stream);
+		return;
+	}
+	
+	bs::error_code ignored;
+	stream->socket.close(ignored);
+}
+
+/**
+ * Carries a connection of a portal directly to the remote hbox
+ *
+ */
+void tunnel_client::bypass(tunnel_stream::pointer stream) {
+	tunnel_bypass::start(io_service_, stream, host, tuning, dscp, metrics);
+}
+
+/**
+ * Connects the tunnel again after a while, the proxies connect directly in between
+ *
+ */
+void tunnel_client::handle_end() {
+	if (isReady)
+		HBOX_INFO("Tunnel to " << host << ":" << port << " is lost");
+	isReady = false;
+	session_.reset();
+	if (isClosed)
+		return;
+	
+	retry_.expires_from_now(boost::posix_time::seconds(backoff));
+	retry_.async_wait(boost::bind(&tunnel_client::handle_retry, shared_from_this(), ba::placeholders::error));
+	backoff = min(2 * backoff, TUNNEL_RETRY_MAX);
+}
+
+void tunnel_client::handle_retry(const bs::error_code& err) {
+	if (!err && !isClosed)
+		start_connect();
+}
+
+/**
+ * Closes the tunnel for good, its portals are left to the proxies which connect directly from then on. May be
+ * called from any thread.
+ *
+ */
+void tunnel_client::close() {
+	io_service_.post(boost::bind(&tunnel_client::handle_close, shared_from_this()));
+}
+
+void tunnel_client::handle_close() {
+	if (isClosed)
+		return;
+	isClosed = true;
+	isReady = false;
+	
+	bs::error_code ignored;
+	retry_.cancel(ignored);
+	resolver_.cancel();
+	if (session_)
+		session_->close();
+	session_.reset();
+}
+
+/**
+ * Accepts the next connection of a portal
+ * @param acceptor the loopback acceptor of the portal
+ * @param port the port of the remote hbox its connections are carried to
+ *
+ */
+void tunnel_client::accept(boost::shared_ptr<ba::ip::tcp::acceptor> acceptor, int port) {
+	tunnel_stream::pointer stream(new tunnel_stream(io_service_));
+	acceptor->async_accept(stream->socket, boost::bind(&tunnel_client::handle_accept, shared_from_this(), acceptor,
+													   port, stream, ba::placeholders::error));
+}
+
+void tunnel_client::handle_accept(boost::shared_ptr<ba::ip::tcp::acceptor> acceptor, int port,
+								  tunnel_stream::pointer stream, const bs::error_code& err) {
+	if (!acceptor->is_open())
+		return;
+	
+	if (!err) {
+		stream->port = port;
+		if (!session_ || !isReady || !session_->attach(stream, port))
+			bypass(stream);
+	}
+	accept(acceptor, port);
+}
+
+void tunnel_client::close_portal(boost::shared_ptr<ba::ip::tcp::acceptor> acceptor) {
+	bs::error_code ignored;
+	acceptor->close(ignored);
+}
+
+/**
+ * Connects the remote hbox for a connection of a portal, which is relayed once the connect succeeds
+ * @param io_service the thread of the portal
+ * @param stream the stream whose socket is the connection of the portal, with the port it goes to
+ * @param host the address of the remote hbox
+ * @param tuning the socket options of the tunnel
+ * @param dscp the code point of the tunnel
+ * @param metrics the metrics of the tunnel
+ *
+ */
+void tunnel_bypass::start(ba::io_service& io_service, tunnel_stream::pointer stream, const string& host,
+						  const socket_tuning& tuning, int dscp, proxy_metrics::pointer metrics) {
+	pointer bypass(new tunnel_bypass(io_service, stream, tuning, dscp, metrics));
+	ba::ip::tcp::resolver::query query(host, boost::lexical_cast<string>(stream->port));
+	bypass->resolver_.async_resolve(query, boost::bind(&tunnel_bypass::handle_resolve, bypass,
+													   ba::placeholders::error, ba::placeholders::iterator));
+}
+
+tunnel_bypass::tunnel_bypass(ba::io_service& io_service, tunnel_stream::pointer stream, const socket_tuning& tuning,
+							 int dscp, proxy_metrics::pointer metrics) : stream_(stream),
+	remote_(io_service),
+	resolver_(io_service),
+	tuning(tuning),
+	dscp(dscp),
+	metrics(metrics),
+	isClosed(false) {
+	ended_[0] = ended_[1] = false;
+}
+
+void tunnel_bypass::handle_resolve(const bs::error_code& err, ba::ip::tcp::resolver::iterator endpoints) {
+	if (err) {
+		HBOX_DEBUG("Cannot resolve the remote hbox of port " << stream_->port << ": " << err.message());
+		close();
+		return;
+	}
+	endpoints_.assign(endpoints, ba::ip::tcp::resolver::iterator());
+	connect(0);
+}
+
+/**
+ * Connects the next candidate of the remote hbox, tuned like the tunnel socket
+ * @param index the position of the candidate in endpoints_
+ *
+ */
+void tunnel_bypass::connect(size_t index) {
+	bs::error_code err;
+	remote_.close(err);
+	remote_.open(endpoints_[index].protocol(), err);
+	if (!err) {
+		tuning.apply(remote_.native_handle(), true, *metrics);
+		mark_traffic(remote_, dscp, TRAFFIC_BULK);
+	}
+	remote_.async_connect(endpoints_[index], boost::bind(&tunnel_bypass::handle_connect, shared_from_this(),
+														 ba::placeholders::error, index));
+}
+
+void tunnel_bypass::handle_connect(const bs::error_code& err, size_t index) {
+	if (err && index + 1 < endpoints_.size()) {
+		connect(index + 1);
+		return;
+	}
+	if (err) {
+		HBOX_DEBUG("Cannot connect port " << stream_->port << " of the remote hbox: " << err.message());
+		close();
+		return;
+	}
+	
+	bs::error_code ignored;
+	remote_.set_option(ba::ip::tcp::no_delay(true), ignored);
+	buffers_[0].resize(TUNNEL_FRAME_MAX);
+	buffers_[1].resize(TUNNEL_FRAME_MAX);
+	start_read(true);
+	start_read(false);
+}
+
+/**
+ * Reads one side, the portal connection or the remote hbox, once what was read before is written to the other
+ *
+ */
+void tunnel_bypass::start_read(bool fromLocal) {
+	ba::ip::tcp::socket& source = fromLocal ? stream_->socket : remote_;
+	vector<char>& buffer = buffers_[fromLocal ? 0 : 1];
+	source.async_read_some(ba::buffer(buffer), boost::bind(&tunnel_bypass::handle_read, shared_from_this(), fromLocal,
+														   ba::placeholders::error, ba::placeholders::bytes_transferred));
+}
+
+void tunnel_bypass::handle_read(bool fromLocal, const bs::error_code& err, size_t len) {
+	if (isClosed)
+		return;
+	
+	ba::ip::tcp::socket& destination = fromLocal ? remote_ : stream_->socket;
+	if (err == ba::error::eof) {
+		bs::error_code ignored;
+		destination.shutdown(ba::ip::tcp::socket::shutdown_send, ignored);
+		ended_[fromLocal ? 0 : 1] = true;
+		if (ended_[0] && ended_[1])
+			close();
+		return;
+	}
+	if (err) {
+		close();
+		return;
+	}
+	
+	ba::async_write(destination, ba::buffer(buffers_[fromLocal ? 0 : 1], len),
+					boost::bind(&tunnel_bypass::handle_write, shared_from_this(), fromLocal, ba::placeholders::error));
+}
+
+void tunnel_bypass::handle_write(bool fromLocal, const bs::error_code& err) {
+	if (isClosed)
+		return;
+	if (err) {
+		close();
+		return;
+	}
+	start_read(fromLocal);
+}
+
+void tunnel_bypass::close() {
+	if (isClosed)
+		return;
+	isClosed = true;
+	
+	bs::error_code ignored;
+	stream_->closed = true;
+	stream_->socket.close(ignored);
+	remote_.close(ignored);
+}
+
+/**
+ * Opens a portal on an ephemeral loopback port
+ * @param client the tunnel the connections of the portal are carried by
+ * @param port the port of the remote hbox they are carried to
+ *
+ */
+tunnel_portal::tunnel_portal(tunnel_client::pointer client, int port) : client_(client),
+	acceptor_(new ba::ip::tcp::acceptor(client->io_service(), ba::ip::tcp::endpoint(ba::ip::address_v4::loopback(), 0))) {
+	localPort = acceptor_->local_endpoint().port();
+	client->io_service().post(boost::bind(&tunnel_client::accept, client, acceptor_, port));
+}
+
+/**
+ * Closes the portal on the thread of its tunnel, the streams it opened go on
+ *
+ */
+tunnel_portal::~tunnel_portal() {
+	client_->io_service().post(boost::bind(&tunnel_client::close_portal, client_, acceptor_));
+}
+
+/**
+ * Opens the tunnel port and starts accepting tunnels
+ * @param io_pool the I/O threads, the tunnels are spread over them
+ * @param port the tunnel port
+ * @param tuning the socket options of the proxies, the tunnels carry their traffic across the WAN
+ * @param dscp the code point of the tunnels, see tunnel_client::create()
+ * @return the server
+ *
+ */
+tunnel_server::pointer tunnel_server::create(io_service_pool& io_pool, int port, const socket_tuning& tuning, int dscp) {
+	pointer server(new tunnel_server(io_pool, port, tuning, dscp));
+	server->io_service_.post(boost::bind(&tunnel_server::start_accept, server));
+	return server;
+}
+
+/**
+ * Opens the listener, tuned before it binds so that the tunnels it accepts inherit its buffers
+ * @throws boost::system::system_error if the port cannot be used
+ *
+ */
+tunnel_server::tunnel_server(io_service_pool& io_pool, int port, const socket_tuning& tuning, int dscp) : io_pool_(io_pool),
+	io_service_(io_pool.get_io_service()),
+	acceptor_(io_service_),
+	tuning(tuning),
+	dscp(dscp),
+	metrics(new proxy_metrics(port, "tunnel", "")) {
+	metrics->congestion = tuning.congestion;
+	metrics_registry::instance().add(metrics);
+	
+	ba::ip::tcp::endpoint endpoint(ba::ip::tcp::v4(), port);
+	acceptor_.open(endpoint.protocol());
+	acceptor_.set_option(ba::ip::tcp::acceptor::reuse_address(true));
+	tuning.listen(acceptor_.native_handle(), *metrics);
+	acceptor_.bind(endpoint);
+	acceptor_.listen();
+}
+
+void tunnel_server::start_accept() {
+	tunnel_session::pointer session = tunnel_session::create(io_pool_.get_io_service(), false,
+															 boost::bind(&tunnel_server::admit, boost::weak_ptr<tunnel_server>(shared_from_this()), _1));
+	acceptor_.async_accept(session->socket(), boost::bind(&tunnel_server::handle_accept, shared_from_this(), session,
+														  ba::placeholders::error));
+}
+
+void tunnel_server::handle_accept(tunnel_session::pointer session, const bs::error_code& err) {
+	if (!acceptor_.is_open())
+		return;
+	
+	if (!err) {
+		bs::error_code ignored;
+		HBOX_INFO("Tunnel from " << session->socket().remote_endpoint(ignored).address() << " accepted");
+		metrics->accepted++;
+		tuning.apply(session->socket().native_handle(), false, *metrics);
+		mark_traffic(session->socket(), dscp, TRAFFIC_BULK);
+		session->io_service().post(boost::bind(&tunnel_session::start, session));
+	}
+	start_accept();
+}
+
+/**
+ * Lets tunnels open streams to a proxy port
+ *
+ */
+void tunnel_server::allow(int port) {
+	lock_guard<mutex> lock(m);
+	ports_.insert(port);
+}
+
+void tunnel_server::forbid(int port) {
+	lock_guard<mutex> lock(m);
+	ports_.erase(port);
+}
+
+bool tunnel_server::admits(int port) {
+	lock_guard<mutex> lock(m);
+	return ports_.count(port) > 0;
+}
+
+/**
+ * The admission of the tunnels a server accepted, which do not keep it alive
+ *
+ */
+bool tunnel_server::admit(boost::weak_ptr<tunnel_server> server, int port) {
+	pointer s = server.lock();
+	return s && s->admits(port);
+}
+
+/**
+ * Closes the tunnel port, the tunnels already open go on. May be called from any thread.
+ *
+ */
+void tunnel_server::close() {
+	io_service_.post(boost::bind(&tunnel_server::handle_close, shared_from_this()));
+}
+
+void tunnel_server::handle_close() {
+	bs::error_code ignored;
+	acceptor_.close(ignored);
+}
@@ -0,0 +1,123 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "upstreampool.hh"
+#include "hbox.hh"
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+
+/**
+ * Constructor of upstream_pool class
+ * @param maxIdle how many idle connections are kept, 0 disables the pool
+ * @param idleTimeout seconds after which an idle connection is closed
+ *
+ */
+upstream_pool::upstream_pool(size_t maxIdle, int idleTimeout) : maxIdle(maxIdle), idleTimeout(idleTimeout) {
+}
+
+upstream_pool::~upstream_pool() {
+	for (size_t i = 0; i < idle_.size(); i++)
+		::close(idle_[i].fd);
+}
+
+/**
+ * Closes the connections which were idle for too long. The caller holds the lock.
+ *
+ */
+void upstream_pool::expire(time_t now) {
+	while (!idle_.empty() && now - idle_.front().since >= idleTimeout) {
+		::close(idle_.front().fd);
+		idle_.pop_front();
+	}
+}
+
+/**
+ * Hands the most recently parked connection over to a closed socket
+ * @param socket the socket which will own the connection
+ * @return false if there is no usable idle connection
+ *
+ */
+bool upstream_pool::acquire(ba::ip::tcp::socket& socket) {
+	lock_guard<mutex> lock(m);
+	expire(time(NULL));
+	
+	while (!idle_.empty()) {
+		idle_connection conn = idle_.back();
+		idle_.pop_back();
+		
+		// the server may have closed the connection meanwhile, or sent something nobody asked for
+		char c;
+		ssize_t n = ::recv(conn.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			bs::error_code err;
+			socket.assign(conn.v6 ? ba::ip::tcp::v6() : ba::ip::tcp::v4(), conn.fd, err);
+			if (!err) {
+				HBOX_DEBUG("Reusing an idle connection to the remote server, " << idle_.size() << " left");
+				return true;
+			}
+		}
+		::close(conn.fd);
+	}
+	
+	return false;
+}
+
+/**
+ * Parks the connection of a socket. The socket is closed in any case, its pending operations are aborted.
+ * @param socket the connected socket
+ * @return true if the connection was kept
+ *
+ */
+bool upstream_pool::release(ba::ip::tcp::socket& socket) {
+	bs::error_code err;
+	idle_connection conn;
+	conn.v6 = socket.local_endpoint(err).address().is_v6();
+	conn.fd = err ? -1 : ::dup(socket.native_handle());
+	conn.since = time(NULL);
+	socket.close(err);
+	
+	if (conn.fd < 0)
+		return false;
+	
+	lock_guard<mutex> lock(m);
+	expire(conn.since);
+	if (idle_.size() >= maxIdle) {
+		::close(conn.fd);
+		return false;
+	}
+	
+	idle_.push_back(conn);
+	return true;
+}
+
+/**
+ * @return the number of idle connections which have not expired
+ *
+ */
+size_t upstream_pool::size() {
+	lock_guard<mutex> lock(m);
+	expire(time(NULL));
+	return idle_.size();
+}
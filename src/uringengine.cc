@@ -0,0 +1,398 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "uringengine.hh"
+#include "bufferpool.hh"
+#include "hbox.hh"
+
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifndef __NR_io_uring_setup
+#undef HAVE_LINUX_IO_URING_H
+#endif
+#endif
+
+ba::io_service::id uring_engine::id;
+
+#ifdef HAVE_LINUX_IO_URING_H
+// glibc has no wrappers for the io_uring system calls
+static int uring_setup(unsigned entries, io_uring_params* params) {
+	return (int) ::syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring, unsigned submit, unsigned wait, unsigned flags) {
+	return (int) ::syscall(__NR_io_uring_enter, ring, submit, wait, flags, NULL, 0);
+}
+
+static int uring_register(int ring, unsigned op, void* arg, unsigned count) {
+	return (int) ::syscall(__NR_io_uring_register, ring, op, arg, count);
+}
+#endif
+
+/**
+ * Constructor of uring_engine class, sets up the ring. The engine is not available if that fails.
+ * @param io_service the io_service the completions are delivered on
+ *
+ */
+uring_engine::uring_engine(ba::io_service& io_service) : ba::io_service::service(io_service),
+	io_service_(io_service),
+	notifier_(io_service),
+	ring_(-1),
+	rings(NULL),
+	ringsSize(0),
+	sqes(NULL),
+	sqesSize(0),
+	queued(0),
+	isSubmitting(false),
+	sequence(0),
+	arena(NULL) {
+	if (!open()) {
+		HBOX_WARN("io_uring is not available: " << strerror(errno));
+		close();
+		return;
+	}
+	start_wait();
+}
+
+uring_engine::~uring_engine() {
+	close();
+}
+
+/**
+ * Drops the handlers of the operations still in the ring, they keep their connections alive
+ *
+ */
+void uring_engine::shutdown_service() {
+	boost::system::error_code ignored;
+	notifier_.close(ignored);
+	pending_.clear();
+}
+
+/**
+ * @return true if the kernel and the headers the hbox was built with support io_uring
+ *
+ */
+bool uring_engine::supported() {
+#ifdef HAVE_LINUX_IO_URING_H
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int ring = uring_setup(2, &params);
+	if (ring < 0)
+		return false;
+	::close(ring);
+	return (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+#else
+	return false;
+#endif
+}
+
+/**
+ * Creates the ring, maps its queues, registers the eventfd and the buffers
+ * @return false if the ring cannot be used, errno tells why
+ *
+ */
+bool uring_engine::open() {
+#ifdef HAVE_LINUX_IO_URING_H
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring_ = uring_setup(URING_ENTRIES, &params);
+	if (ring_ < 0)
+		return false;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		errno = ENOSYS; // kernels before 5.4
+		return false;
+	}
+	
+	ringsSize = max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+					params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+	rings = ::mmap(NULL, ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED) {
+		rings = NULL;
+		return false;
+	}
+	sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	void* entries = ::mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQES);
+	if (entries == MAP_FAILED)
+		return false;
+	sqes = (io_uring_sqe*) entries;
+	
+	char* base = (char*) rings;
+	sqHead = (unsigned*) (base + params.sq_off.head);
+	sqTail = (unsigned*) (base + params.sq_off.tail);
+	sqFlags = (unsigned*) (base + params.sq_off.flags);
+	sqArray = (unsigned*) (base + params.sq_off.array);
+	sqMask = *(unsigned*) (base + params.sq_off.ring_mask);
+	sqEntries = params.sq_entries;
+	cqHead = (unsigned*) (base + params.cq_off.head);
+	cqTail = (unsigned*) (base + params.cq_off.tail);
+	cqMask = *(unsigned*) (base + params.cq_off.ring_mask);
+	cqes = (io_uring_cqe*) (base + params.cq_off.cqes);
+	
+	int efd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0)
+		return false;
+	notifier_.assign(efd);
+	if (uring_register(ring_, IORING_REGISTER_EVENTFD, &efd, 1) < 0)
+		return false;
+	
+	// without registered buffers every connection uses pooled ones, e.g. when RLIMIT_MEMLOCK is too low
+	void* buffers = ::mmap(NULL, URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffers != MAP_FAILED) {
+		arena = (char*) buffers;
+		vector<iovec> iov(URING_BUFFERS);
+		for (int i = 0; i < URING_BUFFERS; i++) {
+			iov[i].iov_base = arena + i * URING_BUFFER_SIZE;
+			iov[i].iov_len = URING_BUFFER_SIZE;
+		}
+		if (uring_register(ring_, IORING_REGISTER_BUFFERS, &iov[0], URING_BUFFERS) < 0) {
+			HBOX_DEBUG("Cannot register the io_uring buffers: " << strerror(errno));
+			::munmap(arena, URING_BUFFERS * URING_BUFFER_SIZE);
+			arena = NULL;
+		}
+		else
+			for (int i = URING_BUFFERS - 1; i >= 0; i--)
+				free_.push_back(i);
+	}
+	return true;
+#else
+	errno = ENOSYS;
+	return false;
+#endif
+}
+
+void uring_engine::close() {
+	boost::system::error_code ignored;
+	notifier_.close(ignored);
+	if (ring_ >= 0)
+		::close(ring_); // the kernel cancels what is left in the ring
+	ring_ = -1;
+	
+#ifdef HAVE_LINUX_IO_URING_H
+	if (sqes)
+		::munmap(sqes, sqesSize);
+	if (rings)
+		::munmap(rings, ringsSize);
+	if (arena)
+		::munmap(arena, URING_BUFFERS * URING_BUFFER_SIZE);
+#endif
+	sqes = NULL;
+	rings = NULL;
+	arena = NULL;
+}
+
+/**
+ * Takes a registered buffer of URING_BUFFER_SIZE bytes, or a pooled buffer once they are all in use
+ * @param slot set to the index of the registered buffer, -1 for a pooled one
+ * @return the buffer
+ *
+ */
+char* uring_engine::acquire(int& slot) {
+	{
+		lock_guard<mutex> lock(m);
+		if (!free_.empty()) {
+			slot = free_.back();
+			free_.pop_back();
+			return arena + slot * URING_BUFFER_SIZE;
+		}
+	}
+	slot = -1;
+	return buffer_pool::instance().acquire(URING_BUFFER_SIZE);
+}
+
+/**
+ * Gives a buffer taken with acquire() back, no operation may use it anymore
+ * @param buffer the buffer
+ * @param slot the index of the registered buffer, -1 for a pooled one
+ *
+ */
+void uring_engine::release(char* buffer, int slot) {
+	if (slot < 0) {
+		buffer_pool::instance().release(buffer, URING_BUFFER_SIZE);
+		return;
+	}
+	lock_guard<mutex> lock(m);
+	free_.push_back(slot);
+}
+
+/**
+ * Reads from a socket into a buffer taken with acquire()
+ * @param fd the socket
+ * @param buffer where to read
+ * @param len at most this many bytes
+ * @param slot the registered buffer, -1 for a pooled one
+ * @param handler called on the thread of the io_service once the read completes
+ *
+ */
+void uring_engine::read(int fd, char* buffer, size_t len, int slot, completion handler) {
+#ifdef HAVE_LINUX_IO_URING_H
+	prepare(slot >= 0 ? IORING_OP_READ_FIXED : IORING_OP_RECV, fd, buffer, len, slot, handler);
+#else
+	(void) fd; (void) buffer; (void) len; (void) slot; (void) handler;
+#endif
+}
+
+/**
+ * Writes part of a buffer taken with acquire() to a socket
+ * @param fd the socket
+ * @param buffer what to write
+ * @param len at most this many bytes
+ * @param slot the registered buffer, -1 for a pooled one
+ * @param handler called on the thread of the io_service once the write completes
+ *
+ */
+void uring_engine::write(int fd, const char* buffer, size_t len, int slot, completion handler) {
+#ifdef HAVE_LINUX_IO_URING_H
+	prepare(slot >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_SEND, fd, buffer, len, slot, handler);
+#else
+	(void) fd; (void) buffer; (void) len; (void) slot; (void) handler;
+#endif
+}
+
+/**
+ * Fills the next submission queue entry. The entries are submitted once the running handler returns, or right
+ * away when the queue is full.
+ *
+ */
+void uring_engine::prepare(int op, int fd, const char* buffer, size_t len, int slot, completion handler) {
+#ifdef HAVE_LINUX_IO_URING_H
+	unsigned tail = *sqTail;
+	if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+		submit();
+		tail = *sqTail;
+	}
+	
+	io_uring_sqe* sqe = &sqes[tail & sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long long) (uintptr_t) buffer;
+	sqe->len = len;
+	if (slot >= 0)
+		sqe->buf_index = slot;
+	else
+		sqe->msg_flags = op == IORING_OP_SEND ? MSG_NOSIGNAL : 0;
+	sqe->user_data = ++sequence;
+	pending_[sequence] = handler;
+	
+	sqArray[tail & sqMask] = tail & sqMask;
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+	queued++;
+	
+	if (!isSubmitting) {
+		isSubmitting = true;
+		io_service_.post(boost::bind(&uring_engine::submit, this));
+	}
+#else
+	(void) op; (void) fd; (void) buffer; (void) len; (void) slot; (void) handler;
+#endif
+}
+
+/**
+ * Hands the prepared entries to the kernel with one system call
+ *
+ */
+void uring_engine::submit() {
+#ifdef HAVE_LINUX_IO_URING_H
+	isSubmitting = false;
+	while (queued > 0 && ring_ >= 0) {
+		int n = uring_enter(ring_, queued, 0, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			// EAGAIN or EBUSY: the completions are reaped first, the wait submits again
+			HBOX_DEBUG("io_uring submit deferred: " << strerror(errno));
+			return;
+		}
+		queued -= n;
+	}
+#endif
+}
+
+void uring_engine::start_wait() {
+	notifier_.async_read_some(ba::null_buffers(), boost::bind(&uring_engine::handle_wait, this, ba::placeholders::error));
+}
+
+/**
+ * Reaps the completions of the ring and calls their handlers. Operations the handlers start are submitted together
+ * afterwards.
+ *
+ */
+void uring_engine::handle_wait(const boost::system::error_code& err) {
+#ifdef HAVE_LINUX_IO_URING_H
+	if (err == ba::error::operation_aborted || ring_ < 0)
+		return;
+	
+	unsigned long long count;
+	if (::read(notifier_.native_handle(), &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		HBOX_ERROR("Cannot read the io_uring eventfd: " << strerror(errno));
+		return;
+	}
+	
+	for (;;) {
+		unsigned head = *cqHead;
+		while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+			io_uring_cqe* cqe = &cqes[head & cqMask];
+			unsigned long long key = cqe->user_data;
+			int result = cqe->res;
+			__atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+			
+			boost::unordered_map<unsigned long long, completion>::iterator it = pending_.find(key);
+			if (it == pending_.end())
+				continue;
+			completion handler;
+			handler.swap(it->second);
+			pending_.erase(it);
+			handler(result);
+		}
+		
+#ifdef IORING_SQ_CQ_OVERFLOW
+		// completions which did not fit the ring wait in the kernel until they are asked for
+		if (__atomic_load_n(sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW) {
+			uring_enter(ring_, 0, 0, IORING_ENTER_GETEVENTS);
+			continue;
+		}
+#endif
+		break;
+	}
+	
+	submit();
+	start_wait();
+#else
+	(void) err;
+#endif
+}
@@ -0,0 +1,226 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+
+#include "urlrewriter.hh"
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <boost/lexical_cast.hpp>
+#include <boost/algorithm/string.hpp>
+
+/**
+ * @param c a character of a URL
+ * @return true if c may be part of the host and port of a URL
+ *
+ */
+static bool authority_char(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr(".-:[]_%", c);
+}
+
+/**
+ * Tells whether the body of a response is text whose URLs are rewritten: documents and playlists which are not
+ * compressed
+ * @param response the response head
+ * @return true if the body is rewritten
+ *
+ */
+bool url_rewriter::rewritable(const http_head& response) {
+	if (response.status != 200)
+		return false;
+	if (response.has("Content-Encoding") && !boost::iequals(boost::trim_copy(response.get("Content-Encoding")), "identity"))
+		return false;
+	if (response.has("Transfer-Encoding") && !boost::iequals(boost::trim_copy(response.get("Transfer-Encoding")), "chunked"))
+		return false;
+	
+	string type = response.get("Content-Type");
+	return boost::istarts_with(type, "text/") || boost::icontains(type, "xml") || boost::icontains(type, "mpegurl") ||
+		   boost::icontains(type, "scpls") || boost::icontains(type, "json") || boost::icontains(type, "smil");
+}
+
+/**
+ * Rewrites the URLs of a complete text, such as a header field value
+ * @param text the text
+ * @param port the port of the remote server in its own network
+ * @param base what the scheme and authority of its URLs are replaced with
+ * @return the text with the URLs rewritten
+ *
+ */
+string url_rewriter::rewrite(const string& text, int port, const string& base) {
+	url_rewriter rewriter;
+	rewriter.start(port, base, false);
+	string out;
+	rewriter.scan(text.data(), text.size(), true, out);
+	return out;
+}
+
+/**
+ * Prepares rewriting the body of a response
+ * @param port the port of the remote server in its own network
+ * @param base what the scheme and authority of its URLs are replaced with
+ * @param chunked true if the body comes chunked, the chunk framing is taken off
+ *
+ */
+void url_rewriter::start(int port, const string& base, bool chunked) {
+	clear();
+	portText_ = boost::lexical_cast<string>(port);
+	base_ = base;
+	active_ = true;
+	state_ = chunked ? D_SIZE : D_IDENTITY;
+}
+
+void url_rewriter::clear() {
+	active_ = false;
+	state_ = D_IDENTITY;
+	remaining_ = 0;
+	line_.clear();
+	held_.clear();
+}
+
+/**
+ * Rewrites the next bytes of the body, as the response parser reports them
+ * @param data the body bytes, chunk framing included
+ * @param len number of bytes in data
+ * @param out receives the rewritten bytes which are final
+ *
+ */
+void url_rewriter::feed(const char* data, size_t len, string& out) {
+	if (state_ == D_IDENTITY) {
+		scan(data, len, false, out);
+		return;
+	}
+	
+	const char* end = data + len;
+	while (data < end) {
+		if (state_ == D_DATA) {
+			size_t n = (size_t) min((unsigned long long) (end - data), remaining_);
+			scan(data, n, false, out);
+			data += n;
+			remaining_ -= n;
+			if (remaining_ == 0)
+				state_ = D_DATA_END;
+			continue;
+		}
+		
+		char c = *data++;
+		if (state_ == D_DONE)
+			continue;
+		if (c != '\n') {
+			if (state_ != D_DATA_END)
+				line_ += c;
+			continue;
+		}
+		
+		boost::trim(line_);
+		if (state_ == D_DATA_END)
+			state_ = D_SIZE;
+		else if (state_ == D_SIZE) {
+			remaining_ = strtoull(line_.c_str(), NULL, 16);
+			state_ = remaining_ > 0 ? D_DATA : D_TRAILER;
+		}
+		else if (line_.empty())
+			state_ = D_DONE;
+		line_.clear();
+	}
+}
+
+/**
+ * Ends the body
+ * @param out receives the bytes which were held back
+ *
+ */
+void url_rewriter::finish(string& out) {
+	scan(NULL, 0, true, out);
+	clear();
+}
+
+/**
+ * Copies text to the output with the URLs of the remote server rewritten. A URL whose host and port may go on
+ * in the next bytes is held back, as is an end which may be the start of one.
+ * @param data the text
+ * @param len number of bytes in data
+ * @param last true if no more text follows
+ * @param out receives the rewritten text
+ *
+ */
+void url_rewriter::scan(const char* data, size_t len, bool last, string& out) {
+	static const char scheme[] = "http://";
+	static const size_t schemeLen = sizeof(scheme) - 1;
+	
+	string joined;
+	if (!held_.empty()) {
+		joined.swap(held_);
+		joined.append(data, len);
+		data = joined.data();
+		len = joined.size();
+	}
+	
+	const char* end = data + len;
+	const char* pos = data;
+	while (pos < end) {
+		const char* url = (const char*) memmem(pos, end - pos, scheme, schemeLen);
+		if (!url) {
+			// the end may be the start of a scheme
+			size_t keep = 0;
+			for (size_t n = min(schemeLen - 1, (size_t) (end - pos)); n > 0 && !last; n--)
+				if (memcmp(end - n, scheme, n) == 0) {
+					keep = n;
+					break;
+				}
+			out.append(pos, end - pos - keep);
+			held_.assign(end - keep, keep);
+			return;
+		}
+		
+		const char* authority = url + schemeLen;
+		const char* stop = authority;
+		while (stop < end && authority_char(*stop))
+			stop++;
+		if (stop == end && !last && (size_t) (stop - authority) <= URL_MAX_AUTHORITY) {
+			out.append(pos, url - pos);
+			held_.assign(url, end - url);
+			return;
+		}
+		
+		out.append(pos, url - pos);
+		if (matches(string(authority, stop - authority)))
+			out += base_;
+		else
+			out.append(url, stop - url);
+		pos = stop;
+	}
+}
+
+/**
+ * @param authority the host and port of a URL
+ * @return true if the URL is one of the remote server
+ *
+ */
+bool url_rewriter::matches(const string& authority) const {
+	string::size_type colon = authority.rfind(':');
+	string::size_type bracket = authority.rfind(']');
+	if (colon == string::npos || colon == 0 || (bracket != string::npos && colon < bracket))
+		return false;
+	return authority.compare(colon + 1, string::npos, portText_) == 0;
+}
@@ -0,0 +1,201 @@
+/*
+Copyright (c) 2010-2012 Aalto University
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+
+
+#include "warmup.hh"
+#include "hbox.hh"
+
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+/**
+ * Creates the warmer of a remote server and starts warming in the background
+ * @param io_service the I/O thread the warmer runs on
+ * @param context the proxy context of the remote server, whose pool the warm connections are parked in
+ * @return the warmer, which runs as long as the context is neither retired nor freed
+ *
+ */
+upstream_warmer::pointer upstream_warmer::create(ba::io_service& io_service, proxy_context::pointer context) {
+	pointer warmer(new upstream_warmer(io_service, context));
+	io_service.post(boost::bind(&upstream_warmer::start_warm, warmer));
+	return warmer;
+}
+
+upstream_warmer::upstream_warmer(ba::io_service& io_service, proxy_context::pointer context) : io_service_(io_service),
+	resolver_(io_service),
+	timer_(io_service),
+	context_(context),
+	backoff(WARMUP_RETRY),
+	filled(false),
+	lastRequests(context->metrics->requests),
+	unusedRefills(0) {
+}
+
+/**
+ * @return how many idle connections the warmer keeps, never more than the pool takes
+ *
+ */
+size_t upstream_warmer::target(const proxy_context& context) const {
+	const proxy_settings& settings = context.settings;
+	return max(0, min(settings.warmConnections, settings.upstreamPoolSize));
+}
+
+/**
+ * Connects the remote server once more if the pool holds fewer warm connections than wanted, otherwise checks
+ * again later. The candidates are found the way connections find them: the portal while the tunnel is up, else
+ * the resolver cache of the proxy, else the resolver.
+ *
+ */
+void upstream_warmer::start_warm() {
+	proxy_context::pointer context = context_.lock();
+	if (!context || context->retired || target(*context) == 0)
+		return;
+	
+	if (context->upstreams.size() >= target(*context)) {
+		// the parked connections expire after the idle timeout, the warmer replaces them
+		filled = true;
+		wait(max(1, context->settings.upstreamIdleTimeout / 4));
+		return;
+	}
+	
+	// warm connections which expire unused only load the remote server with handshakes
+	unsigned long requests = context->metrics->requests;
+	if (filled) {
+		filled = false;
+		unusedRefills = requests == lastRequests ? unusedRefills + 1 : 0;
+		lastRequests = requests;
+	}
+	if (unusedRefills > WARMUP_UNUSED_REFILLS) {
+		if (requests == lastRequests) {
+			wait(WARMUP_QUIET_CHECK);
+			return;
+		}
+		HBOX_DEBUG("Warming up " << context->forwardIP << ":" << context->forwardPort << " again, it is in use");
+		unusedRefills = 0;
+		lastRequests = requests;
+	}
+	
+	if (context->tunnel && context->tunnel->ready()) {
+		endpoints_.assign(1, ba::ip::tcp::endpoint(ba::ip::address_v4::loopback(), context->tunnel->port()));
+		start_connect(0);
+		return;
+	}
+	if (context->resolved.lookup(endpoints_)) {
+		start_connect(0);
+		return;
+	}
+	
+	HBOX_DEBUG("Warming up the path to " << context->forwardIP << ":" << context->forwardPort);
+	ba::ip::tcp::resolver::query query(context->forwardIP, boost::lexical_cast<string>(context->forwardPort));
+	resolver_.async_resolve(query, boost::bind(&upstream_warmer::handle_resolve, shared_from_this(),
+											   ba::placeholders::error, ba::placeholders::iterator));
+}
+
+void upstream_warmer::handle_resolve(const bs::error_code& err, ba::ip::tcp::resolver::iterator endpoints) {
+	proxy_context::pointer context = context_.lock();
+	if (!context || context->retired)
+		return;
+	
+	if (err) {
+		HBOX_DEBUG("Cannot resolve " << context->forwardIP << " to warm it up: " << err.message());
+		wait(backoff);
+		backoff = min(2 * backoff, WARMUP_RETRY_MAX);
+		return;
+	}
+	
+	endpoints_.assign(endpoints, ba::ip::tcp::resolver::iterator());
+	context->resolved.store(endpoints_);
+	start_connect(0);
+}
+
+/**
+ * Tries the candidates one after another, nobody waits for the warmer. Each socket is opened and tuned before it
+ * connects, like the sockets of the connections.
+ * @param index the position of the candidate in endpoints_
+ *
+ */
+void upstream_warmer::start_connect(size_t index) {
+	proxy_context::pointer context = context_.lock();
+	if (!context || context->retired)
+		return;
+	
+	socket_.reset(new ba::ip::tcp::socket(io_service_));
+	bs::error_code err;
+	socket_->open(endpoints_[index].protocol(), err);
+	if (!err) {
+		// the buffers set before the connect decide the window scale, Fast Open only pays off across the WAN
+		bool peer = !context->peer.empty() && !endpoints_[index].address().is_loopback();
+		context->settings.tuning.apply(socket_->native_handle(), peer, *context->metrics);
+	}
+	socket_->async_connect(endpoints_[index],
+						   boost::bind(&upstream_warmer::handle_connect, shared_from_this(),
+									   ba::placeholders::error, index));
+}
+
+/**
+ * Parks a connected socket in the upstream pool and remembers the candidate which answered
+ * @param err
+ * @param index the position of the candidate in endpoints_
+ *
+ */
+void upstream_warmer::handle_connect(const bs::error_code& err, size_t index) {
+	proxy_context::pointer context = context_.lock();
+	boost::shared_ptr<ba::ip::tcp::socket> socket = socket_;
+	socket_.reset();
+	if (!context || context->retired)
+		return;
+	
+	if (err) {
+		if (index + 1 < endpoints_.size()) {
+			start_connect(index + 1);
+			return;
+		}
+		HBOX_DEBUG("Cannot connect " << context->forwardIP << ":" << context->forwardPort << " to warm it up: " << err.message());
+		wait(backoff);
+		backoff = min(2 * backoff, WARMUP_RETRY_MAX);
+		return;
+	}
+	
+	backoff = WARMUP_RETRY;
+	if (endpoints_.size() > 1)
+		context->resolved.prefer(endpoints_[index]);
+	if (!context->upstreams.release(*socket)) {
+		wait(max(1, context->settings.upstreamIdleTimeout / 4));
+		return;
+	}
+	
+	context->metrics->warmed++;
+	start_warm();
+}
+
+void upstream_warmer::wait(int seconds) {
+	timer_.expires_from_now(boost::posix_time::seconds(seconds));
+	timer_.async_wait(boost::bind(&upstream_warmer::handle_wait, shared_from_this(), ba::placeholders::error));
+}
+
+void upstream_warmer::handle_wait(const bs::error_code& err) {
+	if (!err)
+		start_warm();
+}